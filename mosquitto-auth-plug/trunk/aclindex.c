@@ -0,0 +1,401 @@
+/*
+ * Copyright (c) 2014 Jan-Piet Mens <jpmens()gmail.com>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of mosquitto nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <mosquitto.h>
+#include <mosquitto_plugin.h>
+#include "aclindex.h"
+#include "uthash.h"
+#include "log.h"
+
+static struct aclnode *node_new(const char *level, size_t len)
+{
+	struct aclnode *n;
+
+	if ((n = (struct aclnode *)calloc(1, sizeof(struct aclnode))) == NULL)
+		return (NULL);
+	if ((n->level = malloc(len + 1)) == NULL) {
+		free(n);
+		return (NULL);
+	}
+	memcpy(n->level, level, len);
+	n->level[len] = 0;
+	return (n);
+}
+
+static void node_free(struct aclnode *n)
+{
+	struct aclnode *c, *tmp;
+
+	if (n == NULL)
+		return;
+
+	HASH_ITER(hh, n->children, c, tmp) {
+		HASH_DEL(n->children, c);
+		node_free(c);
+	}
+	node_free(n->plus);
+	for (c = n->slots; c; c = tmp) {
+		tmp = c->next;
+		node_free(c);
+	}
+	free(n->level);
+	free(n);
+}
+
+static int has_slot(const char *level, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 1 < len; i++)
+		if (level[i] == '%' && (level[i+1] == 'u' || level[i+1] == 'c'))
+			return (TRUE);
+	return (FALSE);
+}
+
+struct aclindex *aclindex_new(void)
+{
+	return ((struct aclindex *)calloc(1, sizeof(struct aclindex)));
+}
+
+/*
+ * Add the topic pattern of username for acc. Patterns which are not
+ * valid subscriptions are skipped, as they never match.
+ */
+
+void aclindex_add(void *index, const char *username, const char *topic, int acc)
+{
+	struct aclindex *idx = (struct aclindex *)index;
+	struct acluser *u;
+	struct aclnode *n, *c;
+	const char *t, *end;
+	size_t len;
+
+	if (!username || !topic || (acc != MOSQ_ACL_READ && acc != MOSQ_ACL_WRITE))
+		return;
+
+	HASH_FIND(hh, idx->users, username, strlen(username), u);
+	if (u == NULL) {
+		if ((u = (struct acluser *)calloc(1, sizeof(struct acluser))) == NULL)
+			return;
+		if ((u->username = strdup(username)) == NULL) {
+			free(u);
+			return;
+		}
+		HASH_ADD_KEYPTR(hh, idx->users, u->username, strlen(u->username), u);
+	}
+	if (u->root[acc - 1] == NULL && (u->root[acc - 1] = node_new("", 0)) == NULL)
+		return;
+
+	n = u->root[acc - 1];
+	for (t = topic; t; t = end ? end + 1 : NULL) {
+		end = strchr(t, '/');
+		len = end ? (size_t)(end - t) : strlen(t);
+
+		if (len == 1 && *t == '#') {
+			if (end == NULL) {
+				n->hash = TRUE;
+				idx->patterns++;
+			}
+			return;
+		}
+		if (memchr(t, '#', len) || (memchr(t, '+', len) && len != 1))
+			return;
+
+		if (len == 1 && *t == '+') {
+			if (n->plus == NULL && (n->plus = node_new(t, len)) == NULL)
+				return;
+			n = n->plus;
+		} else if (has_slot(t, len)) {
+			for (c = n->slots; c; c = c->next)
+				if (strlen(c->level) == len && memcmp(c->level, t, len) == 0)
+					break;
+			if (c == NULL) {
+				if ((c = node_new(t, len)) == NULL)
+					return;
+				c->next = n->slots;
+				n->slots = c;
+			}
+			n = c;
+		} else {
+			HASH_FIND(hh, n->children, t, len, c);
+			if (c == NULL) {
+				if ((c = node_new(t, len)) == NULL)
+					return;
+				HASH_ADD_KEYPTR(hh, n->children, c->level, len, c);
+			}
+			n = c;
+		}
+	}
+	n->terminal = TRUE;
+	idx->patterns++;
+}
+
+/*
+ * Compare a topic level with a template, as t_expand() would expand it.
+ */
+
+static int slot_matches(const char *p, const char *t, size_t len, const char *clientid, const char *username)
+{
+	size_t i = 0, l;
+	const char *s;
+
+	while (*p) {
+		if (p[0] == '%' && (p[1] == 'u' || p[1] == 'c')) {
+			s = (p[1] == 'u') ? username : clientid;
+			l = strlen(s);
+			if (i + l > len || memcmp(t + i, s, l) != 0)
+				return (FALSE);
+			i += l;
+			p += 2;
+		} else {
+			if (i >= len || t[i] != *p)
+				return (FALSE);
+			i++;
+			p++;
+		}
+	}
+	return (i == len);
+}
+
+/*
+ * Match the levels of the topic from t on (NULL when they are over)
+ * against the patterns below n. As in mosquitto_topic_matches_sub(),
+ * wildcards in the first level don't match topics beginning with `$'.
+ */
+
+static int match(struct aclnode *n, const char *t, int first, const char *clientid, const char *username)
+{
+	const char *end, *next;
+	struct aclnode *c;
+	size_t len;
+	int wild = !(first && t && *t == '$');
+
+	if (n->hash && wild)
+		return (TRUE);
+	if (t == NULL)
+		return (n->terminal);
+
+	end = strchr(t, '/');
+	len = end ? (size_t)(end - t) : strlen(t);
+	next = end ? end + 1 : NULL;
+
+	HASH_FIND(hh, n->children, t, len, c);
+	if (c && match(c, next, FALSE, clientid, username))
+		return (TRUE);
+	if (n->plus && wild && match(n->plus, next, FALSE, clientid, username))
+		return (TRUE);
+	for (c = n->slots; c; c = c->next)
+		if (slot_matches(c->level, t, len, clientid, username) &&
+		    match(c, next, FALSE, clientid, username))
+			return (TRUE);
+	return (FALSE);
+}
+
+/*
+ * Return TRUE or FALSE as the back-end's aclcheck would, or -1 if the
+ * index can't tell and the back-end has to be asked.
+ */
+
+int aclindex_check(struct aclindex *index, const char *clientid, const char *username, const char *topic, int acc)
+{
+	struct acluser *u;
+
+	if (!index || !username || !topic || (acc != MOSQ_ACL_READ && acc != MOSQ_ACL_WRITE))
+		return (-1);
+
+	clientid = (clientid) ? clientid : "";
+
+	/* These would change the levels of a pattern once expanded */
+	if (strpbrk(username, "/+#") || strpbrk(clientid, "/+#"))
+		return (-1);
+
+	/* Unknown users may have been added after the last reload */
+	HASH_FIND(hh, index->users, username, strlen(username), u);
+	if (u == NULL)
+		return (-1);
+	if (u->root[acc - 1] == NULL)
+		return (FALSE);
+
+	return match(u->root[acc - 1], topic, TRUE, clientid, username);
+}
+
+void aclindex_free(struct aclindex *index)
+{
+	struct acluser *u, *tmp;
+
+	if (index == NULL)
+		return;
+
+	HASH_ITER(hh, index->users, u, tmp) {
+		HASH_DEL(index->users, u);
+		node_free(u->root[0]);
+		node_free(u->root[1]);
+		free(u->username);
+		free(u);
+	}
+	free(index);
+}
+
+/*
+ * Build an index with the ACLs loaded from a back-end.
+ */
+
+struct aclindex *aclindex_load(void *conf, f_aclload *load)
+{
+	struct aclindex *index;
+
+	if ((index = aclindex_new()) == NULL)
+		return (NULL);
+
+	if (load(conf, MOSQ_ACL_READ, aclindex_add, index) != 0 ||
+	    load(conf, MOSQ_ACL_WRITE, aclindex_add, index) != 0) {
+		aclindex_free(index);
+		return (NULL);
+	}
+
+	_log(LOG_NOTICE, "ACL index: %lu patterns of %u users",
+		index->patterns, HASH_COUNT(index->users));
+	return (index);
+}
+
+static void *loader(void *arg)
+{
+	struct aclloader *l = (struct aclloader *)arg;
+	struct aclindex *index;
+	struct timespec ts;
+
+	if (l->thread_init)
+		l->thread_init();
+
+	pthread_mutex_lock(&l->mutex);
+	while (!l->stop) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += l->interval;
+		while (!l->stop && pthread_cond_timedwait(&l->cond, &l->mutex, &ts) != ETIMEDOUT)
+			;
+		if (l->stop)
+			break;
+		pthread_mutex_unlock(&l->mutex);
+
+		aclindex_free(__atomic_exchange_n(&l->retired, NULL, __ATOMIC_ACQ_REL));
+
+		if ((index = aclindex_load(l->conf, l->load)) != NULL) {
+			/* An index the broker didn't pick up yet is superseded */
+			aclindex_free(__atomic_exchange_n(&l->next, index, __ATOMIC_ACQ_REL));
+		} else {
+			_log(LOG_NOTICE, "ACL index: cannot load the ACLs, keeping the previous ones");
+		}
+
+		pthread_mutex_lock(&l->mutex);
+	}
+	pthread_mutex_unlock(&l->mutex);
+
+	if (l->thread_end)
+		l->thread_end();
+	return (NULL);
+}
+
+/*
+ * Start refreshing index every interval seconds with load on conf, which
+ * is a connection to the back-end for the loader only. The loader thread
+ * calls thread_init when it starts and thread_end before it exits, if not
+ * NULL. An interval of 0 keeps index as it is.
+ */
+
+struct aclloader *aclloader_start(struct aclindex *index, void *conf, f_kill *kill, f_aclload *load, f_thread *thread_init, f_thread *thread_end, time_t interval)
+{
+	struct aclloader *l;
+
+	if ((l = (struct aclloader *)calloc(1, sizeof(struct aclloader))) == NULL)
+		return (NULL);
+
+	l->current = index;
+	l->conf = conf;
+	l->kill = kill;
+	l->load = load;
+	l->thread_init = thread_init;
+	l->thread_end = thread_end;
+	l->interval = interval;
+	pthread_mutex_init(&l->mutex, NULL);
+	pthread_cond_init(&l->cond, NULL);
+
+	if (interval > 0 && pthread_create(&l->thread, NULL, loader, l) != 0) {
+		_log(LOG_NOTICE, "ACL index: cannot start the loader, the ACLs won't be refreshed");
+		l->interval = 0;
+	}
+	return (l);
+}
+
+/*
+ * Return the index to check, switching to a newly loaded one if there is.
+ */
+
+struct aclindex *aclloader_index(struct aclloader *l)
+{
+	struct aclindex *index;
+
+	if (l == NULL)
+		return (NULL);
+
+	if (__atomic_load_n(&l->next, __ATOMIC_RELAXED) != NULL &&
+	    (index = __atomic_exchange_n(&l->next, NULL, __ATOMIC_ACQ_REL)) != NULL) {
+		aclindex_free(__atomic_exchange_n(&l->retired, l->current, __ATOMIC_ACQ_REL));
+		l->current = index;
+	}
+	return (l->current);
+}
+
+void aclloader_stop(struct aclloader *l)
+{
+	if (l == NULL)
+		return;
+
+	if (l->interval > 0) {
+		pthread_mutex_lock(&l->mutex);
+		l->stop = TRUE;
+		pthread_cond_signal(&l->cond);
+		pthread_mutex_unlock(&l->mutex);
+		pthread_join(l->thread, NULL);
+	}
+	pthread_mutex_destroy(&l->mutex);
+	pthread_cond_destroy(&l->cond);
+
+	aclindex_free(l->current);
+	aclindex_free(l->next);
+	aclindex_free(l->retired);
+	if (l->conf && l->kill)
+		l->kill(l->conf);
+	free(l);
+}
@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2014 Jan-Piet Mens <jpmens()gmail.com>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of mosquitto nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <time.h>
+#include "uthash.h"
+#include "backends.h"
+
+#ifndef __ACLINDEX_H
+# define __ACLINDEX_H
+
+/*
+ * In-memory index of all the ACLs of a back-end: for every user and
+ * access, a trie of the topic patterns with one level per node. `+' and
+ * `#' are nodes of their own, and levels containing %u or %c are kept as
+ * templates which are compared with the username and clientid while
+ * matching, so that a check walks the topic once without building any
+ * string.
+ */
+
+struct aclnode {
+	char *level;			/* literal or %u/%c template */
+	UT_hash_handle hh;		/* in the parent's children */
+	struct aclnode *children;	/* literal levels */
+	struct aclnode *plus;
+	struct aclnode *slots;		/* levels with %u or %c */
+	struct aclnode *next;		/* next slot of the parent */
+	int terminal;			/* a pattern ends here */
+	int hash;			/* a pattern ends here with `#' */
+};
+
+struct acluser {
+	char *username;
+	struct aclnode *root[2];	/* MOSQ_ACL_READ, MOSQ_ACL_WRITE */
+	UT_hash_handle hh;
+};
+
+struct aclindex {
+	struct acluser *users;
+	unsigned long patterns;
+};
+
+/*
+ * The index is rebuilt every `interval' seconds by a thread, using a
+ * connection to the back-end of its own. The new index is handed to the
+ * broker's thread through `next' and the one it replaces goes back to
+ * the loader through `retired', so that neither building nor freeing an
+ * index happens during a check.
+ */
+
+struct aclloader {
+	struct aclindex *current;	/* only used by the broker's thread */
+	struct aclindex *next;
+	struct aclindex *retired;
+	void *conf;
+	f_kill *kill;
+	f_aclload *load;
+	f_thread *thread_init;		/* optional, called by the loader */
+	f_thread *thread_end;
+	time_t interval;
+	int stop;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+struct aclindex *aclindex_new(void);
+void aclindex_add(void *index, const char *username, const char *topic, int acc);
+int aclindex_check(struct aclindex *index, const char *clientid, const char *username, const char *topic, int acc);
+void aclindex_free(struct aclindex *index);
+struct aclindex *aclindex_load(void *conf, f_aclload *load);
+
+struct aclloader *aclloader_start(struct aclindex *index, void *conf, f_kill *kill, f_aclload *load, f_thread *thread_init, f_thread *thread_end, time_t interval);
+struct aclindex *aclloader_index(struct aclloader *loader);
+void aclloader_stop(struct aclloader *loader);
+
+#endif
@@ -31,6 +31,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <openssl/evp.h>
+#include <openssl/rand.h>
 #include <mosquitto.h>
 #include <mosquitto_plugin.h>
 #include <fnmatch.h>
@@ -53,6 +54,7 @@
 
 #include "userdata.h"
 #include "cache.h"
+#include "aclindex.h"
 
 #define STRINGIFY(x) #x
 #define TOSTRING(x) STRINGIFY(x)
@@ -78,6 +80,10 @@ struct backend_p {
 	f_getuser *getuser;
 	f_superuser *superuser;
 	f_aclcheck *aclcheck;
+	f_init *init;
+	f_aclload *aclload;		/* load all the ACLs, for the ACL index */
+	f_thread *thread_init;		/* set up/tear down a thread using the */
+	f_thread *thread_end;		/* back-end, e.g. the ACL loader */
 };
 
 int pbkdf2_check(char *password, char *hash);
@@ -118,7 +124,11 @@ int mosquitto_auth_plugin_init(void **userdata, struct mosquitto_auth_opt *auth_
 	ud->fallback_be = -1;
 	ud->anonusername = strdup("anonymous");
 	ud->cacheseconds = 300;
+	ud->cachesize = 100000;
 	ud->aclcache = NULL;
+	ud->authcacheseconds = 300;
+	ud->authcachesize = 10000;
+	ud->authcache = NULL;
 
 	/*
 	 * Shove all options Mosquitto gives the plugin into a hash,
@@ -139,12 +149,23 @@ int mosquitto_auth_plugin_init(void **userdata, struct mosquitto_auth_opt *auth_
 		}
 		if (!strcmp(o->key, "cacheseconds"))
 			ud->cacheseconds = atol(o->value);
+		if (!strcmp(o->key, "cachesize"))
+			ud->cachesize = strtoul(o->value, NULL, 10);
+		if (!strcmp(o->key, "authcacheseconds"))
+			ud->authcacheseconds = atol(o->value);
+		if (!strcmp(o->key, "authcachesize"))
+			ud->authcachesize = strtoul(o->value, NULL, 10);
 #if 0
 		if (!strcmp(o->key, "topic_prefix"))
 			ud->topicprefix = strdup(o->value);
 #endif
 	}
 
+	if (ud->authcacheseconds > 0 && RAND_bytes(ud->authkey, sizeof(ud->authkey)) != 1) {
+		_log(LOG_NOTICE, "Cannot generate the authentication cache key: cache disabled");
+		ud->authcacheseconds = 0;
+	}
+
 	/*
 	 * Set up back-ends, and tell them to initialize themselves.
 	 */
@@ -159,7 +180,7 @@ int mosquitto_auth_plugin_init(void **userdata, struct mosquitto_auth_opt *auth_
 
         _log(LOG_NOTICE, "** Configured order: %s\n", p);
 
-	ud->be_list = (struct backend_p **)malloc((sizeof (struct backend_p *)) * (NBACKENDS + 1));
+	ud->be_list = (struct backend_p **)calloc(NBACKENDS + 1, sizeof (struct backend_p *));
 
 	bep = ud->be_list;
 	nord = 0;
@@ -177,8 +198,7 @@ int mosquitto_auth_plugin_init(void **userdata, struct mosquitto_auth_opt *auth_
 	}
 
 	pskbep = bep;
-	*pskbep = (struct backend_p *)malloc(sizeof(struct backend_p));
-	memset(*pskbep, 0, sizeof(struct backend_p));
+	*pskbep = (struct backend_p *)calloc(1, sizeof(struct backend_p));
 	(*pskbep)->name = strdup("psk");
 
 	bep = pskbep;
@@ -190,8 +210,7 @@ int mosquitto_auth_plugin_init(void **userdata, struct mosquitto_auth_opt *auth_
                 int found = 0;
 #if BE_MYSQL
 		if (!strcmp(q, "mysql")) {
-			*bep = (struct backend_p *)malloc(sizeof(struct backend_p));
-			memset(*bep, 0, sizeof(struct backend_p));
+			*bep = (struct backend_p *)calloc(1, sizeof(struct backend_p));
 			(*bep)->name = strdup("mysql");
 			(*bep)->conf = be_mysql_init();
 			if ((*bep)->conf == NULL) {
@@ -201,6 +220,10 @@ int mosquitto_auth_plugin_init(void **userdata, struct mosquitto_auth_opt *auth_
 			(*bep)->getuser =  be_mysql_getuser;
 			(*bep)->superuser =  be_mysql_superuser;
 			(*bep)->aclcheck =  be_mysql_aclcheck;
+			(*bep)->init =  be_mysql_init;
+			(*bep)->aclload =  be_mysql_aclload;
+			(*bep)->thread_init =  be_mysql_thread_init;
+			(*bep)->thread_end =  be_mysql_thread_end;
 			found = 1;
 			ud->fallback_be = ud->fallback_be == -1 ? nord : ud->fallback_be;
 			PSKSETUP;
@@ -209,8 +232,7 @@ int mosquitto_auth_plugin_init(void **userdata, struct mosquitto_auth_opt *auth_
 
 #if BE_POSTGRES
 		if (!strcmp(q, "postgres")) {
-			*bep = (struct backend_p *)malloc(sizeof(struct backend_p));
-			memset(*bep, 0, sizeof(struct backend_p));
+			*bep = (struct backend_p *)calloc(1, sizeof(struct backend_p));
 			(*bep)->name = strdup("postgres");
 			(*bep)->conf = be_pg_init();
 			if ((*bep)->conf == NULL) {
@@ -220,6 +242,8 @@ int mosquitto_auth_plugin_init(void **userdata, struct mosquitto_auth_opt *auth_
 			(*bep)->getuser = be_pg_getuser;
 			(*bep)->superuser = be_pg_superuser;
 			(*bep)->aclcheck = be_pg_aclcheck;
+			(*bep)->init = be_pg_init;
+			(*bep)->aclload = be_pg_aclload;
 			found = 1;
 			ud->fallback_be = ud->fallback_be == -1 ? nord : ud->fallback_be;
 			PSKSETUP;
@@ -228,8 +252,7 @@ int mosquitto_auth_plugin_init(void **userdata, struct mosquitto_auth_opt *auth_
 
 #if BE_LDAP
 		if (!strcmp(q, "ldap")) {
-			*bep = (struct backend_p *)malloc(sizeof(struct backend_p));
-			memset(*bep, 0, sizeof(struct backend_p));
+			*bep = (struct backend_p *)calloc(1, sizeof(struct backend_p));
 			(*bep)->name = strdup("ldap");
 			(*bep)->conf = be_ldap_init();
 			if ((*bep)->conf == NULL) {
@@ -247,8 +270,7 @@ int mosquitto_auth_plugin_init(void **userdata, struct mosquitto_auth_opt *auth_
 
 #if BE_CDB
 		if (!strcmp(q, "cdb")) {
-			*bep = (struct backend_p *)malloc(sizeof(struct backend_p));
-			memset(*bep, 0, sizeof(struct backend_p));
+			*bep = (struct backend_p *)calloc(1, sizeof(struct backend_p));
 			(*bep)->name = strdup("cdb");
 			(*bep)->conf = be_cdb_init();
 			if ((*bep)->conf == NULL) {
@@ -266,8 +288,7 @@ int mosquitto_auth_plugin_init(void **userdata, struct mosquitto_auth_opt *auth_
 
 #if BE_SQLITE
 		if (!strcmp(q, "sqlite")) {
-			*bep = (struct backend_p *)malloc(sizeof(struct backend_p));
-			memset(*bep, 0, sizeof(struct backend_p));
+			*bep = (struct backend_p *)calloc(1, sizeof(struct backend_p));
 			(*bep)->name = strdup("sqlite");
 			(*bep)->conf = be_sqlite_init();
 			if ((*bep)->conf == NULL) {
@@ -285,8 +306,7 @@ int mosquitto_auth_plugin_init(void **userdata, struct mosquitto_auth_opt *auth_
 
 #if BE_REDIS
 		if (!strcmp(q, "redis")) {
-			*bep = (struct backend_p *)malloc(sizeof(struct backend_p));
-			memset(*bep, 0, sizeof(struct backend_p));
+			*bep = (struct backend_p *)calloc(1, sizeof(struct backend_p));
 			(*bep)->name = strdup("redis");
 			(*bep)->conf = be_redis_init();
 			if ((*bep)->conf == NULL) {
@@ -304,8 +324,7 @@ int mosquitto_auth_plugin_init(void **userdata, struct mosquitto_auth_opt *auth_
 
 #if BE_HTTP
 		if (!strcmp(q, "http")) {
-			*bep = (struct backend_p *)malloc(sizeof(struct backend_p));
-			memset(*bep, 0, sizeof(struct backend_p));
+			*bep = (struct backend_p *)calloc(1, sizeof(struct backend_p));
 			(*bep)->name = strdup("http");
 			(*bep)->conf = be_http_init();
 			if ((*bep)->conf == NULL) {
@@ -323,8 +342,7 @@ int mosquitto_auth_plugin_init(void **userdata, struct mosquitto_auth_opt *auth_
 
 #if BE_MONGO
 		if (!strcmp(q, "mongo")) {
-			*bep = (struct backend_p *)malloc(sizeof(struct backend_p));
-			memset(*bep, 0, sizeof(struct backend_p));
+			*bep = (struct backend_p *)calloc(1, sizeof(struct backend_p));
 			(*bep)->name = strdup("mongo");
 			(*bep)->conf = be_mongo_init();
 			if ((*bep)->conf == NULL) {
@@ -348,6 +366,34 @@ int mosquitto_auth_plugin_init(void **userdata, struct mosquitto_auth_opt *auth_
 
         free(p);
 
+	/*
+	 * Load the ACLs of the first back-end which can, if configured to,
+	 * and keep them up to date.
+	 */
+
+	ud->aclindex_be = -1;
+	if (p_stab("aclloadquery") != NULL) {
+		for (nord = 0, bep = ud->be_list; bep && *bep; bep++, nord++) {
+			if ((*bep)->aclload != NULL)
+				break;
+		}
+		if (bep && *bep) {
+			struct aclindex *index;
+			time_t interval = p_stab("aclrefresh") ? atol(p_stab("aclrefresh")) : 60;
+			void *conf = NULL;
+
+			if ((index = aclindex_load((*bep)->conf, (*bep)->aclload)) == NULL) {
+				_fatal("Cannot load the ACLs from %s", (*bep)->name);
+			}
+			if (interval > 0 && (conf = (*bep)->init()) == NULL) {
+				_fatal("%s init returns NULL", (*bep)->name);
+			}
+			ud->aclloader = aclloader_start(index, conf, (*bep)->kill, (*bep)->aclload,
+				(*bep)->thread_init, (*bep)->thread_end, interval);
+			ud->aclindex_be = nord;
+		}
+	}
+
 	return (ret);
 }
 
@@ -359,14 +405,8 @@ int mosquitto_auth_plugin_cleanup(void *userdata, struct mosquitto_auth_opt *aut
 		free(ud->superusers);
 	if (ud->anonusername)
 		free(ud->anonusername);
-	if (ud->aclcache != NULL) {
-		struct aclcache *a, *tmp;
-
-		HASH_ITER(hh, ud->aclcache, a, tmp) {
-			HASH_DEL(ud->aclcache, a);
-			free(a);
-		}
-	}
+	cache_free(ud);
+	aclloader_stop(ud->aclloader);
 
 	free(ud);
 
@@ -415,7 +455,12 @@ int mosquitto_auth_unpwd_check(void *userdata, const char *username, const char
 			break;
 		}
 		if (phash != NULL) {
-			match = pbkdf2_check((char *)password, phash);
+			match = auth_cache_q(username, password, phash, nord, userdata);
+			if (match != 1) {
+				match = pbkdf2_check((char *)password, phash);
+				if (match == 1)
+					auth_cache(username, password, phash, nord, userdata);
+			}
 			if (match == 1) {
 				authenticated = TRUE;
 				/* Mark backend index in userdata so we can check
@@ -523,7 +568,13 @@ int mosquitto_auth_acl_check(void *userdata, const char *clientid, const char *u
 	}
 
 
-	match = (*bep)->aclcheck((*bep)->conf, clientid, username, topic, access);
+	match = -1;
+	if (nord == ud->aclindex_be) {
+		match = aclindex_check(aclloader_index(ud->aclloader), clientid, username, topic, access);
+	}
+	if (match == -1) {
+		match = (*bep)->aclcheck((*bep)->conf, clientid, username, topic, access);
+	}
 	if (match == 1) {
 		authorized = TRUE;
 	}
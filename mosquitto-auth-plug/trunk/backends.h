@@ -41,6 +41,10 @@ typedef void (f_kill)(void *conf);
 typedef char *(f_getuser)(void *conf, const char *username, const char *password, int *authenticated);
 typedef int (f_superuser)(void *conf, const char *username);
 typedef int (f_aclcheck)(void *conf, const char *clientid, const char *username, const char *topic, int acc);
+typedef void (f_acladd)(void *index, const char *username, const char *topic, int acc);
+typedef int (f_aclload)(void *conf, int acc, f_acladd *add, void *index);
+typedef void *(f_init)();
+typedef void (f_thread)(void);
 
 void t_expand(const char *clientid, const char *username, char *in, char **res);
 
@@ -40,7 +40,6 @@
 
 static int get_string_envs(CURL *curl, const char *required_env, char *querystring)
 {
-	char *data;
 	char *escaped_key;
 	char *escaped_val;
 	char *env_string;
@@ -50,146 +49,172 @@ static int get_string_envs(CURL *curl, const char *required_env, char *querystri
 	char *env_value[MAXPARAMSNUM];
 	int i, num = 0;
 
-	//_log(LOG_DEBUG, "sys_envs=%s", sys_envs);
-
-	env_string = (char *)malloc( strlen(required_env) + 20);
+	env_string = strdup(required_env);
 	if (env_string == NULL) {
 		_fatal("ENOMEM");
 		return (-1);
 	}
-	sprintf(env_string, "%s", required_env);
-
-	//_log(LOG_DEBUG, "env_string=%s", env_string);
 
 	num = get_sys_envs(env_string, ",", "=", params_key, env_names, env_value);
-	//sprintf(querystring, "");
+	*querystring = 0;
 	for( i = 0; i < num; i++ ){
 		escaped_key = curl_easy_escape(curl, params_key[i], 0);
 		escaped_val = curl_easy_escape(curl, env_value[i], 0);
 
-		//_log(LOG_DEBUG, "key=%s", params_key[i]);
-		//_log(LOG_DEBUG, "escaped_key=%s", escaped_key);
-		//_log(LOG_DEBUG, "escaped_val=%s", escaped_envvalue);
-
-		data = (char *)malloc(strlen(escaped_key) + strlen(escaped_val) + 1);
-		if ( data == NULL ) {
-			_fatal("ENOMEM");
-			return (-1);
-		}
-		sprintf(data, "%s=%s&", escaped_key, escaped_val);
-		if ( i == 0 ) {
-			sprintf(querystring, "%s", data);
-		} else {
-			strcat(querystring, data);
+		if (strlen(querystring) + strlen(escaped_key) + strlen(escaped_val) + 2 < MAXPARAMSLEN) {
+			strcat(querystring, escaped_key);
+			strcat(querystring, "=");
+			strcat(querystring, escaped_val);
+			strcat(querystring, "&");
 		}
+
+		curl_free(escaped_key);
+		curl_free(escaped_val);
 	}
 
-	free(data);
-	free(escaped_key);
-	free(escaped_val);
 	free(env_string);
-	//free(params_key);
-	//free(env_names);
-	//free(env_value);
 	return (num);
 }
 
-static int http_post(void *handle, char *uri, const char *clientid, const char *username, const char *password, const char *topic, int acc, int method)
+/*
+ * Format the parameters of method from the environment, once.
+ */
+
+static char *mkparams(struct http_backend *conf, const char *envs)
 {
-	struct http_backend *conf = (struct http_backend *)handle;
-	CURL *curl;
-	struct curl_slist *headerlist=NULL;
-	int re;
-	int respCode = 0;
-	int ok = FALSE;
-	char *url;
-	char *data;
+	char *params = (char *)malloc(MAXPARAMSLEN);
 
-	if (username == NULL) {
-		return (FALSE);
+	if (params == NULL) {
+		_fatal("ENOMEM");
+		return (NULL);
 	}
-
-	clientid = (clientid && *clientid) ? clientid : "";
-	password = (password && *password) ? password : "";
-	topic    = (topic && *topic) ? topic : "";
-
-	if ((curl = curl_easy_init()) == NULL) {
-		_fatal("create curl_easy_handle fails");
-		return (FALSE);
+	*params = 0;
+	if (envs != NULL && get_string_envs(conf->curl, envs, params) == -1) {
+		free(params);
+		return (NULL);
 	}
-	if (conf->hostheader != NULL)
-		curl_slist_append(headerlist, conf->hostheader);
-	curl_slist_append(headerlist, "Expect:");
+	return (params);
+}
 
-	//_log(LOG_NOTICE, "u=%s p=%s t=%s acc=%d", username, password, topic, acc);
+static char *mkurl(struct http_backend *conf, const char *uri)
+{
+	char *url = (char *)malloc(strlen(conf->ip) + strlen(uri) + 20);
 
-	url = (char *)malloc(strlen(conf->ip) + strlen(uri) + 20);
 	if (url == NULL) {
 		_fatal("ENOMEM");
-		return (FALSE);
+		return (NULL);
 	}
-	
+
 	// enable the https
 	if (strcmp(conf->with_tls, "true") == 0){
 		sprintf(url, "https://%s:%d%s", conf->ip, conf->port, uri);
 	}else{
 		sprintf(url, "http://%s:%d%s", conf->ip, conf->port, uri);
 	}
+	return (url);
+}
 
-	char* escaped_username = curl_easy_escape(curl, username, 0);
-	char* escaped_password = curl_easy_escape(curl, password, 0);
-	char* escaped_topic = curl_easy_escape(curl, topic, 0);
-	char* escaped_clientid = curl_easy_escape(curl, clientid, 0);
+/*
+ * Append s to the request body, escaped as curl_easy_escape() does.
+ */
 
-	char string_acc[20];
-	snprintf(string_acc, 20, "%d", acc);
+static size_t escape(struct http_backend *conf, size_t len, const char *s)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	size_t need = len + strlen(s) * 3 + 32;
 
-	char *string_envs = (char *)malloc(MAXPARAMSLEN);
-	if (string_envs == NULL) {
-		_fatal("ENOMEM");
-		return (FALSE);
+	if (need > conf->datasize) {
+		char *data = (char *)realloc(conf->data, need * 2);
+
+		if (data == NULL) {
+			_fatal("ENOMEM");
+			return (len);
+		}
+		conf->data = data;
+		conf->datasize = need * 2;
 	}
 
-	memset(string_envs, 0, MAXPARAMSLEN);
+	for (; *s; s++) {
+		unsigned char c = *s;
 
-	//get the sys_env from here
-	int env_num = 0;
-	if ( method == METHOD_GETUSER && conf->getuser_envs != NULL ){
-		env_num = get_string_envs(curl, conf->getuser_envs, string_envs);
-	}else if ( method == METHOD_SUPERUSER && conf->superuser_envs != NULL ){
-		env_num = get_string_envs(curl, conf->superuser_envs, string_envs);
-	} else if ( method == METHOD_ACLCHECK && conf->aclcheck_envs != NULL ){
-		env_num = get_string_envs(curl, conf->aclcheck_envs, string_envs);
+		if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+		    (c >= '0' && c <= '9') || c == '-' || c == '.' || c == '_' || c == '~') {
+			conf->data[len++] = c;
+		} else {
+			conf->data[len++] = '%';
+			conf->data[len++] = hex[c >> 4];
+			conf->data[len++] = hex[c & 0x0f];
+		}
 	}
-	if( env_num == -1 ){
-		return (FALSE);
+	conf->data[len] = 0;
+	return (len);
+}
+
+static size_t append(struct http_backend *conf, size_t len, const char *s)
+{
+	size_t slen = strlen(s);
+
+	if (len + slen + 1 > conf->datasize) {
+		char *data = (char *)realloc(conf->data, (len + slen + 1) * 2);
+
+		if (data == NULL) {
+			_fatal("ENOMEM");
+			return (len);
+		}
+		conf->data = data;
+		conf->datasize = (len + slen + 1) * 2;
 	}
-	//---- over ----
+	memcpy(conf->data + len, s, slen + 1);
+	return (len + slen);
+}
 
-	data = (char *)malloc(strlen(string_envs) + strlen(escaped_username) + strlen(escaped_password) + strlen(escaped_topic) + strlen(string_acc) + strlen(escaped_clientid) + 50);
-	if (data == NULL) {
-		_fatal("ENOMEM");
+static int http_post(void *handle, char *url, const char *clientid, const char *username, const char *password, const char *topic, int acc, int method)
+{
+	struct http_backend *conf = (struct http_backend *)handle;
+	CURL *curl = conf->curl;
+	int re;
+	long respCode = 0, connects = 0;
+	int ok = FALSE;
+	char string_acc[20];
+	size_t len;
+
+	if (username == NULL) {
 		return (FALSE);
 	}
-	sprintf(data, "%susername=%s&password=%s&topic=%s&acc=%s&clientid=%s",
-		string_envs,
-		escaped_username,
-		escaped_password,
-		escaped_topic,
-		string_acc,
-		clientid);
+
+	clientid = (clientid && *clientid) ? clientid : "";
+	password = (password && *password) ? password : "";
+	topic    = (topic && *topic) ? topic : "";
+
+	//_log(LOG_NOTICE, "u=%s p=%s t=%s acc=%d", username, password, topic, acc);
+
+	snprintf(string_acc, 20, "%d", acc);
+
+	len = append(conf, 0, (method == METHOD_GETUSER) ? conf->getuser_params :
+		(method == METHOD_SUPERUSER) ? conf->superuser_params : conf->aclcheck_params);
+	len = append(conf, len, "username=");
+	len = escape(conf, len, username);
+	len = append(conf, len, "&password=");
+	len = escape(conf, len, password);
+	len = append(conf, len, "&topic=");
+	len = escape(conf, len, topic);
+	len = append(conf, len, "&acc=");
+	len = append(conf, len, string_acc);
+	len = append(conf, len, "&clientid=");
+	len = escape(conf, len, clientid);
 
 	//_log(LOG_DEBUG, "url=%s", url);
-	//_log(LOG_DEBUG, "data=%s", data);
+	//_log(LOG_DEBUG, "data=%s", conf->data);
 	// curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
 
 	curl_easy_setopt(curl, CURLOPT_URL, url);
-	curl_easy_setopt(curl, CURLOPT_POST, 1L);
-	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, data);
-	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headerlist);
-	curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10);
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, conf->data);
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)len);
 
+	conf->requests++;
 	re = curl_easy_perform(curl);
+	if (curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects) == CURLE_OK)
+		conf->connects += connects;
 	if (re == CURLE_OK) {
 		re = curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &respCode);
 		if (re == CURLE_OK && respCode == 200) {
@@ -201,15 +226,6 @@ static int http_post(void *handle, char *uri, const char *clientid, const char *
 	  //_log(LOG_DEBUG, "http req fail url=%s re=%s", url, curl_easy_strerror(re));
 	}
 
-	curl_easy_cleanup(curl);
-	curl_slist_free_all (headerlist);
-	free(url);
-	free(data);
-	free(string_envs);
-	free(escaped_username);
-	free(escaped_password);
-	free(escaped_topic);
-	free(escaped_clientid);
 	return (ok);
 }
 
@@ -244,10 +260,15 @@ void *be_http_init()
 	}
 
 	conf = (struct http_backend *)malloc(sizeof(struct http_backend));
+	if (conf == NULL) {
+		_fatal("ENOMEM");
+		return (NULL);
+	}
+	memset(conf, 0, sizeof(struct http_backend));
 	conf->ip = ip;
 	conf->port = p_stab("http_port") == NULL ? 80 : atoi(p_stab("http_port"));
 	if (p_stab("http_hostname") != NULL) {
-		conf->hostheader = (char *)malloc(128);
+		conf->hostheader = (char *)malloc(strlen(p_stab("http_hostname")) + 10);
 		sprintf(conf->hostheader, "Host: %s", p_stab("http_hostname"));
 	} else {
 		conf->hostheader = NULL;
@@ -255,6 +276,7 @@ void *be_http_init()
 	conf->getuser_uri = getuser_uri;
 	conf->superuser_uri = superuser_uri;
 	conf->aclcheck_uri = aclcheck_uri;
+	conf->superacl_uri = p_stab("http_superacl_uri");
 
 	conf->getuser_envs = p_stab("http_getuser_params");
 	conf->superuser_envs = p_stab("http_superuser_params");
@@ -266,10 +288,42 @@ void *be_http_init()
 		conf->with_tls = "false";
 	}
 
+	if ((conf->curl = curl_easy_init()) == NULL) {
+		_fatal("create curl_easy_handle fails");
+		return (NULL);
+	}
+	if (conf->hostheader != NULL)
+		conf->headers = curl_slist_append(conf->headers, conf->hostheader);
+	conf->headers = curl_slist_append(conf->headers, "Expect:");
+
+	curl_easy_setopt(conf->curl, CURLOPT_POST, 1L);
+	curl_easy_setopt(conf->curl, CURLOPT_HTTPHEADER, conf->headers);
+	curl_easy_setopt(conf->curl, CURLOPT_TIMEOUT, 10L);
+	curl_easy_setopt(conf->curl, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(conf->curl, CURLOPT_TCP_KEEPALIVE, 1L);
+	curl_easy_setopt(conf->curl, CURLOPT_TCP_NODELAY, 1L);
+
+	conf->getuser_url = mkurl(conf, getuser_uri);
+	conf->superuser_url = mkurl(conf, superuser_uri);
+	conf->aclcheck_url = mkurl(conf, conf->superacl_uri ? conf->superacl_uri : aclcheck_uri);
+	conf->getuser_params = mkparams(conf, conf->getuser_envs);
+	conf->superuser_params = mkparams(conf, conf->superuser_envs);
+	conf->aclcheck_params = mkparams(conf, conf->aclcheck_envs);
+	if (!conf->getuser_url || !conf->superuser_url || !conf->aclcheck_url ||
+	    !conf->getuser_params || !conf->superuser_params || !conf->aclcheck_params)
+		return (NULL);
+
+	conf->datasize = MAXPARAMSLEN;
+	if ((conf->data = (char *)malloc(conf->datasize)) == NULL) {
+		_fatal("ENOMEM");
+		return (NULL);
+	}
+
 	_log(LOG_DEBUG, "with_tls=%s", conf->with_tls);
 	_log(LOG_DEBUG, "getuser_uri=%s", getuser_uri);
 	_log(LOG_DEBUG, "superuser_uri=%s", superuser_uri);
 	_log(LOG_DEBUG, "aclcheck_uri=%s", aclcheck_uri);
+	_log(LOG_DEBUG, "superacl_uri=%s", conf->superacl_uri ? conf->superacl_uri : "");
 	_log(LOG_DEBUG, "getuser_params=%s", conf->getuser_envs);
 	_log(LOG_DEBUG, "superuser_params=%s", conf->superuser_envs);
 	_log(LOG_DEBUG, "aclcheck_paramsi=%s", conf->aclcheck_envs);
@@ -281,7 +335,19 @@ void be_http_destroy(void *handle)
 	struct http_backend *conf = (struct http_backend *)handle;
 
 	if (conf) {
+		_log(LOG_NOTICE, "http: %lu requests on %lu connections",
+			conf->requests, conf->connects);
+		curl_easy_cleanup(conf->curl);
+		curl_slist_free_all(conf->headers);
 		curl_global_cleanup();
+		free(conf->hostheader);
+		free(conf->getuser_url);
+		free(conf->superuser_url);
+		free(conf->aclcheck_url);
+		free(conf->getuser_params);
+		free(conf->superuser_params);
+		free(conf->aclcheck_params);
+		free(conf->data);
 		free(conf);
 	}
 };
@@ -292,24 +358,32 @@ char *be_http_getuser(void *handle, const char *username, const char *password,
 	if (username == NULL) {
 		return NULL;
 	}
-	re = http_post(handle, conf->getuser_uri, NULL, username, password, NULL, -1, METHOD_GETUSER);
+	re = http_post(handle, conf->getuser_url, NULL, username, password, NULL, -1, METHOD_GETUSER);
 	if (re == 1) {
 		*authenticated = 1;
 	}
 	return NULL;
 };
 
+/*
+ * With `http_superacl_uri', superusers are resolved by the server together
+ * with the ACL check, so they don't cost a request of their own.
+ */
+
 int be_http_superuser(void *handle, const char *username)
 {
 	struct http_backend *conf = (struct http_backend *)handle;
 
-	return http_post(handle, conf->superuser_uri, NULL, username, NULL, NULL, -1, METHOD_SUPERUSER);
+	if (conf->superacl_uri != NULL)
+		return (FALSE);
+
+	return http_post(handle, conf->superuser_url, NULL, username, NULL, NULL, -1, METHOD_SUPERUSER);
 };
 
 int be_http_aclcheck(void *handle, const char *clientid, const char *username, const char *topic, int acc)
 {
 	struct http_backend *conf = (struct http_backend *)handle;
 
-	return http_post(conf, conf->aclcheck_uri, clientid, username, NULL, topic, acc, METHOD_ACLCHECK);
+	return http_post(conf, conf->aclcheck_url, clientid, username, NULL, topic, acc, METHOD_ACLCHECK);
 };
 #endif /* BE_HTTP */
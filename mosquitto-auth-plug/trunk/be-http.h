@@ -28,11 +28,20 @@
  */
 #ifdef BE_HTTP
 
+#include <curl/curl.h>
+
 #define MAXPARAMSLEN  1024
 #define METHOD_GETUSER   1
 #define METHOD_SUPERUSER 2
 #define METHOD_ACLCHECK  3
 
+/*
+ * A single curl handle is kept for the lifetime of the back-end, so that
+ * its connection to the HTTP server is kept alive and reused by all the
+ * requests; the request body is formatted in a buffer which is reused as
+ * well.
+ */
+
 struct http_backend {
 	char *ip;
 	int port;
@@ -40,10 +49,23 @@ struct http_backend {
 	char *getuser_uri;
 	char *superuser_uri;
 	char *aclcheck_uri;
+	char *superacl_uri;		/* superuser and ACL check in one request */
 	char *getuser_envs;
 	char *superuser_envs;
 	char *aclcheck_envs;
 	char *with_tls;
+	CURL *curl;
+	struct curl_slist *headers;
+	char *getuser_url;		/* URLs and parameters from the environment */
+	char *superuser_url;		/* are formatted once, at init */
+	char *aclcheck_url;
+	char *getuser_params;
+	char *superuser_params;
+	char *aclcheck_params;
+	char *data;			/* request body */
+	size_t datasize;
+	unsigned long requests;
+	unsigned long connects;		/* new connections opened */
 };
 
 void *be_http_init();
@@ -32,12 +32,34 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <mosquitto.h>
+#include <errmsg.h>
+#include <mysqld_error.h>
 #include "be-mysql.h"
 #include "log.h"
 #include "hash.h"
 #include "backends.h"
 
+#define MAXPARAMS	4
+#define MAXCOLUMNS	2
+
+/*
+ * The queries are configured as printf(3) templates, with a '%s' for the
+ * username and a %d for the access. They are rewritten as statements
+ * with placeholders, which are prepared once and executed with the
+ * username and the access bound to them, in the order of the template.
+ */
+
+struct query {
+	char *template;
+	char *sql;
+	char params[MAXPARAMS];	/* 's' username, 'd' acc */
+	int nparams;
+	unsigned int ncolumns;
+	MYSQL_STMT *stmt;
+};
+
 struct mysql_backend {
         MYSQL *mysql;
 	char *host;
@@ -46,9 +68,15 @@ struct mysql_backend {
 	char *user;
 	char *pass;
         bool auto_connect;
-        char *userquery;        // MUST return 1 row, 1 column
-        char *superquery;       // MUST return 1 row, 1 column, [0, 1]
-        char *aclquery;         // MAY return n rows, 1 column, string
+	struct query userquery;		// MUST return 1 row, 1 column
+	struct query superquery;	// MUST return 1 row, 1 column, [0, 1]
+	struct query aclquery;		// MAY return n rows, 1 column, string
+	struct query aclloadquery;	// MAY return n rows, 2 columns, username and topic
+	unsigned long thread_id;	/* connection the statements were prepared on */
+	time_t ping_interval;		/* ping an idle connection after this many seconds */
+	time_t last_used;
+	char *value[MAXCOLUMNS];	/* columns of the current row */
+	unsigned long valuesize[MAXCOLUMNS];
 };
 
 static char *get_bool(char *option, char *defval)
@@ -62,6 +90,87 @@ static char *get_bool(char *option, char *defval)
     return defval;
 }
 
+/*
+ * Rewrite the template of q with a `?' for each '%s', %s or %d.
+ */
+
+static int mkquery(struct query *q, char *template)
+{
+	char *t, *s, quote = 0;
+
+	memset(q, 0, sizeof(struct query));
+	q->ncolumns = 1;
+	if ((q->template = template) == NULL)
+		return (0);
+
+	if ((q->sql = s = malloc(strlen(template) + 1)) == NULL)
+		return (-1);
+
+	for (t = template; *t; t++) {
+		if (*t != '%') {
+			if (quote && *t == quote)
+				quote = 0;
+			else if (!quote && (*t == '\'' || *t == '"'))
+				quote = *t;
+			*s++ = *t;
+			continue;
+		}
+		if (t[1] == '%') {
+			*s++ = *t++;
+			continue;
+		}
+		if ((t[1] != 's' && t[1] != 'd') || q->nparams == MAXPARAMS)
+			return (-1);
+		q->params[q->nparams++] = t[1];
+
+		/* '%s' is replaced as a whole, other quoted conversions can't be */
+		if (quote) {
+			if (s[-1] != quote || t[2] != quote)
+				return (-1);
+			--s;
+			t++;
+			quote = 0;
+		}
+		*s++ = '?';
+		t++;
+	}
+	*s = 0;
+	return (quote == 0) ? 0 : -1;
+}
+
+static int prepare(struct mysql_backend *conf, struct query *q)
+{
+	if (q->sql == NULL)
+		return (0);
+
+	if (q->stmt)
+		mysql_stmt_close(q->stmt);
+
+	if ((q->stmt = mysql_stmt_init(conf->mysql)) == NULL)
+		return (-1);
+
+	if (mysql_stmt_prepare(q->stmt, q->sql, strlen(q->sql)) ||
+	    mysql_stmt_field_count(q->stmt) != q->ncolumns) {
+		_log(LOG_NOTICE, "mysql: cannot prepare [%s]: %s", q->sql, mysql_stmt_error(q->stmt));
+		mysql_stmt_close(q->stmt);
+		q->stmt = NULL;
+		return (-1);
+	}
+	return (0);
+}
+
+static int prepare_all(struct mysql_backend *conf)
+{
+	int rc = 0;
+
+	rc |= prepare(conf, &conf->userquery);
+	rc |= prepare(conf, &conf->superquery);
+	rc |= prepare(conf, &conf->aclquery);
+	rc |= prepare(conf, &conf->aclloadquery);
+	conf->thread_id = mysql_thread_id(conf->mysql);
+	return (rc);
+}
+
 void *be_mysql_init()
 {
 	struct mysql_backend *conf;
@@ -99,9 +208,24 @@ void *be_mysql_init()
 	conf->pass		= pass;
     conf->auto_connect  = false;
 	conf->dbname		= dbname;
-	conf->userquery		= userquery;
-	conf->superquery	= p_stab("superquery");
-	conf->aclquery		= p_stab("aclquery");
+	conf->thread_id		= 0;
+	conf->last_used		= 0;
+	conf->valuesize[0]	= 1024;
+	conf->value[0]		= malloc(conf->valuesize[0]);
+	conf->valuesize[1]	= 1024;
+	conf->value[1]		= malloc(conf->valuesize[1]);
+
+	if (mkquery(&conf->userquery, userquery) ||
+	    mkquery(&conf->superquery, p_stab("superquery")) ||
+	    mkquery(&conf->aclquery, p_stab("aclquery")) ||
+	    mkquery(&conf->aclloadquery, p_stab("aclloadquery"))) {
+		_fatal("Queries may only contain '%%s' for the username and %%d for the access");
+		return (NULL);
+	}
+	conf->aclloadquery.ncolumns = 2;
+
+	p = p_stab("mysql_ping_interval");
+	conf->ping_interval = (p) ? atol(p) : 30;
 
     opt_flag = get_bool("mysql_auto_connect", "true");
     if (!strcmp("true", opt_flag)) {
@@ -117,43 +241,41 @@ void *be_mysql_init()
 	if (!mysql_real_connect(conf->mysql, host, user, pass, dbname, port, NULL, 0)) {
 		fprintf(stderr, "%s\n", mysql_error(conf->mysql));
         if (!conf->auto_connect && !reconnect) {
-            free(conf);
             mysql_close(conf->mysql);
+            free(conf);
             return (NULL);
         }
+	} else if (prepare_all(conf)) {
+		_fatal("Cannot prepare the queries");
+		return (NULL);
 	}
 
 	return ((void *)conf);
 }
 
+static void free_query(struct query *q)
+{
+	if (q->stmt)
+		mysql_stmt_close(q->stmt);
+	free(q->sql);
+}
+
 void be_mysql_destroy(void *handle)
 {
 	struct mysql_backend *conf = (struct mysql_backend *)handle;
 
 	if (conf) {
+		free_query(&conf->userquery);
+		free_query(&conf->superquery);
+		free_query(&conf->aclquery);
+		free_query(&conf->aclloadquery);
 		mysql_close(conf->mysql);
-		if (conf->userquery)
-			free(conf->userquery);
-		if (conf->superquery)
-			free(conf->superquery);
-		if (conf->aclquery)
-			free(conf->aclquery);
+		free(conf->value[0]);
+		free(conf->value[1]);
 		free(conf);
 	}
 }
 
-static char *escape(void *handle, const char *value, long *vlen)
-{
-	struct mysql_backend *conf = (struct mysql_backend *)handle;
-	char *v;
-
-	*vlen = strlen(value) * 2 + 1;
-	if ((v = malloc(*vlen)) == NULL)
-		return (NULL);
-	mysql_real_escape_string(conf->mysql, v, value, strlen(value));
-	return (v);
-}
-
 static bool auto_connect(struct mysql_backend *conf)
 {
     if (conf->auto_connect) {
@@ -166,64 +288,163 @@ static bool auto_connect(struct mysql_backend *conf)
     return false;
 }
 
-char *be_mysql_getuser(void *handle, const char *username, const char *password, int *authenticated)
+/*
+ * Make sure the connection is up and the statements are prepared on it.
+ * An idle connection is pinged, so that it is re-established before the
+ * query if the server dropped it; a busy one is only checked when a query
+ * fails.
+ */
+
+static bool connection(struct mysql_backend *conf, bool force)
 {
-	struct mysql_backend *conf = (struct mysql_backend *)handle;
-	char *query = NULL, *u = NULL, *value = NULL, *v;
-	long nrows, ulen;
-	MYSQL_RES *res = NULL;
-	MYSQL_ROW rowdata;
+	time_t now = time(NULL);
 
-	if (!conf || !conf->userquery || !username || !*username)
-		return (NULL);
+	if (force || conf->thread_id == 0 || now - conf->last_used >= conf->ping_interval) {
+		if (mysql_ping(conf->mysql)) {
+			fprintf(stderr, "%s\n", mysql_error(conf->mysql));
+			if (!auto_connect(conf)) {
+				return false;
+			}
+		}
+		/* Reconnecting drops the statements with the connection */
+		if ((force || mysql_thread_id(conf->mysql) != conf->thread_id) && prepare_all(conf))
+			return false;
+	}
+	conf->last_used = now;
+	return true;
+}
 
-    if (mysql_ping(conf->mysql)) {
-        fprintf(stderr, "%s\n", mysql_error(conf->mysql));
-        if (!auto_connect(conf)) {
-            return (NULL);
-        }
-    }
+/*
+ * Execute q with username and acc, and buffer its result. The caller
+ * fetches the rows with fetch() and frees the result with
+ * mysql_stmt_free_result().
+ */
 
-	if ((u = escape(conf, username, &ulen)) == NULL)
-		return (NULL);
+static MYSQL_STMT *execute(struct mysql_backend *conf, struct query *q, const char *username, int acc)
+{
+	MYSQL_BIND params[MAXPARAMS];
+	unsigned long ulen = strlen(username);
+	int i, retry;
+
+	for (retry = 0; retry < 2; retry++) {
+		if (!connection(conf, retry > 0) || q->stmt == NULL)
+			return (NULL);
+
+		memset(params, 0, sizeof(params));
+		for (i = 0; i < q->nparams; i++) {
+			if (q->params[i] == 's') {
+				params[i].buffer_type = MYSQL_TYPE_STRING;
+				params[i].buffer = (char *)username;
+				params[i].buffer_length = ulen;
+				params[i].length = &ulen;
+			} else {
+				params[i].buffer_type = MYSQL_TYPE_LONG;
+				params[i].buffer = (char *)&acc;
+			}
+		}
 
-	if ((query = malloc(strlen(conf->userquery) + ulen + 128)) == NULL) {
-		free(u);
-		return (NULL);
+		if (mysql_stmt_bind_param(q->stmt, params) == 0 &&
+		    mysql_stmt_execute(q->stmt) == 0 &&
+		    mysql_stmt_store_result(q->stmt) == 0)
+			return (q->stmt);
+
+		fprintf(stderr, "%s\n", mysql_stmt_error(q->stmt));
+		switch (mysql_stmt_errno(q->stmt)) {
+			case CR_SERVER_GONE_ERROR:
+			case CR_SERVER_LOST:
+			case ER_UNKNOWN_STMT_HANDLER:
+				continue;
+		}
+		break;
 	}
-	sprintf(query, conf->userquery, u);
-	free(u);
+	return (NULL);
+}
 
-	// DEBUG puts(query);
+/*
+ * Fetch the next row of stmt into conf->value, setting values to its
+ * columns, which are NULL for NULL columns. Return false when there are
+ * no more rows.
+ */
 
-	if (mysql_query(conf->mysql, query)) {
-		fprintf(stderr, "%s\n", mysql_error(conf->mysql));
-		goto out;
+static bool fetch(struct mysql_backend *conf, MYSQL_STMT *stmt, char **values)
+{
+	MYSQL_BIND result[MAXCOLUMNS];
+	unsigned long length[MAXCOLUMNS];
+	my_bool is_null[MAXCOLUMNS], error[MAXCOLUMNS];
+	unsigned int i, ncolumns = mysql_stmt_field_count(stmt);
+	int rc;
+
+	memset(result, 0, sizeof(result));
+	for (i = 0; i < ncolumns; i++) {
+		if (conf->value[i] == NULL)
+			return false;
+		result[i].buffer_type = MYSQL_TYPE_STRING;
+		result[i].buffer = conf->value[i];
+		/* Keep room for the terminating NUL: longer values are truncated */
+		result[i].buffer_length = conf->valuesize[i] - 1;
+		result[i].length = &length[i];
+		result[i].is_null = &is_null[i];
+		result[i].error = &error[i];
 	}
 
-	res = mysql_store_result(conf->mysql);
-	if ((nrows = mysql_num_rows(res)) != 1) {
-		// DEBUG fprintf(stderr, "rowcount = %ld; not ok\n", nrows);
-		goto out;
+	if (mysql_stmt_bind_result(stmt, result))
+		return false;
+
+	rc = mysql_stmt_fetch(stmt);
+	if (rc == MYSQL_DATA_TRUNCATED) {
+		for (i = 0; i < ncolumns; i++) {
+			char *v;
+
+			if (!error[i])
+				continue;
+			if ((v = realloc(conf->value[i], length[i] + 1)) == NULL)
+				return false;
+			conf->value[i] = v;
+			conf->valuesize[i] = length[i] + 1;
+			result[i].buffer = conf->value[i];
+			result[i].buffer_length = length[i];
+			if (mysql_stmt_fetch_column(stmt, &result[i], i, 0))
+				return false;
+		}
+		rc = 0;
 	}
-
-	if (mysql_num_fields(res) != 1) {
-		// DEBUG fprintf(stderr, "numfields not ok\n");
-		goto out;
+	if (rc != 0)
+		return false;
+
+	for (i = 0; i < ncolumns; i++) {
+		if (is_null[i]) {
+			values[i] = NULL;
+		} else {
+			conf->value[i][length[i]] = 0;
+			values[i] = conf->value[i];
+		}
 	}
+	return true;
+}
+
+char *be_mysql_getuser(void *handle, const char *username, const char *password, int *authenticated)
+{
+	struct mysql_backend *conf = (struct mysql_backend *)handle;
+	char *value = NULL, *v;
+	MYSQL_STMT *stmt;
+
+	if (!conf || !conf->userquery.sql || !username || !*username)
+		return (NULL);
+
+	if ((stmt = execute(conf, &conf->userquery, username, 0)) == NULL)
+		return (NULL);
 
-	if ((rowdata = mysql_fetch_row(res)) == NULL) {
+	if (mysql_stmt_num_rows(stmt) != 1) {
+		// DEBUG fprintf(stderr, "rowcount = %ld; not ok\n", nrows);
 		goto out;
 	}
 
-	v = rowdata[0];
-	value = (v) ? strdup(v) : NULL;
-
+	if (fetch(conf, stmt, &v) && v)
+		value = strdup(v);
 
    out:
 
-	mysql_free_result(res);
-	free(query);
+	mysql_stmt_free_result(stmt);
 
 	return (value);
 }
@@ -235,60 +456,26 @@ char *be_mysql_getuser(void *handle, const char *username, const char *password,
 int be_mysql_superuser(void *handle, const char *username)
 {
 	struct mysql_backend *conf = (struct mysql_backend *)handle;
-	char *query = NULL, *u = NULL;
-	long nrows, ulen;
 	int issuper = FALSE;
-	MYSQL_RES *res = NULL;
-	MYSQL_ROW rowdata;
-
-
-	if (!conf || !conf->superquery)
-		return (FALSE);
-
-    if (mysql_ping(conf->mysql)) {
-        fprintf(stderr, "%s\n", mysql_error(conf->mysql));
-        if (!auto_connect(conf)) {
-            return (FALSE);
-        }
-    }
+	MYSQL_STMT *stmt;
+	char *v;
 
-	if ((u = escape(conf, username, &ulen)) == NULL)
+	if (!conf || !conf->superquery.sql)
 		return (FALSE);
 
-	if ((query = malloc(strlen(conf->superquery) + ulen + 128)) == NULL) {
-		free(u);
+	if ((stmt = execute(conf, &conf->superquery, username, 0)) == NULL)
 		return (FALSE);
-	}
-	sprintf(query, conf->superquery, u);
-	free(u);
-
-	// puts(query);
-
-	if (mysql_query(conf->mysql, query)) {
-		fprintf(stderr, "%s\n", mysql_error(conf->mysql));
-		goto out;
-	}
 
-	res = mysql_store_result(conf->mysql);
-	if ((nrows = mysql_num_rows(res)) != 1) {
+	if (mysql_stmt_num_rows(stmt) != 1) {
 		goto out;
 	}
 
-	if (mysql_num_fields(res) != 1) {
-		// DEBUG fprintf(stderr, "numfields not ok\n");
-		goto out;
-	}
-
-	if ((rowdata = mysql_fetch_row(res)) == NULL) {
-		goto out;
-	}
-
-	issuper = atoi(rowdata[0]);
+	if (fetch(conf, stmt, &v) && v)
+		issuper = atoi(v);
 
    out:
 
-	mysql_free_result(res);
-	free(query);
+	mysql_stmt_free_result(stmt);
 
 	return (issuper);
 }
@@ -310,48 +497,19 @@ int be_mysql_superuser(void *handle, const char *username)
 int be_mysql_aclcheck(void *handle, const char *clientid, const char *username, const char *topic, int acc)
 {
 	struct mysql_backend *conf = (struct mysql_backend *)handle;
-	char *query = NULL, *u = NULL, *v;
-	long ulen;
+	char *v;
 	int match = 0;
 	bool bf;
-	MYSQL_RES *res = NULL;
-	MYSQL_ROW rowdata;
-
-	if (!conf || !conf->aclquery)
-		return (FALSE);
+	MYSQL_STMT *stmt;
 
-	if (mysql_ping(conf->mysql)) {
-		fprintf(stderr, "%s\n", mysql_error(conf->mysql));
-		if (!auto_connect(conf)) {
-			return (FALSE);
-		}
-	}
-
-	if ((u = escape(conf, username, &ulen)) == NULL)
+	if (!conf || !conf->aclquery.sql)
 		return (FALSE);
 
-	if ((query = malloc(strlen(conf->aclquery) + ulen + 128)) == NULL) {
-		free(u);
+	if ((stmt = execute(conf, &conf->aclquery, username, acc)) == NULL)
 		return (FALSE);
-	}
-	sprintf(query, conf->aclquery, u, acc);
-	free(u);
-
-	//_log(LOG_DEBUG, "SQL: %s", query);
-
-	if (mysql_query(conf->mysql, query)) {
-		_log(LOG_NOTICE, "%s", mysql_error(conf->mysql));
-		goto out;
-	}
 
-	res = mysql_store_result(conf->mysql);
-	if (mysql_num_fields(res) != 1) {
-		fprintf(stderr, "numfields not ok\n");
-		goto out;
-	}
-
-	while (match == 0 && (rowdata = mysql_fetch_row(res)) != NULL) {
-		if ((v = rowdata[0]) != NULL) {
+	while (match == 0 && fetch(conf, stmt, &v)) {
+		if (v != NULL) {
 
 			/* Check mosquitto_match_topic. If true,
 			 * if true, set match and break out of loop. */
@@ -370,11 +528,54 @@ int be_mysql_aclcheck(void *handle, const char *clientid, const char *username,
 		}
 	}
 
-   out:
-
-	mysql_free_result(res);
-	free(query);
+	mysql_stmt_free_result(stmt);
 
 	return (match);
 }
+
+/*
+ * Load all the ACLs for acc, adding the username and the topic of every
+ * row to index. This runs on a connection of its own, in the thread
+ * refreshing the ACL index.
+ */
+
+int be_mysql_aclload(void *handle, int acc, f_acladd *add, void *index)
+{
+	struct mysql_backend *conf = (struct mysql_backend *)handle;
+	MYSQL_STMT *stmt;
+	char *v[MAXCOLUMNS];
+	int rc = 0;
+
+	if (!conf || !conf->aclloadquery.sql)
+		return (-1);
+
+	if ((stmt = execute(conf, &conf->aclloadquery, "", acc)) == NULL)
+		return (-1);
+
+	while (fetch(conf, stmt, v)) {
+		if (v[0] && v[1])
+			add(index, v[0], v[1], acc);
+	}
+	if (mysql_stmt_errno(stmt))
+		rc = -1;
+
+	mysql_stmt_free_result(stmt);
+
+	return (rc);
+}
+
+/*
+ * The client library needs its per-thread state in threads other than
+ * the one which initialized it, i.e. the ACL loader.
+ */
+
+void be_mysql_thread_init(void)
+{
+	mysql_thread_init();
+}
+
+void be_mysql_thread_end(void)
+{
+	mysql_thread_end();
+}
 #endif /* BE_MYSQL */
@@ -30,10 +30,14 @@
 #ifdef BE_MYSQL
 
 #include <mysql.h>
+#include "backends.h"
 
 void *be_mysql_init();
 void be_mysql_destroy(void *conf);
 char *be_mysql_getuser(void *conf, const char *username, const char *password, int *authenticated);
 int be_mysql_superuser(void *conf, const char *username);
 int be_mysql_aclcheck(void *conf, const char *clientid, const char *username, const char *topic, int acc);
+int be_mysql_aclload(void *conf, int acc, f_acladd *add, void *index);
+void be_mysql_thread_init(void);
+void be_mysql_thread_end(void);
 #endif /* BE_MYSQL */
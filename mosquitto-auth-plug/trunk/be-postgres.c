@@ -49,8 +49,70 @@ struct pg_backend {
 	char *userquery;        // MUST return 1 row, 1 column
 	char *superquery;       // MUST return 1 row, 1 column, [0, 1]
 	char *aclquery;         // MAY return n rows, 1 column, string
+	char *aclloadquery;     // MAY return n rows, 2 columns, username and topic
 };
 
+/*
+ * The queries are prepared once, as named statements, when connecting to
+ * the server, and they are prepared again whenever the connection is reset.
+ */
+
+static int prepare(struct pg_backend *conf, const char *name, const char *query, int nparams)
+{
+	PGresult *res;
+	int rc = 0;
+
+	if (query == NULL)
+		return (0);
+
+	res = PQprepare(conf->conn, name, query, nparams, NULL);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+		_log(LOG_NOTICE, "postgres: cannot prepare [%s]: %s", query, PQresultErrorMessage(res));
+		rc = -1;
+	}
+	PQclear(res);
+	return (rc);
+}
+
+static int prepare_all(struct pg_backend *conf)
+{
+	int rc = 0;
+
+	rc |= prepare(conf, "userquery", conf->userquery, 1);
+	rc |= prepare(conf, "superquery", conf->superquery, 1);
+	rc |= prepare(conf, "aclquery", conf->aclquery, 2);
+	rc |= prepare(conf, "aclloadquery", conf->aclloadquery, 1);
+	return (rc);
+}
+
+/*
+ * Execute a prepared statement. If the connection went away, or the
+ * statement is gone with it, reset the connection and try again once.
+ */
+
+static PGresult *execute(struct pg_backend *conf, const char *name, int nparams, const char *const *values, const int *lengths, const int *binary)
+{
+	PGresult *res;
+	const char *state;
+
+	res = PQexecPrepared(conf->conn, name, nparams, values, lengths, binary, 0);
+	if (PQresultStatus(res) == PGRES_TUPLES_OK)
+		return (res);
+
+	state = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+	if (PQstatus(conf->conn) != CONNECTION_BAD &&
+	    !(state && strcmp(state, "26000") == 0))	/* invalid_sql_statement_name */
+		return (res);
+
+	_log(LOG_NOTICE, "postgres: %s; reconnecting", PQresultErrorMessage(res));
+	PQclear(res);
+	PQreset(conf->conn);
+	if (PQstatus(conf->conn) != CONNECTION_OK || prepare_all(conf))
+		return (NULL);
+
+	return PQexecPrepared(conf->conn, name, nparams, values, lengths, binary, 0);
+}
+
 void *be_pg_init()
 {
 	struct pg_backend *conf;
@@ -87,6 +149,7 @@ void *be_pg_init()
 	conf->userquery  = userquery;
 	conf->superquery = p_stab("superquery");
 	conf->aclquery   = p_stab("aclquery");
+	conf->aclloadquery = p_stab("aclloadquery");
 
 	_log( LOG_DEBUG, "HERE: %s", conf->superquery );
 	_log( LOG_DEBUG, "HERE: %s", conf->aclquery );
@@ -103,6 +166,11 @@ void *be_pg_init()
 		return (NULL);
 	}
 
+	if (prepare_all(conf)) {
+		_fatal("Cannot prepare the queries");
+		return (NULL);
+	}
+
 	free(connect_string);
 
 	return ((void *)conf);
@@ -113,13 +181,8 @@ void be_pg_destroy(void *handle)
 	struct pg_backend *conf = (struct pg_backend *)handle;
 
 	if (conf) {
+		/* The queries belong to the options, which other instances share */
 		PQfinish(conf->conn);
-		if (conf->userquery)
-			free(conf->userquery);
-		if (conf->superquery)
-			free(conf->superquery);
-		if (conf->aclquery)
-			free(conf->aclquery);
 		free(conf);
 	}
 }
@@ -140,7 +203,7 @@ char *be_pg_getuser(void *handle, const char *username, const char *password, in
 	int lengths[1] = {strlen(username)};
 	int binary[1] = {0};
 
-	res = PQexecParams(conf->conn, conf->userquery, 1, NULL, values, lengths, binary, 0);
+	res = execute(conf, "userquery", 1, values, lengths, binary);
 
 	if ( PQresultStatus(res) != PGRES_TUPLES_OK )
 	{
@@ -195,7 +258,7 @@ int be_pg_superuser(void *handle, const char *username)
 	int lengths[1] = {strlen(username)};
 	int binary[1] = {0};
 
-	res = PQexecParams(conf->conn, conf->superquery, 1, NULL, values, lengths, binary, 0);
+	res = execute(conf, "superquery", 1, values, lengths, binary);
 
 	if ( PQresultStatus(res) != PGRES_TUPLES_OK )
 	{
@@ -261,7 +324,7 @@ int be_pg_aclcheck(void *handle, const char *clientid, const char *username, con
 	int lengths[2] = {strlen(username),sizeof(localacc)};
 	int binary[2] = {0,1};
 
-	res = PQexecParams(conf->conn, conf->aclquery, 2, NULL, values, lengths, binary, 0);
+	res = execute(conf, "aclquery", 2, values, lengths, binary);
 
 	if ( PQresultStatus(res) != PGRES_TUPLES_OK )
 	{
@@ -307,4 +370,51 @@ out:
 
 	return (match);
 }
+
+/*
+ * Load all the ACLs for acc, adding the username and the topic of every
+ * row to index. This runs on a connection of its own, in the thread
+ * refreshing the ACL index.
+ */
+
+int be_pg_aclload(void *handle, int acc, f_acladd *add, void *index)
+{
+	struct pg_backend *conf = (struct pg_backend *)handle;
+	PGresult *res = NULL;
+	int row, rc = -1;
+
+	if (!conf || !conf->aclloadquery)
+		return (-1);
+
+	int localacc = htonl(acc);
+
+	const char *values[1] = {(char*)&localacc};
+	int lengths[1] = {sizeof(localacc)};
+	int binary[1] = {1};
+
+	res = execute(conf, "aclloadquery", 1, values, lengths, binary);
+
+	if ( PQresultStatus(res) != PGRES_TUPLES_OK )
+	{
+		fprintf(stderr, "%s\n", PQresultErrorMessage(res));
+		goto out;
+	}
+
+	if (PQnfields(res) != 2) {
+		fprintf(stderr, "numfields not ok\n");
+		goto out;
+	}
+
+	for (row = 0; row < PQntuples(res); row++) {
+		if (!PQgetisnull(res, row, 0) && !PQgetisnull(res, row, 1))
+			add(index, PQgetvalue(res, row, 0), PQgetvalue(res, row, 1), acc);
+	}
+	rc = 0;
+
+out:
+
+	PQclear(res);
+
+	return (rc);
+}
 #endif /* BE_POSTGRES */
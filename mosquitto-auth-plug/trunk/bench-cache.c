@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2014 Jan-Piet Mens <jpmens()gmail.com>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of mosquitto nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Drive the ACL cache with one million checks, the way a broker with
+ * many stations publishing on a few dozens topics each does, and print
+ * the time per check and the cache counters.
+ *
+ *	cc -O2 -I$(MOSQUITTO_SRC)/lib -o bench-cache bench-cache.c cache.c log.c
+ *	./bench-cache [stations [topics [cachesize]]]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <mosquitto.h>
+#include <mosquitto_plugin.h>
+#include "userdata.h"
+#include "cache.h"
+
+#define CHECKS	1000000
+
+int main(int argc, char **argv)
+{
+	struct userdata ud;
+	struct timespec start, end;
+	int stations = (argc > 1) ? atoi(argv[1]) : 5000;
+	int topics = (argc > 2) ? atoi(argv[2]) : 40;
+	char clientid[32], username[32], topic[128];
+	double ns;
+	long n;
+
+	memset(&ud, 0, sizeof(ud));
+	ud.cacheseconds = 300;
+	ud.cachesize = (argc > 3) ? strtoul(argv[3], NULL, 10) : 100000;
+
+	srandom(1);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (n = 0; n < CHECKS; n++) {
+		int s = random() % stations;
+		int t = random() % topics;
+
+		snprintf(clientid, sizeof(clientid), "station-%d", s);
+		snprintf(username, sizeof(username), "user-%d", s);
+		snprintf(topic, sizeof(topic), "/%d/1123456,4432100/locali/254,0,0/103,2000,-,-/B%05d", s, 12101 + t);
+
+		if (cache_q(clientid, username, topic, MOSQ_ACL_WRITE, &ud) == MOSQ_ERR_UNKNOWN)
+			acl_cache(clientid, username, topic, MOSQ_ACL_WRITE, MOSQ_ERR_SUCCESS, &ud);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+	printf("%d checks: %.0f ns/check, %lu hits, %lu misses, %lu evicted, %u cached\n",
+		CHECKS, ns / CHECKS, ud.cachestats.hits, ud.cachestats.misses,
+		ud.cachestats.evictions, HASH_COUNT(ud.aclcache));
+
+	cache_free(&ud);
+	return (0);
+}
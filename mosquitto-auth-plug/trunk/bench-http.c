@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2014 Jan-Piet Mens <jpmens()gmail.com>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of mosquitto nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Drive the http back-end with ACL checks the way the plugin does (a
+ * superuser check, then an ACL check on a new topic) against the server
+ * in examples/http-auth-bench.py, and print the time per check and the
+ * number of connections which were opened.
+ *
+ *	cc -O2 -DBE_HTTP -I$(MOSQUITTO_SRC)/lib -o bench-http bench-http.c be-http.c hash.c envs.c log.c -lcurl
+ *	./bench-http [checks [port [superacl]]]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "backends.h"
+#include "be-http.h"
+#include "hash.h"
+
+int main(int argc, char **argv)
+{
+	struct http_backend *conf;
+	struct timespec start, end;
+	int checks = (argc > 1) ? atoi(argv[1]) : 10000;
+	char topic[64];
+	int n, allowed = 0, authenticated = 0;
+	double ns;
+
+	p_add("http_ip", "127.0.0.1");
+	p_add("http_port", (argc > 2) ? argv[2] : "8100");
+	p_add("http_getuser_uri", "/auth");
+	p_add("http_superuser_uri", "/superuser");
+	p_add("http_aclcheck_uri", "/acl");
+	if (argc > 3)
+		p_add("http_superacl_uri", "/superacl");
+
+	if ((conf = be_http_init()) == NULL)
+		return (1);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	be_http_getuser(conf, "jane@mens.de", "jolie", &authenticated);
+	for (n = 0; n < checks; n++) {
+		snprintf(topic, sizeof(topic), "t/%d", n);
+		if (be_http_superuser(conf, "jane@mens.de") ||
+		    be_http_aclcheck(conf, "jane", "jane@mens.de", topic, 2))
+			allowed++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+	printf("%d checks (%d allowed, authenticated=%d): %.0f us/check, %lu requests on %lu connections\n",
+		checks, allowed, authenticated, ns / checks / 1000,
+		conf->requests, conf->connects);
+
+	be_http_destroy(conf);
+	return (0);
+}
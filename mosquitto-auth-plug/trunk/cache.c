@@ -34,50 +34,57 @@
 #include <mosquitto.h>
 #include "userdata.h"
 #include "cache.h"
+#include <openssl/crypto.h>
 #include <openssl/evp.h>
-#include <openssl/sha.h>
+#include <openssl/hmac.h>
 #include "uthash.h"
 #include "log.h"
 
-static unsigned int sha_hash(const char *data, size_t size, unsigned char *out)
-{
-	unsigned int md_len = -1;
-	const EVP_MD *md = EVP_get_digestbyname("SHA1");
-
-	if (md != NULL) {
-		EVP_MD_CTX mdctx;
-		EVP_MD_CTX_init(&mdctx);
-		EVP_DigestInit_ex(&mdctx, md, NULL);
-		EVP_DigestUpdate(&mdctx, data, size);
-		EVP_DigestFinal_ex(&mdctx, out, &md_len);
-		EVP_MD_CTX_cleanup(&mdctx);
-	}
-	return md_len;
-}
+/*
+ * Lookup keys are built in a buffer on the stack; only unusually long
+ * topics need one on the heap.
+ */
+
+#define KEYBUFSIZE	512
 
-static void hexify(const char *clientid, const char *username, const char *topic, int access, char *hex)
+static char *mkkey(const char *clientid, const char *username, const char *topic, int access, char *buf, unsigned *keylen)
 {
-	char *data;
-	unsigned char hashdata[SHA_DIGEST_LENGTH];
-	int mdlen, i;
+	size_t clen = strlen(clientid) + 1;
+	size_t ulen = strlen(username) + 1;
+	size_t tlen = strlen(topic) + 1;
+	size_t len = clen + ulen + tlen + 1;
+	char *key = buf, *p;
 
-	data = malloc(strlen(clientid) + strlen(username) + strlen(topic) + 20);
-	sprintf(data, "%s:%s:%s:%d", clientid, username, topic, access);
+	if (len > KEYBUFSIZE && (key = malloc(len)) == NULL)
+		return (NULL);
 
-	mdlen = sha_hash(data, strlen(data), hashdata);
-	if (mdlen != SHA_DIGEST_LENGTH) {
-		free(data);
-		return;
-	}
+	p = key;
+	memcpy(p, clientid, clen);
+	p += clen;
+	memcpy(p, username, ulen);
+	p += ulen;
+	memcpy(p, topic, tlen);
+	p += tlen;
+	*p = (char)access;
 
-	// printf("mdlen=%d, string=%s\n\thash=", mdlen, data);
-	for (i = 0, *hex = 0; i < sizeof(hashdata) / sizeof(hashdata[0]); i++) {
-		sprintf(hex + (i*2), "%02X", hashdata[i]);
-	}
-	// printf("%s\n", hex);
+	*keylen = (unsigned)len;
+	return (key);
+}
 
+/*
+ * Drop expired entries. The cache is ordered by age, so this stops
+ * at the first entry which is still valid.
+ */
 
-	free(data);
+static void expire(struct userdata *ud, time_t now)
+{
+	struct aclcache *a;
+
+	while ((a = ud->aclcache) != NULL && now > (a->seconds + ud->cacheseconds)) {
+		HASH_DEL(ud->aclcache, a);
+		free(a);
+		ud->cachestats.expired++;
+	}
 }
 
 /* access is desired read/write access
@@ -86,10 +93,10 @@ static void hexify(const char *clientid, const char *username, const char *topic
 
 void acl_cache(const char *clientid, const char *username, const char *topic, int access, int granted, void *userdata)
 {
-	char hex[SHA_DIGEST_LENGTH * 2 + 1];
-	struct aclcache *a, *tmp;
+	char buf[KEYBUFSIZE], *key;
+	unsigned keylen;
+	struct aclcache *a;
 	struct userdata *ud = (struct userdata *)userdata;
-	time_t cacheseconds = ud->cacheseconds;
 	time_t now;
 
 	if (ud->cacheseconds <= 0) {
@@ -100,46 +107,51 @@ void acl_cache(const char *clientid, const char *username, const char *topic, in
 		return;
 	}
 
+	if ((key = mkkey(clientid, username, topic, access, buf, &keylen)) == NULL)
+		return;
+
 	now = time(NULL);
+	expire(ud, now);
 
-	hexify(clientid, username, topic, access, hex);
+	/*
+	 * An entry which is already there is re-added, so that it moves
+	 * to the tail together with the other recent ones.
+	 */
 
-	HASH_FIND_STR(ud->aclcache, hex, a);
+	HASH_FIND(hh, ud->aclcache, key, keylen, a);
 	if (a) {
-		granted = a->granted;
+		HASH_DEL(ud->aclcache, a);
+	} else {
+		if (ud->cachesize > 0 && HASH_COUNT(ud->aclcache) >= ud->cachesize) {
+			struct aclcache *oldest = ud->aclcache;
 
-		if (time(NULL) > (a->seconds + cacheseconds)) {
-			_log(DEBUG, " Expired [%s] for (%s,%s,%d)", hex, clientid, username, access);
-			HASH_DEL(ud->aclcache, a);
+			HASH_DEL(ud->aclcache, oldest);
+			free(oldest);
+			ud->cachestats.evictions++;
 		}
-	} else {
-		a = (struct aclcache *)malloc(sizeof(struct aclcache));
-		strcpy(a->hex, hex);
-		a->granted = granted;
-		a->seconds = now;
-		HASH_ADD_STR(ud->aclcache, hex, a);
-		_log(DEBUG, " Cached  [%s] for (%s,%s,%d)", hex, clientid, username, access);
+
+		if ((a = (struct aclcache *)malloc(sizeof(struct aclcache) + keylen)) == NULL)
+			goto out;
+		memcpy(a->key, key, keylen);
+		a->keylen = keylen;
+		_log(LOG_DEBUG, " Cached  for (%s,%s,%s,%d)", clientid, username, topic, access);
 	}
 
-	/*
-	 * Check whole cache for items which need deleting. Important with
-	 * clients who show up once only (mosquitto_[sp]ub with variable clientIDs
-	 */
+	a->granted = granted;
+	a->seconds = now;
+	HASH_ADD_KEYPTR(hh, ud->aclcache, a->key, a->keylen, a);
 
-	HASH_ITER(hh, ud->aclcache, a, tmp) {
-		if (now > (a->seconds + ud->cacheseconds)) {
-			_log(DEBUG, " Cleanup [%s]", a->hex);
-			HASH_DEL(ud->aclcache, a);
-		}
-	}
+    out:
+	if (key != buf)
+		free(key);
 }
 
 int cache_q(const char *clientid, const char *username, const char *topic, int access, void *userdata)
 {
-	char hex[SHA_DIGEST_LENGTH * 2 + 1];
+	char buf[KEYBUFSIZE], *key;
+	unsigned keylen;
 	struct aclcache *a;
 	struct userdata *ud = (struct userdata *)userdata;
-	time_t cacheseconds = ud->cacheseconds;
 	int granted = MOSQ_ERR_UNKNOWN;
 
 	if (ud->cacheseconds <= 0) {
@@ -150,21 +162,165 @@ int cache_q(const char *clientid, const char *username, const char *topic, int a
 		return (MOSQ_ERR_UNKNOWN);
 	}
 
-	hexify(clientid, username, topic, access, hex);
+	if ((key = mkkey(clientid, username, topic, access, buf, &keylen)) == NULL)
+		return (MOSQ_ERR_UNKNOWN);
+
+	HASH_FIND(hh, ud->aclcache, key, keylen, a);
+	if (a && time(NULL) > (a->seconds + ud->cacheseconds)) {
+		_log(LOG_DEBUG, " Expired for (%s,%s,%s,%d)", clientid, username, topic, access);
+		HASH_DEL(ud->aclcache, a);
+		free(a);
+		ud->cachestats.expired++;
+		a = NULL;
+	}
 
-	HASH_FIND_STR(ud->aclcache, hex, a);
 	if (a) {
-		// printf("---> CACHED! %d\n", a->granted);
-
 		granted = a->granted;
+		ud->cachestats.hits++;
+	} else {
+		ud->cachestats.misses++;
+	}
+
+	if (key != buf)
+		free(key);
+	return (granted);
+}
+
+/*
+ * HMAC under the per-process key of the back-end number, hash and
+ * password, which is what a cached verification stands for.
+ */
+
+static int auth_digest(struct userdata *ud, const char *password, const char *phash, int nord, unsigned char *digest)
+{
+	char buf[KEYBUFSIZE], *data = buf;
+	size_t hlen = strlen(phash) + 1;
+	size_t plen = strlen(password);
+	size_t len = 1 + hlen + plen;
+	unsigned int mdlen = 0;
+
+	if (len > KEYBUFSIZE && (data = malloc(len)) == NULL)
+		return (FALSE);
 
-		if (time(NULL) > (a->seconds + cacheseconds)) {
-			_log(DEBUG, " Expired [%s] for (%s,%s,%d)", hex, clientid, username, access);
-			HASH_DEL(ud->aclcache, a);
+	data[0] = (char)nord;
+	memcpy(data + 1, phash, hlen);
+	memcpy(data + 1 + hlen, password, plen);
+
+	HMAC(EVP_sha256(), ud->authkey, sizeof(ud->authkey),
+		(unsigned char *)data, len, digest, &mdlen);
+
+	OPENSSL_cleanse(data, len);
+	if (data != buf)
+		free(data);
+	return (mdlen == SHA256_DIGEST_LENGTH);
+}
+
+/*
+ * Return TRUE if username was successfully verified with this password
+ * against this same hash of back-end nord less than authcacheseconds ago.
+ */
+
+int auth_cache_q(const char *username, const char *password, const char *phash, int nord, void *userdata)
+{
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+	struct authcache *a;
+	struct userdata *ud = (struct userdata *)userdata;
+	int match;
+
+	if (ud->authcacheseconds <= 0) {
+		return (FALSE);
+	}
+
+	HASH_FIND(hh, ud->authcache, username, strlen(username), a);
+	if (a && time(NULL) > (a->seconds + ud->authcacheseconds)) {
+		HASH_DEL(ud->authcache, a);
+		free(a);
+		ud->authstats.expired++;
+		a = NULL;
+	}
+
+	match = a && a->nord == nord &&
+		auth_digest(ud, password, phash, nord, digest) &&
+		CRYPTO_memcmp(digest, a->digest, sizeof(digest)) == 0;
+
+	if (match)
+		ud->authstats.hits++;
+	else
+		ud->authstats.misses++;
+	return (match);
+}
+
+void auth_cache(const char *username, const char *password, const char *phash, int nord, void *userdata)
+{
+	struct authcache *a;
+	struct userdata *ud = (struct userdata *)userdata;
+	size_t ulen = strlen(username) + 1;
+	time_t now;
+
+	if (ud->authcacheseconds <= 0) {
+		return;
+	}
+
+	now = time(NULL);
+	while ((a = ud->authcache) != NULL && now > (a->seconds + ud->authcacheseconds)) {
+		HASH_DEL(ud->authcache, a);
+		free(a);
+		ud->authstats.expired++;
+	}
+
+	/* A user has one entry; a new password or hash replaces it */
+
+	HASH_FIND(hh, ud->authcache, username, ulen - 1, a);
+	if (a) {
+		HASH_DEL(ud->authcache, a);
+	} else {
+		if (ud->authcachesize > 0 && HASH_COUNT(ud->authcache) >= ud->authcachesize) {
+			struct authcache *oldest = ud->authcache;
+
+			HASH_DEL(ud->authcache, oldest);
+			free(oldest);
+			ud->authstats.evictions++;
 		}
+
+		if ((a = (struct authcache *)malloc(sizeof(struct authcache) + ulen)) == NULL)
+			return;
+		memcpy(a->username, username, ulen);
 	}
 
-	return (granted);
+	if (!auth_digest(ud, password, phash, nord, a->digest)) {
+		free(a);
+		return;
+	}
+	a->nord = nord;
+	a->seconds = now;
+	HASH_ADD_KEYPTR(hh, ud->authcache, a->username, ulen - 1, a);
 }
 
+void cache_free(void *userdata)
+{
+	struct userdata *ud = (struct userdata *)userdata;
+	struct aclcache *a, *tmp;
+	struct authcache *u, *utmp;
+
+	_log(LOG_NOTICE, "ACL cache: %lu hits, %lu misses, %lu expired, %lu evicted, %u cached",
+		ud->cachestats.hits, ud->cachestats.misses,
+		ud->cachestats.expired, ud->cachestats.evictions,
+		HASH_COUNT(ud->aclcache));
 
+	HASH_ITER(hh, ud->aclcache, a, tmp) {
+		HASH_DEL(ud->aclcache, a);
+		free(a);
+	}
+
+	_log(LOG_NOTICE, "Auth cache: %lu hits, %lu misses, %lu expired, %lu evicted, %u cached",
+		ud->authstats.hits, ud->authstats.misses,
+		ud->authstats.expired, ud->authstats.evictions,
+		HASH_COUNT(ud->authcache));
+
+	HASH_ITER(hh, ud->authcache, u, utmp) {
+		HASH_DEL(ud->authcache, u);
+		OPENSSL_cleanse(u->digest, sizeof(u->digest));
+		free(u);
+	}
+	OPENSSL_cleanse(ud->authkey, sizeof(ud->authkey));
+}
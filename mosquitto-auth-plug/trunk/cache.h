@@ -34,14 +34,48 @@
 #ifndef __CACHE_H
 # define __CACHE_H
 
+/*
+ * ACL cache entries are hashed on the raw clientid, username, topic and
+ * access; uthash compares the full key on lookup, so colliding hashes
+ * never return each other's result. Entries are kept in the order they
+ * were cached (uthash keeps the insertion order), so that the oldest ones,
+ * which are the first to expire, are always at the head.
+ */
+
 struct aclcache {
-        char hex[SHA_DIGEST_LENGTH * 2 + 1];    /* key within struct */
-        int granted;
-        time_t seconds;
-        UT_hash_handle hh;
+	int granted;
+	time_t seconds;
+	UT_hash_handle hh;
+	unsigned keylen;
+	char key[];		/* clientid\0username\0topic\0access */
+};
+
+/*
+ * Successful password verifications are cached per username. Neither the
+ * password nor the back-end's hash are kept: the entry holds an HMAC of
+ * both under a key generated when the plugin is loaded, so it only
+ * matches while the same password is checked against the same hash.
+ */
+
+struct authcache {
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+	int nord;			/* back-end which authenticated */
+	time_t seconds;
+	UT_hash_handle hh;
+	char username[];
+};
+
+struct cachestats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long expired;		/* dropped after cacheseconds */
+	unsigned long evictions;	/* dropped to stay within cachesize */
 };
 
 void acl_cache(const char *clientid, const char *username, const char *topic, int access, int granted, void *userdata);
 int cache_q(const char *clientid, const char *username, const char *topic, int access, void *userdata);
+int auth_cache_q(const char *username, const char *password, const char *phash, int nord, void *userdata);
+void auth_cache(const char *username, const char *password, const char *phash, int nord, void *userdata);
+void cache_free(void *userdata);
 
 #endif
@@ -0,0 +1,86 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+
+# Stand-in for the HTTP back-end's server, with the same rules as
+# http-auth-be.py, which counts requests and connections so that the
+# connection reuse of the back-end can be checked with bench-http.c.
+#
+#   ./http-auth-bench.py [port]
+#   curl http://127.0.0.1:8100/stats
+
+import sys
+import json
+import threading
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import parse_qs
+
+stats = {'connections': 0, 'requests': 0}
+lock = threading.Lock()
+
+
+def auth(form):
+    return form.get('username') == 'jane@mens.de' and form.get('password') == 'jolie'
+
+
+def superuser(form):
+    return form.get('username') == 'special'
+
+
+def acl(form):
+    return form.get('username') == 'jane@mens.de' and form.get('topic', '').startswith('t/')
+
+
+def superacl(form):
+    return superuser(form) or acl(form)
+
+
+routes = {
+    '/auth': auth,
+    '/superuser': superuser,
+    '/acl': acl,
+    '/superacl': superacl,
+}
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def setup(self):
+        super().setup()
+        with lock:
+            stats['connections'] += 1
+
+    def reply(self, status, body=b''):
+        self.send_response(status)
+        self.send_header('Content-Type', 'text/plain')
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def do_POST(self):
+        length = int(self.headers.get('Content-Length', 0))
+        data = self.rfile.read(length).decode()
+        form = {k: v[0] for k, v in parse_qs(data, keep_blank_values=True).items()}
+        with lock:
+            stats['requests'] += 1
+        check = routes.get(self.path)
+        if check is None:
+            self.reply(404)
+        else:
+            self.reply(200 if check(form) else 403)
+
+    def do_GET(self):
+        if self.path == '/stats':
+            with lock:
+                body = json.dumps(stats).encode()
+            self.reply(200, body)
+        else:
+            self.reply(404)
+
+    def log_message(self, format, *args):
+        pass
+
+
+if __name__ == '__main__':
+    port = int(sys.argv[1]) if len(sys.argv) > 1 else 8100
+    ThreadingHTTPServer(('127.0.0.1', port), Handler).serve_forever()
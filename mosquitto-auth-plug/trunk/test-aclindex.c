@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2014 Jan-Piet Mens <jpmens()gmail.com>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of mosquitto nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Check the ACL index against what the back-ends' aclcheck does, i.e.
+ * t_expand() and mosquitto_topic_matches_sub() on every pattern of the
+ * user, with 100000 random topics over random sets of patterns made of
+ * literal, `+', `#', `%c', `%u' and `$' levels. Exits with status 1 if
+ * any check differs.
+ *
+ *	cc -O2 -I$(MOSQUITTO_SRC)/lib -o test-aclindex test-aclindex.c aclindex.c backends.c log.c -lmosquitto -lpthread
+ *	./test-aclindex
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <mosquitto.h>
+#include <mosquitto_plugin.h>
+#include "aclindex.h"
+
+#define ROUNDS		2000
+#define TOPICS		50
+#define PATTERNS	5
+#define DEPTH		4
+
+static const char *pattern_levels[] = {
+	"a", "b", "+", "#", "%u", "x%c", "%u-%c", "$SYS", "",
+};
+static const char *topic_levels[] = {
+	"a", "b", "user", "xclient", "user-client", "$SYS", "", "c",
+};
+
+#define NELEMS(a)	(sizeof(a) / sizeof(a[0]))
+
+static void random_topic(char *buf, const char **levels, size_t nlevels)
+{
+	int depth = 1 + random() % DEPTH, i;
+
+	*buf = 0;
+	for (i = 0; i < depth; i++) {
+		if (i)
+			strcat(buf, "/");
+		strcat(buf, levels[random() % nlevels]);
+	}
+}
+
+/* As be-mysql.c and be-postgres.c do with the rows of aclquery */
+static int expected(char patterns[][64], int npatterns, const char *topic)
+{
+	char *expanded;
+	bool bf;
+	int i, match = 0;
+
+	for (i = 0; i < npatterns && !match; i++) {
+		t_expand("client", "user", patterns[i], &expanded);
+		if (expanded == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(2);
+		}
+		bf = false;
+		mosquitto_topic_matches_sub(expanded, topic, &bf);
+		match = bf;
+		free(expanded);
+	}
+	return (match);
+}
+
+int main(void)
+{
+	struct aclindex *index;
+	char patterns[PATTERNS][64], topic[64];
+	long checks = 0, failures = 0;
+	int round, npatterns, i, got, want;
+
+	srandom(1);
+	for (round = 0; round < ROUNDS; round++) {
+		if ((index = aclindex_new()) == NULL) {
+			fprintf(stderr, "out of memory\n");
+			return (2);
+		}
+		npatterns = 1 + random() % PATTERNS;
+		for (i = 0; i < npatterns; i++) {
+			random_topic(patterns[i], pattern_levels, NELEMS(pattern_levels));
+			aclindex_add(index, "user", patterns[i], MOSQ_ACL_WRITE);
+		}
+
+		for (i = 0; i < TOPICS; i++) {
+			random_topic(topic, topic_levels, NELEMS(topic_levels));
+			want = expected(patterns, npatterns, topic);
+			got = aclindex_check(index, "client", "user", topic, MOSQ_ACL_WRITE);
+			checks++;
+			if (got != want && failures++ < 10) {
+				printf("%s: got %d, expected %d, patterns", topic, got, want);
+				for (int p = 0; p < npatterns; p++)
+					printf(" %s", patterns[p]);
+				printf("\n");
+			}
+
+			/* No read patterns: denied. Unknown user: ask the back-end */
+			if (aclindex_check(index, "client", "user", topic, MOSQ_ACL_READ) != 0 ||
+			    aclindex_check(index, "client", "other", topic, MOSQ_ACL_WRITE) != -1)
+				failures++;
+		}
+		aclindex_free(index);
+	}
+
+	printf("%ld checks, %ld failures\n", checks, failures);
+	return (failures ? 1 : 0);
+}
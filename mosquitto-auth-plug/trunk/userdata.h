@@ -30,6 +30,7 @@
 #include <time.h>
 #include "backends.h"
 #include "cache.h"
+#include "aclindex.h"
 
 #ifndef __USERDATA_H
 # define _USERDATA_H
@@ -41,7 +42,16 @@ struct userdata {
 	int fallback_be;		/* Backend to use for anonymous connections */
 	char *anonusername;		/* Configured name of anonymous MQTT user */
 	time_t cacheseconds;		/* number of seconds to cache ACL lookups */
+	unsigned cachesize;		/* maximum number of cached ACL lookups */
 	struct aclcache *aclcache;
+	struct cachestats cachestats;
+	time_t authcacheseconds;	/* number of seconds to cache verified passwords */
+	unsigned authcachesize;		/* maximum number of cached verified passwords */
+	struct authcache *authcache;
+	struct cachestats authstats;
+	unsigned char authkey[32];	/* HMAC key of the authentication cache */
+	int aclindex_be;		/* Back-end whose ACLs are indexed, or -1 */
+	struct aclloader *aclloader;
 };
 
 #endif
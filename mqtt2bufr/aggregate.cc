@@ -0,0 +1,186 @@
+/*
+ * aggregate - Streaming aggregation of samples into reports
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+
+#include "aggregate.h"
+#include "station.h"
+
+#include <cstdio>
+#include <limits>
+
+namespace {
+
+time_t to_time(const dballe::Datetime& dt) {
+    struct tm tm = {};
+    tm.tm_year = dt.year - 1900;
+    tm.tm_mon = dt.month - 1;
+    tm.tm_mday = dt.day;
+    tm.tm_hour = dt.hour;
+    tm.tm_min = dt.minute;
+    tm.tm_sec = dt.second;
+    return timegm(&tm);
+}
+
+dballe::Datetime to_datetime(time_t t) {
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    return dballe::Datetime(tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+                            tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+/// True if the context only contains numeric values of instantaneous samples
+bool is_sample(const dballe::msg::Context& ctx) {
+    if (ctx.trange.pind != 254)
+        return false;
+    for (const auto& var: ctx.data)
+        if (!var->isset() || var->info()->is_string())
+            return false;
+    return true;
+}
+
+}
+
+namespace mqtt2bufr {
+
+bool Aggregator::add(const dballe::Msg& msg, time_t now) {
+    const dballe::msg::Context* station = msg.find_station_context();
+    bool has_samples = false;
+    for (const auto& ctx: msg.data) {
+        if (ctx->is_station())
+            continue;
+        if (!is_sample(*ctx))
+            return false;
+        has_samples = true;
+    }
+    if (!has_samples)
+        return false;
+
+    dballe::Datetime dt = msg.get_datetime();
+    if (dt.is_missing())
+        return false;
+    time_t t = to_time(dt);
+    time_t start = t - t % interval;
+
+    std::string station_key;
+    make_station_key(msg, station_key);
+    char buf[64];
+    for (const auto& ctx: msg.data) {
+        if (ctx->is_station())
+            continue;
+        const dballe::Level& l = ctx->level;
+        for (const auto& var: ctx->data) {
+            snprintf(buf, sizeof(buf), "/%d,%d,%d,%d/", l.ltype1, l.l1, l.ltype2, l.l2);
+            key = station_key;
+            key += buf;
+            key += wreport::varcode_format(var->code());
+
+            Series& s = series[key];
+            if (!s.info) {
+                s.station_key = station_key;
+                s.level = l;
+                s.info = var->info();
+                if (station)
+                    for (const auto& v: station->data)
+                        if (WR_VAR_X(v->code()) != 4)
+                            s.station.push_back(*v);
+            }
+            auto i = s.open.find(start);
+            if (i == s.open.end()) {
+                if ((s.has_closed && start <= s.closed) || s.reported.count(start)) {
+                    ++late;
+                    continue;
+                }
+                i = s.open.insert(std::make_pair(start, Accumulator())).first;
+                time_t end = start + interval;
+                deadlines.push(Deadline{(end > now ? end : now) + grace, &s, start});
+            }
+            i->second.add(var->enqd());
+            s.last = now;
+            ++samples;
+        }
+    }
+    return true;
+}
+
+void Aggregator::report(const Series& s, time_t start, const Accumulator& acc,
+                        std::map<std::pair<std::string, time_t>, std::size_t>& msgs,
+                        std::vector<dballe::Msg>& out) const {
+    const time_t end = start + interval;
+    auto i = msgs.find(std::make_pair(s.station_key, end));
+    if (i == msgs.end()) {
+        out.emplace_back();
+        dballe::Msg& msg = out.back();
+        const dballe::Level station_level;
+        const dballe::Trange station_trange;
+        for (const auto& var: s.station)
+            msg.set(var, var.code(), station_level, station_trange);
+        msg.set_datetime(to_datetime(end));
+        i = msgs.insert(std::make_pair(std::make_pair(s.station_key, end), out.size() - 1)).first;
+    }
+    dballe::Msg& msg = out[i->second];
+    msg.set(std::unique_ptr<wreport::Var>(new wreport::Var(s.info, acc.sum / acc.count)),
+            s.level, dballe::Trange(0, 0, interval));
+    msg.set(std::unique_ptr<wreport::Var>(new wreport::Var(s.info, acc.max)),
+            s.level, dballe::Trange(2, 0, interval));
+    msg.set(std::unique_ptr<wreport::Var>(new wreport::Var(s.info, acc.min)),
+            s.level, dballe::Trange(3, 0, interval));
+}
+
+void Aggregator::close(time_t now, std::vector<dballe::Msg>& out) {
+    // Reports of the same station and datetime, by index in out
+    std::map<std::pair<std::string, time_t>, std::size_t> msgs;
+    while (!deadlines.empty() && deadlines.top().when <= now) {
+        Deadline d = deadlines.top();
+        deadlines.pop();
+        Series& s = *d.series;
+        auto i = s.open.find(d.start);
+        if (i == s.open.end())
+            continue;
+        report(s, d.start, i->second, msgs, out);
+        s.open.erase(i);
+        s.reported.insert(d.start);
+        // Past their grace, the reported intervals and the older ones are late
+        while (!s.reported.empty() && *s.reported.begin() + interval + grace <= now) {
+            if (!s.has_closed || *s.reported.begin() > s.closed) {
+                s.closed = *s.reported.begin();
+                s.has_closed = true;
+            }
+            s.reported.erase(s.reported.begin());
+        }
+    }
+
+    // Forget the idle series, at most once per interval
+    if (now - swept < interval)
+        return;
+    swept = now;
+    for (auto i = series.begin(); i != series.end(); )
+        if (i->second.open.empty() && i->second.last + interval + grace < now)
+            i = series.erase(i);
+        else
+            ++i;
+}
+
+void Aggregator::close_all(std::vector<dballe::Msg>& out) {
+    close(std::numeric_limits<time_t>::max(), out);
+}
+
+}
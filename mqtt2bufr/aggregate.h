@@ -0,0 +1,146 @@
+/*
+ * aggregate - Streaming aggregation of samples into reports
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+#ifndef MQTT2BUFR_AGGREGATE_H
+#define MQTT2BUFR_AGGREGATE_H
+
+#include <ctime>
+#include <functional>
+#include <map>
+#include <queue>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <dballe/msg/msg.h>
+
+namespace mqtt2bufr {
+
+/**
+ * Aggregate instantaneous samples (time range `254,0,0`) into reports.
+ *
+ * Samples are accumulated per series (station, variable and level) and
+ * interval: when the interval is closed, a report with the mean, maximum and
+ * minimum of the samples (time ranges `0,0,INTERVAL`, `2,0,INTERVAL` and
+ * `3,0,INTERVAL`) and the end of the interval as datetime is produced. An
+ * accumulator only keeps count, sum, minimum and maximum of the samples.
+ *
+ * An interval is closed `grace` seconds after its end, or after its first
+ * sample arrived if later, so that the samples arriving late (e.g. records
+ * resent by a station after a reconnection) are still aggregated. Samples of
+ * an interval already reported are dropped and counted as late, as are the
+ * samples of an interval older than a reported one whose grace expired.
+ *
+ * A series with no open intervals is forgotten after `interval + grace`
+ * seconds without samples.
+ */
+class Aggregator {
+ protected:
+  struct Accumulator {
+      unsigned long count = 0;
+      double sum = 0;
+      double min = 0;
+      double max = 0;
+
+      void add(double val) {
+          if (count == 0 || val < min) min = val;
+          if (count == 0 || val > max) max = val;
+          sum += val;
+          ++count;
+      }
+  };
+
+  struct Series {
+      /// Station context of the samples, without the datetime
+      std::vector<wreport::Var> station;
+      std::string station_key;
+      dballe::Level level;
+      wreport::Varinfo info = nullptr;
+      /// Open intervals, by start
+      std::map<time_t, Accumulator> open;
+      /// Starts of the reported intervals, still in their grace
+      std::set<time_t> reported;
+      /// Intervals up to this start are late
+      time_t closed = 0;
+      bool has_closed = false;
+      /// When the last sample was added
+      time_t last = 0;
+  };
+
+  struct Deadline {
+      time_t when;
+      Series* series;
+      time_t start;
+
+      bool operator>(const Deadline& o) const { return when > o.when; }
+  };
+
+  unsigned interval;
+  unsigned grace;
+  /// Series by station key, level and variable
+  std::unordered_map<std::string, Series> series;
+  std::priority_queue<Deadline, std::vector<Deadline>, std::greater<Deadline>> deadlines;
+  std::string key;
+  /// When the idle series were last looked for
+  time_t swept = 0;
+
+  /// Add the report of an interval of s to out
+  void report(const Series& s, time_t start, const Accumulator& acc,
+              std::map<std::pair<std::string, time_t>, std::size_t>& msgs,
+              std::vector<dballe::Msg>& out) const;
+
+ public:
+  /// Samples aggregated
+  unsigned long long samples = 0;
+  /// Samples dropped because their interval was already reported
+  unsigned long long late = 0;
+
+  /**
+   * @param interval length of the intervals in seconds, starting at
+   *                 00:00:00 UTC
+   * @param grace how long, in seconds, an interval is kept open
+   */
+  Aggregator(unsigned interval, unsigned grace)
+      : interval(interval), grace(grace) {}
+
+  /**
+   * Accumulate the samples of the message.
+   *
+   * @return true if the message only contains samples, and was consumed
+   */
+  bool add(const dballe::Msg& msg, time_t now);
+
+  /**
+   * Close the intervals whose deadline is not after now, appending their
+   * reports to out: the reports of a station with the same datetime are in
+   * the same message.
+   */
+  void close(time_t now, std::vector<dballe::Msg>& out);
+
+  /// Close all the open intervals
+  void close_all(std::vector<dballe::Msg>& out);
+};
+
+}
+
+#endif
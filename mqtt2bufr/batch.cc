@@ -0,0 +1,199 @@
+/*
+ * batch - Batched BUFR output
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+
+#include "batch.h"
+#include "station.h"
+
+#include <cstdio>
+#include <iostream>
+
+#include <wreport/bulletin.h>
+
+namespace {
+
+std::size_t count_vars(const dballe::Msg& msg) {
+    std::size_t count = 0;
+    for (const auto& ctx: msg.data)
+        count += ctx->data.size();
+    return count;
+}
+
+/// True if all the variables of b are in a, with the same value and attributes
+bool contains(const dballe::Msg& a, const dballe::Msg& b) {
+    for (const auto& ctx: b.data)
+        for (const auto& var: ctx->data) {
+            const wreport::Var* v = a.find(var->code(), ctx->level, ctx->trange);
+            if (!v || *v != *var)
+                return false;
+        }
+    return true;
+}
+
+}
+
+namespace mqtt2bufr {
+
+void Batch::make_key(const dballe::Msg& msg) {
+    make_station_key(msg, key);
+    dballe::Datetime dt = msg.get_datetime();
+    if (!dt.is_missing()) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%04d%02d%02d%02d%02d%02d",
+                 dt.year, dt.month, dt.day, dt.hour, dt.minute, dt.second);
+        key += buf;
+    }
+}
+
+void Batch::add(dballe::Msg&& msg) {
+    if (count == 0)
+        started = std::chrono::steady_clock::now();
+    ++count;
+
+    if (!group) {
+        msgs.push_back(std::move(msg));
+        return;
+    }
+
+    make_key(msg);
+    auto i = index.find(key);
+    if (i == index.end()) {
+        index.emplace(key, msgs.size());
+        msgs.push_back(std::move(msg));
+        return;
+    }
+
+    dballe::Msg& dest = msgs[i->second];
+    for (const auto& ctx: msg.data)
+        for (const auto& var: ctx->data)
+            dest.set(*var, var->code(), ctx->level, ctx->trange);
+}
+
+void Batch::make_template_key(const dballe::Msg& msg) {
+    char buf[64];
+    key.clear();
+    for (const auto& ctx: msg.data) {
+        const dballe::Level& l = ctx->level;
+        const dballe::Trange& t = ctx->trange;
+        snprintf(buf, sizeof(buf), "/%d,%d,%d,%d/%d,%d,%d",
+                 l.ltype1, l.l1, l.ltype2, l.l2, t.pind, t.p1, t.p2);
+        key += buf;
+        for (const auto& var: ctx->data) {
+            key += ' ';
+            key += wreport::varcode_format(var->code());
+            for (const wreport::Var* a = var->next_attr(); a; a = a->next_attr()) {
+                key += '.';
+                key += wreport::varcode_format(a->code());
+            }
+        }
+    }
+}
+
+bool Batch::same_observations(const std::string& bulletin, const dballe::Messages& msgs) const {
+    dballe::BinaryMessage binary(dballe::File::BUFR);
+    binary.data = bulletin;
+    dballe::Messages decoded = importer.from_binary(binary);
+    if (decoded.size() != msgs.size())
+        return false;
+    for (std::size_t i = 0; i < msgs.size(); ++i) {
+        const dballe::Msg& orig = dballe::Msg::downcast(*msgs[i]);
+        const dballe::Msg& dec = dballe::Msg::downcast(*decoded[i]);
+        // Same number of variables, each found with the same value on the
+        // other side: nothing lost and nothing added
+        if (count_vars(orig) != count_vars(dec) || !contains(dec, orig) || !contains(orig, dec))
+            return false;
+    }
+    return true;
+}
+
+void Batch::encode_single(const dballe::Messages& msgs) {
+    // Generic messages with different variables cannot share the data
+    // descriptors of a single multi-subset bulletin: encode them one by one
+    // and concatenate them.
+    dballe::Messages single;
+    for (const auto& msg: msgs) {
+        single.clear();
+        single.append(*msg);
+        try {
+            buffer += exporter.to_binary(single);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+        }
+    }
+}
+
+void Batch::encode_compressed(const dballe::Messages& msgs) {
+    try {
+        std::unique_ptr<wreport::Bulletin> bulletin = exporter.to_bulletin(msgs);
+        wreport::BufrBulletin& bufr = dynamic_cast<wreport::BufrBulletin&>(*bulletin);
+        bufr.compression = true;
+        std::string data = bufr.encode();
+        if (!verify || same_observations(data, msgs)) {
+            buffer += data;
+            return;
+        }
+        std::cerr << "Compressed bulletin does not match its " << msgs.size()
+                  << " messages, writing them uncompressed" << std::endl;
+    } catch (const std::exception& e) {
+        std::cerr << "Cannot encode " << msgs.size() << " messages in a compressed bulletin, "
+                  << "writing them uncompressed: " << e.what() << std::endl;
+    }
+    encode_single(msgs);
+}
+
+const std::string& Batch::encode() {
+    buffer.clear();
+    if (compress) {
+        // Bulletins by data template, in order of first message
+        std::unordered_map<std::string, std::size_t> templates;
+        std::vector<dballe::Messages> bulletins;
+        for (auto& msg: msgs) {
+            make_template_key(msg);
+            auto i = templates.emplace(key, bulletins.size());
+            if (i.second)
+                bulletins.emplace_back();
+            bulletins[i.first->second].append(
+                    std::unique_ptr<dballe::Message>(new dballe::Msg(std::move(msg))));
+        }
+        for (const auto& b: bulletins)
+            encode_compressed(b);
+    } else {
+        dballe::Messages all;
+        for (auto& msg: msgs)
+            all.append(std::unique_ptr<dballe::Message>(new dballe::Msg(std::move(msg))));
+        encode_single(all);
+    }
+    msgs.clear();
+    index.clear();
+    count = 0;
+    return buffer;
+}
+
+void Batch::flush(std::ostream& out) {
+    if (count == 0)
+        return;
+    const std::string& data = encode();
+    out.write(data.data(), data.size());
+    out.flush();
+}
+
+}
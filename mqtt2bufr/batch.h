@@ -0,0 +1,119 @@
+/*
+ * batch - Batched BUFR output
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+#ifndef MQTT2BUFR_BATCH_H
+#define MQTT2BUFR_BATCH_H
+
+#include <chrono>
+#include <iosfwd>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <dballe/msg/msg.h>
+#include <dballe/msg/wr_codec.h>
+
+namespace mqtt2bufr {
+
+/**
+ * Collect messages and write them as a single block of BUFR messages.
+ *
+ * When grouping is enabled, messages with the same station (ident,
+ * coordinates, report) and the same datetime are merged in a single message,
+ * so that they share a bulletin.
+ *
+ * When compression is enabled, messages with the same data template (same
+ * variables, attributes, levels and time ranges) are encoded as the subsets
+ * of a single compressed bulletin, instead of a bulletin each.
+ */
+class Batch {
+ protected:
+  bool group;
+  std::vector<dballe::Msg> msgs;
+  /// Index in msgs of each station and datetime, when grouping
+  std::unordered_map<std::string, std::size_t> index;
+  std::size_t count = 0;
+  bool compress = false;
+  bool verify = false;
+  std::chrono::steady_clock::time_point started;
+  dballe::msg::BufrExporter exporter;
+  dballe::msg::BufrImporter importer;
+  std::string key;
+  std::string buffer;
+
+  /// Set key to the grouping key of the message
+  void make_key(const dballe::Msg& msg);
+  /// Set key to the data template of the message
+  void make_template_key(const dballe::Msg& msg);
+  /// Append the messages to buffer as a single compressed bulletin
+  void encode_compressed(const dballe::Messages& msgs);
+  /// Append the messages to buffer, a bulletin each
+  void encode_single(const dballe::Messages& msgs);
+  /// True if the bulletin decodes to the same observations of msgs
+  bool same_observations(const std::string& bulletin, const dballe::Messages& msgs) const;
+
+ public:
+  Batch(bool group=false) : group(group) {}
+
+  /**
+   * Encode the messages with the same data template in compressed
+   * multi-subset bulletins.
+   *
+   * @param verify decode each bulletin and check it against the messages,
+   *               writing them uncompressed if they differ
+   */
+  void set_compression(bool verify=false) {
+      compress = true;
+      this->verify = verify;
+  }
+
+  /// True if the messages are merged by station and datetime
+  bool grouping() const { return group; }
+  /// True if the messages are encoded in compressed bulletins
+  bool compressing() const { return compress; }
+
+  /// Add a message to the batch
+  void add(dballe::Msg&& msg);
+  /// Number of messages added since the last flush
+  std::size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+  /// Time elapsed since the first message of the batch was added
+  std::chrono::steady_clock::duration age() const {
+      return std::chrono::steady_clock::now() - started;
+  }
+  /**
+   * Encode the messages and clear the batch.
+   *
+   * Messages that cannot be encoded are reported on stderr and skipped.
+   *
+   * @return the encoded messages, valid until the next call
+   */
+  const std::string& encode();
+  /**
+   * Encode the messages, write them with a single write and clear the batch.
+   */
+  void flush(std::ostream& out);
+};
+
+}
+
+#endif
@@ -0,0 +1,111 @@
+#!/bin/sh
+# End-to-end throughput of mqtt2bufr: publish a synthetic corpus to a local
+# mosquitto broker and measure the time until mqtt2bufr has converted every
+# message. The result is written to stdout as JSON.
+#
+# Usage: bench-e2e.sh [COUNT [MQTT2BUFR OPTIONS...]]
+#
+# Environment: MOSQUITTO (broker executable, default: mosquitto), BENCH_PORT
+# (default: 18830), BENCH_TIMEOUT (seconds, default: 120), BENCH_INSTANCES
+# (number of mqtt2bufr instances sharing the subscription, default: 1).
+#
+# The messages are counted with the statistics of the instances (see
+# --stats-socket), read with socat.
+
+COUNT=${1:-10000}
+[ $# -gt 0 ] && shift
+MOSQUITTO=${MOSQUITTO:-mosquitto}
+PORT=${BENCH_PORT:-18830}
+TIMEOUT=${BENCH_TIMEOUT:-120}
+INSTANCES=${BENCH_INSTANCES:-1}
+
+if ! command -v "$MOSQUITTO" >/dev/null 2>&1; then
+    echo "$MOSQUITTO not found, skipping the end-to-end benchmark" >&2
+    exit 77
+fi
+if ! command -v socat >/dev/null 2>&1; then
+    echo "socat not found, skipping the end-to-end benchmark" >&2
+    exit 77
+fi
+
+tmp=$(mktemp -d)
+broker=
+subscribers=
+cleanup() {
+    [ -n "$subscribers" ] && kill $subscribers 2>/dev/null
+    [ -n "$broker" ] && kill $broker 2>/dev/null
+    rm -rf "$tmp"
+}
+trap cleanup EXIT INT TERM
+
+now() {
+    date +%s.%N
+}
+
+# Messages written, rejected (topic or payload errors) and dropped as
+# duplicates by all the mqtt2bufr instances, from their statistics
+counts() {
+    for socket in "$tmp"/stats.*; do
+        socat - UNIX-CONNECT:"$socket" 2>/dev/null
+    done | awk '
+    function counter(line, name) {
+        if (match(line, "\"" name "\": [0-9]+"))
+            return substr(line, RSTART + length(name) + 4, RLENGTH - length(name) - 4)
+        return 0
+    }
+    {
+        written += counter($0, "written")
+        failed += counter($0, "errors_topic") + counter($0, "errors_payload")
+        duplicates += counter($0, "duplicates")
+    }
+    END { print written + 0, failed + 0, duplicates + 0 }'
+}
+converted() {
+    counts | awk '{ print $1 + $2 + $3 }'
+}
+
+./gen-corpus -n "$COUNT" -t bench > "$tmp/corpus" || exit 1
+
+"$MOSQUITTO" -p "$PORT" > "$tmp/broker.log" 2>&1 &
+broker=$!
+sleep 1
+
+if [ "$INSTANCES" -gt 1 ]; then
+    # Instances sharing the subscription, splitting the messages
+    i=0
+    while [ $i -lt "$INSTANCES" ]; do
+        ./mqtt2bufr -p "$PORT" -t 'bench/#' --share bench --id-suffix "-bench-$i" \
+            --stats-socket "$tmp/stats.$i" "$@" > "$tmp/out.$i.bufr" 2> "$tmp/err.$i" &
+        subscribers="$subscribers $!"
+        i=$((i + 1))
+    done
+else
+    ./mqtt2bufr -p "$PORT" -t 'bench/#' --stats-socket "$tmp/stats.0" "$@" \
+        > "$tmp/out.0.bufr" 2> "$tmp/err.0" &
+    subscribers=$!
+fi
+sleep 1
+
+start=$(now)
+./bench-publish -p "$PORT" < "$tmp/corpus" > "$tmp/publish.json" || exit 1
+deadline=$(($(date +%s) + TIMEOUT))
+while [ "$(converted)" -lt "$COUNT" ] && [ "$(date +%s)" -lt "$deadline" ]; do
+    sleep 0.01
+done
+end=$(now)
+
+read written failed duplicates <<EOF
+$(counts)
+EOF
+awk -v count="$COUNT" -v written="$written" -v failed="$failed" -v duplicates="$duplicates" \
+    -v instances="$INSTANCES" \
+    -v start="$start" -v end="$end" -v options="$*" \
+    -v publish="$(cat "$tmp/publish.json")" 'BEGIN {
+    seconds = end - start
+    converted = written + failed + duplicates
+    printf "{\"suite\": \"e2e\", \"messages\": %d, \"written\": %d, \"failed\": %d, \"duplicates\": %d, ", count, written, failed, duplicates
+    printf "\"options\": \"%s\", \"instances\": %d, \"seconds\": %f, \"msgs_per_s\": %f, ", options, instances, seconds, (seconds > 0 ? converted / seconds : 0)
+    printf "\"publish\": %s}\n", publish
+}'
+
+[ $((written + failed + duplicates)) -eq "$COUNT" ]
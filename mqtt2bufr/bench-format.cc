@@ -0,0 +1,206 @@
+/*
+ * bench-format - Benchmark for bufr2mqtt::Parser
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <jansson.h>
+
+#include <dballe/core/var.h>
+#include <dballe/msg/msg.h>
+#include <dballe/msg/wr_codec.h>
+
+#include "bench.h"
+#include "parser.h"
+
+namespace bench = mqtt2bufr::bench;
+
+// Former stringstream and jansson based formatter, kept as a reference for
+// the benchmark.
+static void legacy_parse(const wreport::Var& var, const dballe::Level& level, const dballe::Trange& trange,
+                         const dballe::msg::Context& station_context,
+                         const dballe::Datetime& datetime,
+                         std::string& topic, std::string& payload) {
+    topic.clear();
+    payload.clear();
+    topic = "/";
+    if (const wreport::Var* v = station_context.find(WR_VAR(0, 1, 11)))
+        topic += v->enqc();
+    else
+        topic += "-";
+    topic += "/";
+    if (const wreport::Var* v = station_context.find(WR_VAR(0, 6,  1)))
+        topic += v->enqc();
+    else
+        topic += "-";
+    topic +=",";
+    if (const wreport::Var* v = station_context.find(WR_VAR(0, 5,  1)))
+        topic += v->enqc();
+    else
+        topic += "-";
+    topic += "/";
+    if (const wreport::Var* v = station_context.find(WR_VAR(0, 1,194)))
+        topic += v->enqc();
+    else
+        topic += "-";
+    topic += "/";
+    {
+        std::stringstream ss;
+        trange.to_stream(ss);
+        topic += ss.str();
+    }
+    topic += "/";
+    {
+        std::stringstream ss;
+        level.to_stream(ss);
+        topic += ss.str();
+    }
+    topic += "/";
+    topic += wreport::varcode_format(var.code());
+
+    json_t* root = json_object();
+    json_t* v;
+    v = json_string(var.enqc());
+    json_object_set_new(root, "v", v);
+    if (level != dballe::Level() && trange != dballe::Trange()) {
+        std::stringstream ss;
+        datetime.to_stream_iso8601(ss, 'T', "");
+        v = json_string(ss.str().c_str());
+        json_object_set_new(root, "t", v);
+    }
+    v = NULL;
+    for (const wreport::Var* a = var.next_attr(); a != NULL; a = a->next_attr()) {
+        if (!v) {
+            v = json_object();
+            json_object_set_new(root, "a", v);
+        }
+        json_t* av = json_string(a->enqc());
+        json_object_set_new(v, wreport::varcode_format(a->code()).c_str(), av);
+    }
+    char* s = json_dumps(root, 0);
+    payload = s;
+    free(s);
+    json_decref(root);
+}
+
+/**
+ * Synthetic corpus: hourly reports of a station network, each with the
+ * station information and a typical set of measurements.
+ */
+static dballe::Messages make_corpus(unsigned stations) {
+    dballe::Messages msgs;
+    const dballe::Level station_level;
+    const dballe::Trange station_trange;
+    for (unsigned i = 0; i < stations; ++i) {
+        dballe::Msg msg;
+        msg.set(dballe::newvar(WR_VAR(0, 6,  1), (int)(1100000 + i * 1000)), station_level, station_trange);
+        msg.set(dballe::newvar(WR_VAR(0, 5,  1), (int)(4400000 + i * 700)), station_level, station_trange);
+        msg.set(dballe::newvar(WR_VAR(0, 1,194), "locali"), station_level, station_trange);
+        msg.set(dballe::newvar(WR_VAR(0, 1, 19), "Station name"), station_level, station_trange);
+        msg.set(dballe::newvar(WR_VAR(0, 7, 30), 50.5), station_level, station_trange);
+
+        const dballe::Trange inst(254, 0, 0);
+        const dballe::Level h2m(103, 2000);
+        std::unique_ptr<wreport::Var> t = dballe::newvar(WR_VAR(0, 12, 101), 293.15);
+        t->seta(dballe::var("B33196", "0"));
+        t->seta(dballe::var("B33007", "70"));
+        msg.set(std::move(t), h2m, inst);
+        std::unique_ptr<wreport::Var> rh = dballe::newvar(WR_VAR(0, 13, 3), 65);
+        rh->seta(dballe::var("B33007", "80"));
+        msg.set(std::move(rh), h2m, inst);
+        msg.set(dballe::newvar(WR_VAR(0, 12, 101), 291.15), h2m, dballe::Trange(2, 0, 3600));
+        msg.set(dballe::newvar(WR_VAR(0, 12, 101), 295.15), h2m, dballe::Trange(3, 0, 3600));
+        msg.set(dballe::newvar(WR_VAR(0, 10, 4), 101325.0), dballe::Level(1), inst);
+        msg.set(dballe::newvar(WR_VAR(0, 13, 11), 1.2), dballe::Level(1), dballe::Trange(1, 0, 3600));
+        msg.set(dballe::newvar(WR_VAR(0, 11, 1), 270), dballe::Level(103, 10000), dballe::Trange(200, 0, 600));
+        msg.set(dballe::newvar(WR_VAR(0, 11, 2), 3.5), dballe::Level(103, 10000), dballe::Trange(200, 0, 600));
+        msg.set(dballe::newvar(WR_VAR(0, 14, 198), 350), dballe::Level(1), dballe::Trange(0, 0, 3600));
+        msg.set_datetime(dballe::Datetime(2016, 1, 28, 10, 0, 0));
+        msgs.append(std::move(msg));
+    }
+    return msgs;
+}
+
+/// Read a BUFR file as corpus
+static dballe::Messages read_corpus(const char* pathname) {
+    dballe::Messages msgs;
+    std::unique_ptr<dballe::File> input = dballe::File::create(dballe::File::BUFR, pathname, "r");
+    dballe::msg::BufrImporter importer;
+    input->foreach([&](const dballe::BinaryMessage& bmsg) {
+        return importer.foreach_decoded(bmsg, [&](std::unique_ptr<dballe::Message>&& msg) {
+            msgs.append(std::move(msg));
+            return true;
+        });
+    });
+    return msgs;
+}
+
+/// Run format over the variables of msgs
+template<typename F>
+static bench::Result run(const char* name, const dballe::Messages& msgs, unsigned iterations, F format) {
+    std::string topic;
+    std::string payload;
+
+    return bench::run(name, iterations, [&](bench::Result& res) {
+        for (const auto& m: msgs) {
+            const dballe::Msg& msg = dballe::Msg::downcast(*m);
+            const dballe::msg::Context& station = *msg.find_station_context();
+            const dballe::Datetime datetime = msg.get_datetime();
+            for (const auto& ctx: msg.data)
+                for (const auto& var: ctx->data) {
+                    format(*var, ctx->level, ctx->trange, station, datetime, topic, payload);
+                    res.bytes += topic.size() + payload.size();
+                    ++res.operations;
+                }
+        }
+    });
+}
+
+int main(int argc, char** argv)
+{
+    bench::Options opts(argc, argv, 1000);
+    dballe::Messages msgs = opts.args.empty() ? make_corpus(100) : read_corpus(opts.args[0].c_str());
+    std::vector<bench::Result> results;
+    bufr2mqtt::Parser parser;
+    const dballe::msg::Context* last_station = nullptr;
+
+    results.push_back(run("legacy", msgs, opts.iterations, legacy_parse));
+    auto format = [&](const wreport::Var& var, const dballe::Level& level, const dballe::Trange& trange,
+                      const dballe::msg::Context& station, const dballe::Datetime& datetime,
+                      std::string& topic, std::string& payload) {
+        // The station prefix is formatted once per message, as bufr2mqtt does
+        if (&station != last_station) {
+            parser.set_station(station);
+            last_station = &station;
+        }
+        parser.parse(var, level, trange, datetime, topic, payload);
+    };
+    results.push_back(run("parser", msgs, opts.iterations, format));
+
+    bench::report("format", opts, results);
+    return 0;
+}
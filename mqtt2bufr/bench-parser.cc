@@ -0,0 +1,58 @@
+/*
+ * bench-parser - Benchmark for the MQTT message parser
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string>
+#include <vector>
+
+#include "bench.h"
+#include "parser.h"
+
+namespace bench = mqtt2bufr::bench;
+
+int main(int argc, char** argv)
+{
+    bench::Options opts(argc, argv, 100000);
+    mqtt2bufr::Parser parser;
+    std::string topic;
+    std::string payload;
+
+    bench::Result result = bench::run("parser", opts.iterations, [&](bench::Result& res) {
+        for (const auto& s: bench::samples) {
+            topic = s.topic;
+            payload = s.payload;
+            try {
+                dballe::Msg msg = parser.parse(topic, payload);
+                res.bytes += topic.size() + payload.size();
+            } catch (const std::exception& e) {
+                ++res.errors;
+            }
+            ++res.operations;
+        }
+    });
+
+    bench::report("parser", opts, { result });
+    return 0;
+}
@@ -0,0 +1,89 @@
+/*
+ * bench-payload - Benchmark for the MQTT payload decoder
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <jansson.h>
+
+#include "bench.h"
+#include "payload.h"
+
+namespace bench = mqtt2bufr::bench;
+
+/// Run f over the payloads of the samples
+template<typename F>
+static bench::Result run(const char* name, unsigned iterations, F f) {
+    return bench::run(name, iterations, [&](bench::Result& res) {
+        for (const auto& s: bench::samples) {
+            std::size_t size = strlen(s.payload);
+            res.checksum += f(s.payload, size);
+            res.bytes += size;
+            ++res.operations;
+        }
+    });
+}
+
+int main(int argc, char** argv)
+{
+    bench::Options opts(argc, argv, 100000);
+    std::vector<bench::Result> results;
+
+    // Same work done by the former Parser::parse_payload: copy the payload in
+    // a string, load the document and look up the keys.
+    results.push_back(run("jansson", opts.iterations, [](const char* data, std::size_t size) {
+        std::string payload(data, size);
+        json_t* root = json_loads(payload.c_str(), 0, NULL);
+        unsigned long long res = 0;
+        if (json_t* v = json_object_get(root, "v"))
+            res += json_is_integer(v) ? json_integer_value(v) : 1;
+        if (json_t* t = json_object_get(root, "t"))
+            res += strlen(json_string_value(t));
+        if (json_t* a = json_object_get(root, "a"))
+            for (void* i = json_object_iter(a); i; i = json_object_iter_next(a, i))
+                res += strlen(json_string_value(json_object_iter_value(i)));
+        json_decref(root);
+        return res;
+    }));
+
+    mqtt2bufr::PayloadDecoder decoder;
+    results.push_back(run("PayloadDecoder", opts.iterations, [&decoder](const char* data, std::size_t size) {
+        decoder.decode(data, size);
+        unsigned long long res = 0;
+        res += decoder.value.type == mqtt2bufr::PayloadValue::INTEGER ? decoder.value.i : 1;
+        if (decoder.datetime.type == mqtt2bufr::PayloadValue::STRING) {
+            const std::string& t = decoder.datetime.str;
+            res += mqtt2bufr::parse_datetime(t.data(), t.size()).year ? t.size() : 0;
+        }
+        for (std::size_t i = 0; i < decoder.attributes_count; ++i)
+            res += decoder.attributes[i].value.str.size();
+        return res;
+    }));
+
+    bench::report("payload", opts, results);
+    return 0;
+}
@@ -0,0 +1,181 @@
+/*
+ * bench-publish - Publish a corpus of MQTT messages as fast as possible
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <getopt.h>
+
+#include <mosquittopp.h>
+
+#include "inflight.h"
+
+struct Publisher : mosqpp::mosquittopp {
+    bufr2mqtt::MidSet mids;
+    std::mutex mutex;
+    std::condition_variable acked;
+
+    virtual void on_publish(int mid) {
+        std::lock_guard<std::mutex> lock(mutex);
+        mids.erase(mid);
+        acked.notify_all();
+    }
+
+    /// Wait until at most max_size messages are waiting for an acknowledgement
+    bool wait(std::unique_lock<std::mutex>& lock, std::size_t max_size) {
+        return acked.wait_for(lock, std::chrono::seconds(30),
+                              [&] { return mids.size() <= max_size; });
+    }
+};
+
+void print_help(std::ostream& out)
+{
+    out << "Usage: bench-publish [OPTIONS]" << std::endl
+        << "Publish the messages written by gen-corpus, read from stdin, and" << std::endl
+        << "print the publishing rate as JSON" << std::endl
+        << "Options are" << std::endl
+        << " --help             show this help and exit" << std::endl
+        << " -h,--host NAME     host to connect to (default: localhost)" << std::endl
+        << " -p,--port PORT     connect to the port specified (default: 1883)" << std::endl
+        << " -q,--qos QOS       quality of service (default: 1)" << std::endl
+        << " -w,--window N      messages waiting for an acknowledgement (default: 100)" << std::endl
+        ;
+}
+
+int main(int argc, char** argv)
+{
+    static int show_help = 0;
+    std::string hostname = "localhost";
+    int port = 1883;
+    int qos = 1;
+    std::size_t window = 100;
+
+    while (1) {
+        int c;
+        int opt_idx = 0;
+        static struct option opts[] = {
+            { "help", no_argument, &show_help, 1 },
+            { "host", required_argument, 0, 'h' },
+            { "port", required_argument, 0, 'p' },
+            { "qos", required_argument, 0, 'q' },
+            { "window", required_argument, 0, 'w' },
+            { 0, 0, 0, 0 }
+        };
+
+        c = getopt_long(argc, argv, "h:p:q:w:", opts, &opt_idx);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 0:
+                if (show_help) {
+                  print_help(std::cout);
+                  return 0;
+                }
+                break;
+            case 'h':
+                hostname = optarg;
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'q':
+                qos = atoi(optarg);
+                break;
+            case 'w':
+                window = strtoul(optarg, NULL, 10);
+                if (window < 1 || window > 65535)
+                    window = 100;
+                break;
+            default:
+                print_help(std::cerr);
+                return 1;
+        }
+    }
+
+    std::vector<std::pair<std::string, std::string>> corpus;
+    std::string line;
+    while (std::getline(std::cin, line)) {
+        std::size_t sep = line.find(' ');
+        if (sep == std::string::npos)
+            continue;
+        corpus.emplace_back(line.substr(0, sep), line.substr(sep + 1));
+    }
+
+    mosqpp::lib_init();
+    Publisher publisher;
+    publisher.max_inflight_messages_set(window);
+    if (publisher.connect(hostname.c_str(), port, 60) != 0) {
+        std::cerr << "Error while connecting to " << hostname << ":" << port << std::endl;
+        return 1;
+    }
+    if (publisher.loop_start() != 0) {
+        std::cerr << "Error while starting the network loop" << std::endl;
+        return 1;
+    }
+
+    unsigned long long errors = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (const auto& m: corpus) {
+        std::unique_lock<std::mutex> lock(publisher.mutex);
+        if (!publisher.wait(lock, window - 1)) {
+            std::cerr << "Ack timeout error" << std::endl;
+            return 2;
+        }
+        int mid;
+        if (publisher.publish(&mid, m.first.c_str(), m.second.size(), m.second.data(), qos, false) != 0)
+            ++errors;
+        else if (qos > 0)
+            publisher.mids.insert(mid);
+    }
+    {
+        std::unique_lock<std::mutex> lock(publisher.mutex);
+        if (!publisher.wait(lock, 0)) {
+            std::cerr << "Ack timeout error" << std::endl;
+            return 2;
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(end - start).count();
+
+    publisher.disconnect();
+    publisher.loop_stop();
+    mosqpp::lib_cleanup();
+
+    std::cout << "{\"name\": \"publish\", \"messages\": " << corpus.size()
+              << ", \"errors\": " << errors
+              << ", \"qos\": " << qos
+              << ", \"window\": " << window
+              << ", \"seconds\": " << seconds
+              << ", \"msgs_per_s\": " << (seconds > 0 ? corpus.size() / seconds : 0)
+              << "}" << std::endl;
+    return 0;
+}
@@ -0,0 +1,81 @@
+/*
+ * bench-suite - Benchmark of the BUFR export of the synthetic corpus
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <dballe/msg/msg.h>
+#include <dballe/msg/wr_codec.h>
+
+#include "bench.h"
+#include "corpus.h"
+#include "parser.h"
+
+namespace bench = mqtt2bufr::bench;
+
+int main(int argc, char** argv)
+{
+    bench::Options opts(argc, argv, 10);
+    mqtt2bufr::CorpusOptions corpus_opts;
+    if (!opts.args.empty())
+        corpus_opts.count = strtoul(opts.args[0].c_str(), NULL, 10);
+    const std::vector<mqtt2bufr::CorpusMessage> corpus = mqtt2bufr::make_corpus(corpus_opts);
+    std::vector<bench::Result> results;
+
+    // Messages decoded once, as input of the benchmark: parsing is measured
+    // by bench-parser, formatting by bench-format
+    std::vector<dballe::Msg> msgs;
+    {
+        mqtt2bufr::Parser parser;
+        for (const auto& m: corpus)
+            msgs.push_back(parser.parse(m.topic, m.payload));
+    }
+
+    // dballe::Msg to BUFR
+    dballe::msg::BufrExporter exporter;
+    dballe::Messages single;
+    results.push_back(bench::run("bufr_export", opts.iterations, [&](bench::Result& res) {
+        for (const auto& msg: msgs) {
+            single.clear();
+            single.append(msg);
+            try {
+                res.bytes += exporter.to_binary(single).size();
+            } catch (const std::exception& e) {
+                ++res.errors;
+            }
+            ++res.operations;
+        }
+    }));
+
+    std::ostringstream corpus_json;
+    corpus_json << "\"corpus\": {\"messages\": " << corpus_opts.count
+                << ", \"fixed_stations\": " << corpus_opts.fixed_stations
+                << ", \"mobile_stations\": " << corpus_opts.mobile_stations
+                << ", \"seed\": " << corpus_opts.seed << "},";
+    bench::report("micro", opts, results, corpus_json.str());
+    return 0;
+}
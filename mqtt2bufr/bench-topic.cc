@@ -0,0 +1,92 @@
+/*
+ * bench-topic - Benchmark for the MQTT topic tokenizer
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <regex.h>
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "bench.h"
+#include "topic.h"
+
+namespace bench = mqtt2bufr::bench;
+
+// Former regexp-based tokenizer, kept as a reference for the benchmark.
+#define TOPIC_RE "^.*/([^/]+)/([0-9]+),([0-9]+)/([^/]+)/([0-9]+|-),([0-9]+|-),([0-9]+|-)/([0-9]+|-),([0-9]+|-),([0-9]+|-),([0-9]+|-)/(B[0-9]{5})$"
+
+static std::vector<std::string> regex_split_topic(const std::string& topic) {
+    int nmatches = 13;
+    regmatch_t matches[nmatches];
+    regex_t re;
+    std::vector<std::string> items;
+
+    if (regcomp(&re, TOPIC_RE, REG_EXTENDED) != 0)
+        throw std::runtime_error("While compiling topic regexp");
+    int r = regexec(&re, topic.c_str(), nmatches, matches, 0);
+    regfree(&re);
+    if (r != 0)
+        throw std::runtime_error("While parsing topic: No match");
+
+    for (int i = 1; i < nmatches; ++i) {
+        items.push_back(topic.substr(matches[i].rm_so, matches[i].rm_eo - matches[i].rm_so));
+    }
+    return items;
+}
+
+int main(int argc, char** argv)
+{
+    bench::Options opts(argc, argv, 100000);
+    std::vector<bench::Result> results;
+    std::string topic;
+
+    results.push_back(bench::run("regexp", opts.iterations, [&topic](bench::Result& res) {
+        for (const auto& s: bench::samples) {
+            topic = s.topic;
+            try {
+                std::vector<std::string> items = regex_split_topic(topic);
+            } catch (const std::exception&) {
+                ++res.errors;
+            }
+            ++res.operations;
+        }
+    }));
+    results.push_back(bench::run("split_topic", opts.iterations, [&topic](bench::Result& res) {
+        for (const auto& s: bench::samples) {
+            topic = s.topic;
+            mqtt2bufr::Topic decoded;
+            try {
+                mqtt2bufr::split_topic(topic, decoded);
+            } catch (const std::exception&) {
+                ++res.errors;
+            }
+            ++res.operations;
+        }
+    }));
+
+    bench::report("topic", opts, results);
+    return 0;
+}
@@ -0,0 +1,190 @@
+/*
+ * bench - Timing, allocation counting and samples shared by the benchmarks
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+#ifndef MQTT2BUFR_BENCH_H
+#define MQTT2BUFR_BENCH_H
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+// Count every allocation made by the process: replacing the global operator
+// new is enough to track the allocations made by dballe and wreport, too.
+// This header is included by a single source of each benchmark.
+static unsigned long long bench_allocations = 0;
+
+void* operator new(std::size_t size) {
+    ++bench_allocations;
+    if (void* p = malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    free(p);
+}
+
+namespace mqtt2bufr {
+namespace bench {
+
+/**
+ * MQTT messages used as samples: values of each type, attributes, station
+ * information, a mobile station and an invalid topic.
+ */
+struct Sample {
+    const char* topic;
+    const char* payload;
+};
+
+static const Sample samples[] = {
+    { "rmap/-/1212345,4398765/rmap/254,0,0/103,2000,-,-/B12101",
+      "{\"v\": 27315, \"t\": \"2016-01-28T10:00:00\"}" },
+    { "rmap/-/1212345,4398765/rmap/254,0,0/103,2000,-,-/B13003",
+      "{\"v\": 45, \"t\": \"2016-01-28T10:00:00\", \"a\": {\"B33007\": \"70\", \"B33192\": \"90\"}}" },
+    { "rmap/-/1212345,4398765/rmap/0,0,900/1,-,-,-/B13011",
+      "{\"v\": 2.5, \"t\": \"2016-01-28 10:00:00\"}" },
+    { "rmap/-/1212345,4398765/rmap/-,-,-/-,-,-,-/B01019",
+      "{\"v\": \"My station\"}" },
+    { "mobile/myident/1100000,4400000/locali/254,0,0/103,2000,-,-/B12101",
+      "{\"v\": 27315, \"t\": \"2016-01-28T10:00:00Z\"}" },
+    { "rmap/-/1212345,4398765/rmap/254,0,0/103,2000,-,-/B12X01",
+      "{\"v\": 27315, \"t\": \"2016-01-28T10:00:00\"}" },
+};
+
+struct Result {
+    const char* name;
+    unsigned long long operations = 0;
+    unsigned long long errors = 0;
+    unsigned long long bytes = 0;
+    unsigned long long allocations = 0;
+    /// Summary of the results, so that the work is not optimized away
+    unsigned long long checksum = 0;
+    double seconds = 0;
+};
+
+/// Time f over iterations rounds; f counts the operations done in res
+template<typename F>
+Result run(const char* name, unsigned iterations, F f) {
+    Result res;
+    res.name = name;
+    unsigned long long start_allocations = bench_allocations;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < iterations; ++i)
+        f(res);
+    auto end = std::chrono::steady_clock::now();
+    res.allocations = bench_allocations - start_allocations;
+    res.seconds = std::chrono::duration<double>(end - start).count();
+    return res;
+}
+
+/**
+ * Command line of the benchmarks: `[--json] [ITERATIONS [ARGS...]]`.
+ */
+struct Options {
+    unsigned iterations;
+    /// Print the results as JSON, instead of human-readable
+    bool json = false;
+    std::vector<std::string> args;
+
+    Options(int argc, char** argv, unsigned default_iterations)
+        : iterations(default_iterations) {
+        for (int i = 1; i < argc; ++i) {
+            if (strcmp(argv[i], "--json") == 0)
+                json = true;
+            else
+                args.push_back(argv[i]);
+        }
+        if (!args.empty()) {
+            iterations = strtoul(args[0].c_str(), NULL, 10);
+            args.erase(args.begin());
+        }
+    }
+};
+
+inline void print(std::ostream& out, const Result& r) {
+    double ops = r.operations ? (double)r.operations : 1;
+    out << r.name << ": " << r.operations << " operations"
+        << " (" << r.errors << " errors)" << std::endl
+        << "  ns/operation: " << r.seconds * 1e9 / ops << std::endl
+        << "  allocations/operation: " << r.allocations / ops << std::endl;
+    if (r.bytes)
+        out << "  bytes: " << r.bytes << std::endl;
+    if (r.checksum)
+        out << "  checksum: " << r.checksum << std::endl;
+}
+
+/**
+ * Print the results of a suite as a JSON object; extra is added as is
+ * before the results, e.g. `"corpus": {...}, `.
+ */
+inline void print_json(std::ostream& out, const char* suite, unsigned iterations,
+                       const std::vector<Result>& results,
+                       const std::string& extra=std::string()) {
+    out << "{" << std::endl
+        << "  \"suite\": \"" << suite << "\"," << std::endl
+        << "  \"version\": \"" << PACKAGE_VERSION << "\"," << std::endl
+        << "  \"iterations\": " << iterations << "," << std::endl;
+    if (!extra.empty())
+        out << "  " << extra << std::endl;
+    out << "  \"results\": [" << std::endl;
+    for (std::size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        double ops = r.seconds > 0 ? r.operations / r.seconds : 0;
+        double ns = r.operations ? r.seconds * 1e9 / r.operations : 0;
+        double allocs = r.operations ? (double)r.allocations / r.operations : 0;
+        out << "    {\"name\": \"" << r.name << "\""
+            << ", \"operations\": " << r.operations
+            << ", \"errors\": " << r.errors
+            << ", \"bytes\": " << r.bytes
+            << ", \"seconds\": " << r.seconds
+            << ", \"ns_per_op\": " << ns
+            << ", \"ops_per_s\": " << ops
+            << ", \"allocs_per_op\": " << allocs
+            << "}" << (i + 1 < results.size() ? "," : "") << std::endl;
+    }
+    out << "  ]" << std::endl
+        << "}" << std::endl;
+}
+
+/// Print the results on stdout, as JSON with --json
+inline void report(const char* suite, const Options& opts, const std::vector<Result>& results,
+                   const std::string& extra=std::string()) {
+    if (opts.json) {
+        print_json(std::cout, suite, opts.iterations, results, extra);
+        return;
+    }
+    for (const auto& r: results)
+        print(std::cout, r);
+}
+
+}
+}
+
+#endif
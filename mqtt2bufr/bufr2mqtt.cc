@@ -24,12 +24,15 @@
 #include "config.h"
 #endif
 
-#include <set>
-#include <unistd.h>
 #include <iostream>
-#include <cerrno>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstring>
 #include <clocale>
+#include <map>
+#include <mutex>
+#include <thread>
 
 #include <mosquittopp.h>
 
@@ -43,91 +46,312 @@
 #include <dballe/msg/wr_codec.h>
 
 #include "parser.h"
+#include "inflight.h"
+#include "queue.h"
+#include "stats.h"
+#include "retained.h"
+
+// Long options without a short equivalent
+enum {
+    OPT_MAX_INFLIGHT = 256,
+    OPT_THREADS,
+    OPT_STATS_INTERVAL,
+    OPT_STATS_SOCKET,
+    OPT_STATS_TOPIC,
+    OPT_RETAINED_CACHE,
+};
+
+/// MQTT message to publish, without the topic prefix
+struct Item {
+    std::string topic;
+    std::string payload;
+    bool retain;
+};
+
+/**
+ * Convert a decoded message to the MQTT messages to publish.
+ *
+ * The items are overwritten starting from items[count], reusing their
+ * buffers, and the vector grows as needed.
+ *
+ * @return the number of meaningful items at the beginning of the vector
+ */
+std::size_t format_msg(bufr2mqtt::Parser& parser, const dballe::Message& message,
+                       std::vector<Item>& items, std::size_t count=0)
+{
+    const dballe::Msg& msg = dballe::Msg::downcast(message);
+    const dballe::Datetime datetime = msg.get_datetime();
+    parser.set_station(*msg.find_station_context());
+    for (const auto& ctx: msg.data) {
+        for (const auto& var: ctx->data) {
+            // Skip date from station context
+            if (ctx->is_station() &&
+                (var->code() == WR_VAR(0, 4,  1) ||
+                 var->code() == WR_VAR(0, 4,  2) ||
+                 var->code() == WR_VAR(0, 4,  3) ||
+                 var->code() == WR_VAR(0, 4,  4) ||
+                 var->code() == WR_VAR(0, 4,  5) ||
+                 var->code() == WR_VAR(0, 4,  6)))
+                continue;
+            if (count == items.size())
+                items.emplace_back();
+            Item& item = items[count++];
+            item.retain = ( ctx->is_station() ? true : false );
+            parser.parse(*var, ctx->level, ctx->trange, datetime,
+                         item.topic, item.payload);
+        }
+    }
+    return count;
+}
+
+// Seconds to wait for an acknowledgement before giving up
+#define ACK_TIMEOUT 30
 
 struct Publisher : mosqpp::mosquittopp {
     std::vector<std::string> topics;
     bool debug;
-    std::set<int> mids;
-    std::size_t max_mids_size = 0;
+    /// Maximum number of messages waiting for an acknowledgement
+    std::size_t max_inflight;
+    /// Messages waiting for an acknowledgement, guarded by mutex
+    bufr2mqtt::MidSet mids;
+    std::mutex mutex;
+    std::condition_variable acked;
+    bufr2mqtt::Parser parser;
+    std::vector<Item> items;
+    std::string full_topic;
+    /// Payloads already retained by the broker, if suppression is enabled
+    bufr2mqtt::RetainedCache* retained = nullptr;
+    /// Statistics, if enabled
+    mqtt2bufr::Counter* published = nullptr;
+    mqtt2bufr::Counter* suppressed = nullptr;
+    mqtt2bufr::Histogram* publish_time = nullptr;
+    mqtt2bufr::Histogram* puback_time = nullptr;
+    /// Publishing time of each message id, guarded by mutex
+    std::vector<std::chrono::steady_clock::time_point> sent;
 
-    Publisher(const std::vector<std::string>& topics, bool debug=false) : topics(topics), debug(debug) {}
+    Publisher(const std::vector<std::string>& topics, bool debug=false,
+              std::size_t max_inflight=1)
+        : topics(topics), debug(debug), max_inflight(max_inflight) {}
 
     virtual void on_log(int level, const char *str) {
       if (debug)
         std::cerr << str << std::endl;
     }
 
+    /// Record the statistics of the published messages in stats
+    void set_stats(mqtt2bufr::Stats& stats) {
+        published = &stats.counter("published");
+        suppressed = &stats.counter("suppressed");
+        publish_time = &stats.histogram("publish");
+        puback_time = &stats.histogram("puback");
+        sent.resize(65536);
+    }
+
     virtual void on_publish(int mid) {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (puback_time && mids.contains(mid))
+          puback_time->add_since(sent[mid]);
       mids.erase(mid);
+      acked.notify_all();
     }
 
-    bool all_sent() const {
+    bool all_sent() {
+      std::lock_guard<std::mutex> lock(mutex);
       return mids.empty();
     }
 
+    /**
+     * Wait until at most max_size messages are waiting for an
+     * acknowledgement.
+     *
+     * @return false if no acknowledgement arrived for ACK_TIMEOUT seconds
+     */
+    bool wait_dequeue(std::unique_lock<std::mutex>& lock, std::size_t max_size) {
+        while (mids.size() > max_size) {
+            std::size_t size = mids.size();
+            acked.wait_for(lock, std::chrono::seconds(ACK_TIMEOUT),
+                           [&] { return mids.size() < size; });
+            if (mids.size() == size)
+                return false;
+        }
+        return true;
+    }
+
     bool wait_dequeue() {
-        int mosqerr;
-        for (int i = 0; i < 300 && mids.size() > max_mids_size; ++i) {
-	    //std::cerr << "sleep: .1" << std::endl;
-            usleep(100000);
-            mosqerr = loop();
-            if (mosqerr != MOSQ_ERR_SUCCESS) {
-	      std::string msg;
-	      if (mosqerr == MOSQ_ERR_ERRNO)
-		msg = std::strerror(errno);
-	      else
-		msg = mosqpp::strerror(mosqerr);
-
-	      std::cerr << "Error while calling mosquitto loop: "
-			<< msg << std::endl;
-	      return false;
+        std::unique_lock<std::mutex> lock(mutex);
+        return wait_dequeue(lock, 0);
+    }
+
+    /// Print the messages still waiting for an acknowledgement
+    void print_mids(std::ostream& out) {
+        std::lock_guard<std::mutex> lock(mutex);
+        mids.foreach([&out](int mid) { out << "- " << mid << std::endl; });
+    }
+
+    bool publish_one(const std::string& topic, const std::string& payload, bool retain) {
+        std::chrono::steady_clock::time_point start;
+        if (publish_time)
+            start = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lock(mutex);
+        if (not wait_dequeue(lock, max_inflight - 1)) {
+            std::cerr << "Ack timeout error" << std::endl;
+            return false;
+        }
+        // The lock is held until mid is inserted: otherwise the
+        // acknowledgement could be handled before the insertion.
+        int mid;
+        int mosqerr = publish(&mid, topic.c_str(), payload.size(), payload.c_str(), 1, retain);
+        if (mosqerr != MOSQ_ERR_SUCCESS) {
+            std::cerr << "Error while publishing message"
+                << ": " << mosqpp::strerror(mosqerr)
+                << std::endl;
+            return false;
+        }
+        mids.insert(mid);
+        if (publish_time) {
+            sent[mid] = std::chrono::steady_clock::now();
+            publish_time->add(sent[mid] - start);
+            published->add();
+        }
+        return true;
+    }
+
+    bool publish_items(const std::vector<Item>& items, std::size_t count) {
+        for (std::size_t i = 0; i < count; ++i) {
+            for (std::vector<std::string>::const_iterator t = topics.begin();
+                 t != topics.end(); ++t) {
+                full_topic = *t;
+                full_topic += items[i].topic;
+                const bool check = retained && items[i].retain;
+                if (check && retained->unchanged(full_topic, items[i].payload)) {
+                    if (suppressed)
+                        suppressed->add();
+                    continue;
+                }
+                if (not publish_one(full_topic, items[i].payload, items[i].retain))
+                    return false;
+                if (check)
+                    retained->set(full_topic, items[i].payload);
             }
         }
-	if (mids.size() > max_mids_size) return false;
-	return true;
+        return true;
     }
 
     bool publish_msg(const dballe::Message& message) {
+        return publish_items(items, format_msg(parser, message, items));
+    }
+};
+
+// Capacity of the queues between the reader, the decoders and the publisher
+#define PIPELINE_QUEUE_SIZE 256
+
+/**
+ * Decode the BUFR messages on a pool of threads.
+ *
+ * The reader pushes the raw BUFR messages in the job queue, each decoder
+ * converts them to the MQTT messages to publish, and the publisher takes them
+ * back in input order.
+ */
+struct Decoders {
+    struct Job {
+        unsigned long seq = 0;
+        std::string data;
+    };
+    struct Result {
+        unsigned long seq = 0;
+        std::vector<Item> items;
+        std::size_t count = 0;
+        /// Error message, if the message could not be decoded
+        std::string error;
+    };
+
+    mqtt2bufr::BoundedQueue<Job> jobs;
+    mqtt2bufr::BoundedQueue<Result> results;
+    std::vector<std::thread> workers;
+    std::atomic<unsigned> running;
+    /// Statistics, if enabled
+    mqtt2bufr::Histogram* decode_time = nullptr;
+    mqtt2bufr::Counter* decode_errors = nullptr;
+
+    Decoders(unsigned nthreads, mqtt2bufr::Stats* stats=nullptr)
+        : jobs(PIPELINE_QUEUE_SIZE), results(PIPELINE_QUEUE_SIZE),
+          running(nthreads) {
+        if (stats) {
+            decode_time = &stats->histogram("decode");
+            decode_errors = &stats->counter("errors_decode");
+        }
+        for (unsigned i = 0; i < nthreads; ++i)
+            workers.emplace_back(&Decoders::work, this);
+    }
+
+    ~Decoders() {
+        jobs.close();
+        results.close();
+        for (auto& t: workers)
+            t.join();
+    }
+
+    /// Decoder thread body
+    void work() {
         bufr2mqtt::Parser parser;
-        const dballe::Msg& msg = dballe::Msg::downcast(message);
-        const dballe::msg::Context* station_context = msg.find_station_context();
-        for (const auto& ctx: msg.data) {
-            for (const auto& var: ctx->data) {
-                // Skip date from station context
-                if (ctx->is_station() &&
-                    (var->code() == WR_VAR(0, 4,  1) ||
-                     var->code() == WR_VAR(0, 4,  2) ||
-                     var->code() == WR_VAR(0, 4,  3) ||
-                     var->code() == WR_VAR(0, 4,  4) ||
-                     var->code() == WR_VAR(0, 4,  5) ||
-                     var->code() == WR_VAR(0, 4,  6)))
+        dballe::msg::BufrImporter importer;
+        dballe::BinaryMessage bmsg(dballe::File::BUFR);
+        Job job;
+        while (jobs.pop(job)) {
+            Result result;
+            result.seq = job.seq;
+            bmsg.data.swap(job.data);
+            std::chrono::steady_clock::time_point start;
+            if (decode_time)
+                start = std::chrono::steady_clock::now();
+            try {
+                importer.foreach_decoded(bmsg, [&](std::unique_ptr<dballe::Message>&& msgptr) {
+                    // Append the items of each message of the bulletin
+                    result.count = format_msg(parser, *msgptr, result.items, result.count);
+                    return true;
+                });
+            } catch (const std::exception& e) {
+                result.error = e.what();
+                if (decode_errors)
+                    decode_errors->add();
+            }
+            if (decode_time)
+                decode_time->add_since(start);
+            if (!results.push(std::move(result)))
+                break;
+        }
+        // The last decoder tells the publisher that no more results will come
+        if (--running == 0)
+            results.close();
+    }
+
+    /**
+     * Publish the decoded messages in input order, until the decoders are
+     * done.
+     *
+     * The bulletins that cannot be decoded are reported and skipped.
+     *
+     * @return false if a message could not be published
+     */
+    bool publish(Publisher& publisher) {
+        // Results received ahead of their turn
+        std::map<unsigned long, Result> pending;
+        unsigned long next_seq = 0;
+        Result r;
+        while (results.pop(r)) {
+            pending.emplace(r.seq, std::move(r));
+            for (auto i = pending.begin();
+                 i != pending.end() && i->first == next_seq;
+                 i = pending.erase(i), ++next_seq) {
+                if (!i->second.error.empty()) {
+                    std::cerr << i->second.error << std::endl;
                     continue;
-                std::string topic;
-                std::string payload;
-                bool retain = ( ctx->is_station() ? true : false );
-                parser.parse(*var, ctx->level, ctx->trange,
-                             *station_context,
-                             msg.get_datetime(),
-                             topic, payload);
-                for (std::vector<std::string>::const_iterator t = topics.begin();
-                     t != topics.end(); ++t) {
-                    // TODO: do something if publish() fails
-                    int mosqerr;
-                    int mid;
-                    mosqerr = publish(&mid, (*t + topic).c_str(), payload.size(), payload.c_str(), 1, retain);
-                    if (mosqerr != MOSQ_ERR_SUCCESS) {
-                        std::cerr << "Error while publishing message"
-                            << ": " << mosqpp::strerror(mosqerr)
-                            << std::endl;
-			return false;
-                    } else {
-                        mids.insert(mid);
-                    }
-                    if (not wait_dequeue()) return false;
                 }
+                if (not publisher.publish_items(i->second.items, i->second.count))
+                    return false;
             }
         }
-	return true;
+        return true;
     }
 };
 
@@ -145,6 +369,23 @@ void print_help(std::ostream& out)
         << " -u,--username NAME username for authenticating with the broker" << std::endl
         << " -P,--pw PASSWORD   password for authenticating with the broker" << std::endl
         << " -d,--debug         enable debug messages" << std::endl
+        << " --max-inflight N   publish up to N messages without waiting for their" << std::endl
+        << "                    acknowledgement (default: 1)" << std::endl
+        << " --threads N        decode the BUFR messages with N threads (default: 0," << std::endl
+        << "                    decode while reading)" << std::endl
+        << " --suppress-retained skip the retained messages (station information) equal to" << std::endl
+        << "                    the last one published on the same topic" << std::endl
+        << " --retained-cache FILE" << std::endl
+        << "                    with --suppress-retained, load the last retained messages" << std::endl
+        << "                    from FILE, and save them on exit" << std::endl
+        << " --stats-interval SEC" << std::endl
+        << "                    print counters and latency histograms as a JSON line on" << std::endl
+        << "                    stderr every SEC seconds" << std::endl
+        << " --stats-socket PATH answer the connections to the Unix socket PATH with the" << std::endl
+        << "                    statistics as a JSON line" << std::endl
+        << " --stats-topic PREFIX" << std::endl
+        << "                    with --stats-interval, also publish the statistics under" << std::endl
+        << "                    the topic PREFIX" << std::endl
         << std::endl
         << "Report bugs to: " << PACKAGE_BUGREPORT << std::endl;
         ;
@@ -159,6 +400,8 @@ int main(int argc, char** argv)
 {
     static int show_help = 0;
     static int show_version = 0;
+    static int suppress_retained = 0;
+    std::string retained_cache;
     int keepalive = 60;
     int port = 1883;
     std::string hostname = "localhost";
@@ -167,6 +410,11 @@ int main(int argc, char** argv)
     char* password = NULL;
     int mosqerr;
     bool debug = false;
+    long max_inflight = 1;
+    long threads = 0;
+    long stats_interval = 0;
+    std::string stats_socket;
+    std::string stats_topic;
 
     while (1) {
         int c;
@@ -181,6 +429,13 @@ int main(int argc, char** argv)
             { "username", required_argument, 0, 'u' },
             { "pw", required_argument, 0, 'P' },
             { "debug", no_argument, 0, 'd' },
+            { "max-inflight", required_argument, 0, OPT_MAX_INFLIGHT },
+            { "threads", required_argument, 0, OPT_THREADS },
+            { "suppress-retained", no_argument, &suppress_retained, 1 },
+            { "retained-cache", required_argument, 0, OPT_RETAINED_CACHE },
+            { "stats-interval", required_argument, 0, OPT_STATS_INTERVAL },
+            { "stats-socket", required_argument, 0, OPT_STATS_SOCKET },
+            { "stats-topic", required_argument, 0, OPT_STATS_TOPIC },
             { 0, 0, 0, 0 }
         };
 
@@ -222,14 +477,86 @@ int main(int argc, char** argv)
             case 'd':
                 debug = true;
                 break;
+            case OPT_MAX_INFLIGHT:
+                max_inflight = atol(optarg);
+                // Message ids are 16 bit integers
+                if (max_inflight < 1 || max_inflight > 65535) {
+                    std::cerr << "Invalid max inflight " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case OPT_THREADS:
+                threads = atol(optarg);
+                if (threads < 0) {
+                    std::cerr << "Invalid number of threads " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case OPT_STATS_INTERVAL:
+                stats_interval = atol(optarg);
+                if (stats_interval < 1) {
+                    std::cerr << "Invalid stats interval " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case OPT_RETAINED_CACHE:
+                retained_cache = optarg;
+                break;
+            case OPT_STATS_SOCKET:
+                stats_socket = optarg;
+                break;
+            case OPT_STATS_TOPIC:
+                stats_topic = optarg;
+                break;
             default:
                 print_help(std::cerr);
                 return 1;
         }
     }
 
+    if (!stats_topic.empty() && stats_interval == 0) {
+        std::cerr << "--stats-topic requires --stats-interval" << std::endl;
+        return 1;
+    }
+
+    if (!retained_cache.empty() && !suppress_retained) {
+        std::cerr << "--retained-cache requires --suppress-retained" << std::endl;
+        return 1;
+    }
+    bufr2mqtt::RetainedCache retained;
+    if (!retained_cache.empty()) {
+        try {
+            retained.load(retained_cache);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
+
     mosqpp::lib_init();
-    Publisher publisher(topics, debug);
+    Publisher publisher(topics, debug, max_inflight);
+    if (suppress_retained)
+        publisher.retained = &retained;
+    mqtt2bufr::Stats stats;
+    const bool with_stats = stats_interval > 0 || !stats_socket.empty();
+    mqtt2bufr::Counter* read = nullptr;
+    mqtt2bufr::Histogram* decode_time = nullptr;
+    mqtt2bufr::Counter* decode_errors = nullptr;
+    if (with_stats) {
+        publisher.set_stats(stats);
+        read = &stats.counter("read");
+        decode_time = &stats.histogram("decode");
+        decode_errors = &stats.counter("errors_decode");
+    }
+    std::unique_ptr<mqtt2bufr::StatsServer> stats_server;
+    if (!stats_socket.empty()) {
+        try {
+            stats_server.reset(new mqtt2bufr::StatsServer(stats, stats_socket));
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
 
     if ((mosqerr = publisher.username_pw_set(username, password)) != 0) {
         std::cerr << "Error while setting username and password"
@@ -243,23 +570,102 @@ int main(int argc, char** argv)
                   << std::endl;
         return 1;
     }
+    // Otherwise libmosquitto would queue the messages beyond its own limit
+    publisher.max_inflight_messages_set(max_inflight);
+    // The acknowledgements are handled by the network thread, so that the
+    // window is refilled as soon as they arrive.
+    if ((mosqerr = publisher.loop_start()) != 0) {
+        std::cerr << "Error while starting the network loop"
+                  << ": " << mosqpp::strerror(mosqerr)
+                  << std::endl;
+        return 1;
+    }
+
+    std::unique_ptr<mqtt2bufr::StatsTicker> stats_ticker;
+    if (stats_interval > 0)
+        stats_ticker.reset(new mqtt2bufr::StatsTicker(std::chrono::seconds(stats_interval), [&]() {
+            std::cerr << stats.to_json() << std::endl;
+            if (!stats_topic.empty())
+                stats.foreach([&](const std::string& name, const std::string& value) {
+                    std::string topic = stats_topic + "/" + name;
+                    // QoS 0: not counted among the messages in flight
+                    publisher.publish(NULL, topic.c_str(), value.size(), value.data());
+                });
+        }));
 
     std::unique_ptr<dballe::File> input = dballe::File::create(dballe::File::BUFR, stdin, false, "stdin");
 
-    input->foreach([&publisher](const dballe::BinaryMessage& bmsg) {
-        dballe::msg::BufrImporter importer;
-        return importer.foreach_decoded(bmsg, [&publisher](std::unique_ptr<dballe::Message>&& msgptr) {
-            return publisher.publish_msg(*msgptr);
+    if (threads > 0) {
+        Decoders decoders(threads, with_stats ? &stats : nullptr);
+        std::thread reader([&input, &decoders, read]() {
+            unsigned long seq = 0;
+            try {
+                input->foreach([&decoders, &seq, read](const dballe::BinaryMessage& bmsg) {
+                    if (read)
+                        read->add();
+                    Decoders::Job job;
+                    job.seq = seq++;
+                    job.data = bmsg.data;
+                    return decoders.jobs.push(std::move(job));
+                });
+            } catch (const std::exception& e) {
+                std::cerr << e.what() << std::endl;
+            }
+            decoders.jobs.close();
         });
-    });
+        decoders.publish(publisher);
+        // Stop the reader if publishing failed
+        decoders.jobs.close();
+        reader.join();
+    } else {
+        input->foreach([&publisher, read, decode_time, decode_errors](const dballe::BinaryMessage& bmsg) {
+            dballe::msg::BufrImporter importer;
+            std::chrono::steady_clock::time_point start;
+            if (read) {
+                read->add();
+                start = std::chrono::steady_clock::now();
+            }
+            try {
+                return importer.foreach_decoded(bmsg, [&](std::unique_ptr<dballe::Message>&& msgptr) {
+                    // Decoding time of each message of the bulletin
+                    if (decode_time)
+                        decode_time->add_since(start);
+                    bool res = publisher.publish_msg(*msgptr);
+                    if (decode_time)
+                        start = std::chrono::steady_clock::now();
+                    return res;
+                });
+            } catch (const std::exception& e) {
+                // Skip the bulletin, as Decoders::publish does
+                std::cerr << e.what() << std::endl;
+                if (decode_errors)
+                    decode_errors->add();
+                return true;
+            }
+        });
+    }
 
     if (not publisher.wait_dequeue()) {
       std::cerr << "Ack timeout error:" << std::endl;
-      for (auto mid: publisher.mids)
-          std::cerr << "- " << mid << std::endl;
+      publisher.print_mids(std::cerr);
       return 2;
     }
 
+    if (suppress_retained) {
+        std::cerr << "retained: " << retained.suppressed << " unchanged messages not published"
+                  << std::endl;
+        // Only once every message has been acknowledged
+        if (!retained_cache.empty()) {
+            try {
+                retained.save(retained_cache);
+            } catch (const std::exception& e) {
+                std::cerr << e.what() << std::endl;
+            }
+        }
+    }
+
+    stats_ticker.reset();
+
     if ((mosqerr = publisher.disconnect()) != 0) {
         std::cerr << "Error while disconnetting from "
                   << hostname << ":" << port
@@ -267,13 +673,13 @@ int main(int argc, char** argv)
                   << std::endl;
         return 1;
     }
+    publisher.loop_stop();
 
     mosqpp::lib_cleanup();
 
     if (not publisher.all_sent()) {
       std::cerr << "error: not all Ack received:" << std::endl;
-      for (auto mid: publisher.mids)
-          std::cerr << "- " << mid << std::endl;
+      publisher.print_mids(std::cerr);
       return 3;
     }
 
@@ -0,0 +1,136 @@
+/*
+ * corpus - Synthetic MQTT messages for the benchmarks
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+
+#include "corpus.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <random>
+
+namespace {
+
+/// Variable measured by the stations
+struct Measure {
+    const char* var;
+    const char* level;
+    const char* trange;
+    /// Value range, in CREX units
+    int min;
+    int max;
+    /// Quality attribute, if any
+    const char* attr;
+    /// Published as a real number instead of an integer
+    bool real;
+};
+
+const Measure measures[] = {
+    // Air temperature, humidity and pressure samples
+    { "B12101", "103,2000,-,-", "254,0,0", 25315, 31315, "B33196", false },
+    { "B13003", "103,2000,-,-", "254,0,0", 10, 100, "B33007", false },
+    { "B10004", "1,-,-,-", "254,0,0", 9800, 10400, NULL, false },
+    // Wind
+    { "B11001", "103,10000,-,-", "254,0,0", 0, 360, NULL, false },
+    { "B11002", "103,10000,-,-", "254,0,0", 0, 300, NULL, false },
+    // Hourly min, mean and max temperature
+    { "B12101", "103,2000,-,-", "3,0,3600", 25315, 31315, NULL, false },
+    { "B12101", "103,2000,-,-", "0,0,3600", 25315, 31315, NULL, false },
+    { "B12101", "103,2000,-,-", "2,0,3600", 25315, 31315, NULL, false },
+    // Hourly precipitation
+    { "B13011", "1,-,-,-", "1,0,3600", 0, 300, "B33007", false },
+    // Hourly mean PM10
+    { "B15198", "103,2000,-,-", "0,0,3600", 0, 1500, NULL, true },
+};
+
+const std::size_t nmeasures = sizeof(measures) / sizeof(measures[0]);
+
+}
+
+namespace mqtt2bufr {
+
+std::vector<CorpusMessage> make_corpus(const CorpusOptions& opts) {
+    std::vector<CorpusMessage> corpus;
+    std::mt19937 rng(opts.seed);
+    const unsigned nstations = opts.fixed_stations + opts.mobile_stations;
+    char topic[256];
+    char payload[256];
+
+    corpus.reserve(opts.count);
+    if (nstations == 0)
+        return corpus;
+
+    // Each round publishes the measures of every station for one hour
+    for (unsigned round = 0; corpus.size() < opts.count; ++round) {
+        const unsigned hour = round % 24;
+        const unsigned day = 1 + (round / 24) % 28;
+        for (unsigned s = 0; s < nstations && corpus.size() < opts.count; ++s) {
+            const bool mobile = s >= opts.fixed_stations;
+            char ident[16] = "-";
+            int lon = 1000000 + (int)s * 1237;
+            int lat = 4400000 + (int)s * 731;
+            if (mobile) {
+                snprintf(ident, sizeof(ident), "mobile%03u", s);
+                lon += (int)(round * 113);
+                lat += (int)(round * 57);
+            }
+            const char* rep = mobile ? "mobile" : "fixed";
+
+            if (round == 0) {
+                // Station information, in the station context
+                snprintf(topic, sizeof(topic), "%s/%s/%d,%d/%s/-,-,-/-,-,-,-/B01019",
+                         opts.prefix.c_str(), ident, lon, lat, rep);
+                snprintf(payload, sizeof(payload), "{\"v\": \"Station %u\"}", s);
+                corpus.push_back(CorpusMessage{topic, payload});
+
+                snprintf(topic, sizeof(topic), "%s/%s/%d,%d/%s/-,-,-/-,-,-,-/B07030",
+                         opts.prefix.c_str(), ident, lon, lat, rep);
+                snprintf(payload, sizeof(payload), "{\"v\": %u}", (unsigned)(rng() % 20000));
+                corpus.push_back(CorpusMessage{topic, payload});
+            }
+
+            for (std::size_t m = 0; m < nmeasures && corpus.size() < opts.count; ++m) {
+                const Measure& ms = measures[m];
+                const int value = ms.min + (int)(rng() % (unsigned)(ms.max - ms.min + 1));
+                snprintf(topic, sizeof(topic), "%s/%s/%d,%d/%s/%s/%s/%s",
+                         opts.prefix.c_str(), ident, lon, lat, rep,
+                         ms.trange, ms.level, ms.var);
+                int n;
+                if (ms.real)
+                    n = snprintf(payload, sizeof(payload), "{\"v\": %.1f", value / 10.0);
+                else
+                    n = snprintf(payload, sizeof(payload), "{\"v\": %d", value);
+                n += snprintf(payload + n, sizeof(payload) - n,
+                              ", \"t\": \"2016-01-%02uT%02u:00:00\"", day, hour);
+                if (ms.attr)
+                    n += snprintf(payload + n, sizeof(payload) - n,
+                                  ", \"a\": {\"%s\": \"%u\"}", ms.attr, (unsigned)(rng() % 101));
+                n += snprintf(payload + n, sizeof(payload) - n, "}");
+                corpus.push_back(CorpusMessage{topic, payload});
+            }
+        }
+    }
+    // Station information may exceed the requested count
+    corpus.resize(std::min(corpus.size(), opts.count));
+    return corpus;
+}
+
+}
@@ -0,0 +1,72 @@
+/*
+ * corpus - Synthetic MQTT messages for the benchmarks
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+#ifndef MQTT2BUFR_CORPUS_H
+#define MQTT2BUFR_CORPUS_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace mqtt2bufr {
+
+/**
+ * MQTT message, as published by the stations.
+ */
+struct CorpusMessage {
+    std::string topic;
+    std::string payload;
+};
+
+/**
+ * Options of the synthetic corpus.
+ */
+struct CorpusOptions {
+    /// Number of messages
+    std::size_t count = 10000;
+    /// Stations with fixed coordinates (ident "-")
+    unsigned fixed_stations = 50;
+    /// Stations with an ident and moving coordinates
+    unsigned mobile_stations = 10;
+    /// Seed of the pseudo-random values
+    unsigned seed = 1;
+    /// Topic prefix
+    std::string prefix = "rmap";
+};
+
+/**
+ * Generate a corpus of realistic rmap messages.
+ *
+ * Each station publishes its station information (name and height) once, then
+ * a report every hour: instantaneous samples (time range 254,0,0) and hourly
+ * statistical processing (min, mean, max, cumulation), some with quality
+ * attributes. Mobile stations have an ident and change coordinates at each
+ * report.
+ *
+ * The corpus only depends on the options, so that results are comparable
+ * between runs.
+ */
+std::vector<CorpusMessage> make_corpus(const CorpusOptions& opts);
+
+}
+
+#endif
@@ -0,0 +1,71 @@
+/*
+ * dbwriter - Import messages in a DB-All.e database
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+
+#include "dbwriter.h"
+
+#include <iostream>
+
+namespace mqtt2bufr {
+
+DBWriter::DBWriter(const std::string& url)
+    : db(dballe::DB::connect_from_url(url.c_str())) {}
+
+void DBWriter::add(dballe::Msg&& msg) {
+    if (msgs.empty())
+        started = std::chrono::steady_clock::now();
+    msgs.push_back(std::move(msg));
+}
+
+void DBWriter::import_each() {
+    for (const auto& msg: msgs) {
+        try {
+            auto transaction = db->transaction();
+            db->import_msg(*transaction, msg, NULL, flags);
+            transaction->commit();
+        } catch (const std::exception& e) {
+            std::cerr << "Error while importing message: " << e.what() << std::endl;
+        }
+    }
+}
+
+void DBWriter::flush() {
+    if (msgs.empty())
+        return;
+
+    try {
+        // The transaction is rolled back when destroyed without a commit
+        auto transaction = db->transaction();
+        for (const auto& msg: msgs)
+            db->import_msg(*transaction, msg, NULL, flags);
+        transaction->commit();
+    } catch (const std::exception& e) {
+        // Find out which messages cannot be imported
+        if (msgs.size() > 1)
+            import_each();
+        else
+            std::cerr << "Error while importing message: " << e.what() << std::endl;
+    }
+    msgs.clear();
+}
+
+}
@@ -0,0 +1,84 @@
+/*
+ * dbwriter - Import messages in a DB-All.e database
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+#ifndef MQTT2BUFR_DBWRITER_H
+#define MQTT2BUFR_DBWRITER_H
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <dballe/msg/msg.h>
+#include <dballe/db/db.h>
+
+namespace mqtt2bufr {
+
+/**
+ * Collect messages and import them in a DB-All.e database, with a single
+ * transaction for each block of messages.
+ *
+ * Same interface of Batch, so that the batch size and interval set the size
+ * of the transactions.
+ */
+class DBWriter {
+ protected:
+  std::unique_ptr<dballe::DB> db;
+  std::vector<dballe::Msg> msgs;
+  std::chrono::steady_clock::time_point started;
+
+  /// Import the messages one by one, each in its own transaction
+  void import_each();
+
+ public:
+  /// Import flags, see dballe::DB::import_msg
+  int flags = DBA_IMPORT_ATTRS | DBA_IMPORT_FULL_PSEUDOANA | DBA_IMPORT_OVERWRITE;
+
+  /**
+   * Connect to the database.
+   *
+   * @throw std::runtime_error (or a wreport::error) if the connection fails
+   */
+  DBWriter(const std::string& url);
+
+  /// Add a message to the pending block
+  void add(dballe::Msg&& msg);
+  /// Number of messages added since the last flush
+  std::size_t size() const { return msgs.size(); }
+  bool empty() const { return msgs.empty(); }
+  /// Time elapsed since the first message of the block was added
+  std::chrono::steady_clock::duration age() const {
+      return std::chrono::steady_clock::now() - started;
+  }
+  /**
+   * Import the pending messages in a single transaction.
+   *
+   * If the transaction fails, the messages are imported one by one, so that
+   * only the messages that cannot be imported are lost: these are reported on
+   * stderr.
+   */
+  void flush();
+};
+
+}
+
+#endif
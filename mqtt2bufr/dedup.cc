@@ -0,0 +1,99 @@
+/*
+ * dedup - Duplicate messages suppression
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+
+#include "dedup.h"
+#include "station.h"
+
+#include <cstdio>
+#include <iterator>
+
+namespace mqtt2bufr {
+
+void Dedup::make_key(const dballe::Msg& msg) {
+    char buf[64];
+    make_station_key(msg, key);
+    dballe::Datetime dt = msg.get_datetime();
+    if (!dt.is_missing()) {
+        snprintf(buf, sizeof(buf), "%04d%02d%02d%02d%02d%02d",
+                 dt.year, dt.month, dt.day, dt.hour, dt.minute, dt.second);
+        key += buf;
+    }
+    value.clear();
+    for (const auto& ctx: msg.data) {
+        const dballe::Level& l = ctx->level;
+        const dballe::Trange& t = ctx->trange;
+        snprintf(buf, sizeof(buf), "/%d,%d,%d,%d/%d,%d,%d",
+                 l.ltype1, l.l1, l.ltype2, l.l2, t.pind, t.p1, t.p2);
+        key += buf;
+        for (const auto& var: ctx->data) {
+            // Station and datetime are already in the key
+            if (ctx->is_station() && is_station_key(var->code()))
+                continue;
+            key += '/';
+            key += wreport::varcode_format(var->code());
+            value += var->isset() ? var->enqc() : "-";
+            value += '/';
+        }
+    }
+}
+
+bool Dedup::seen(const dballe::Msg& msg) {
+    if (capacity == 0)
+        return false;
+    std::lock_guard<std::mutex> lock(mutex);
+    make_key(msg);
+    const auto now = std::chrono::steady_clock::now();
+
+    auto i = index.find(key);
+    if (i != index.end()) {
+        Entry& e = *i->second;
+        bool duplicate = (window.count() == 0 || now - e.seen < window) &&
+                         (!compare_values || e.value == value);
+        // Move to the front, remembering the latest value
+        lru.splice(lru.begin(), lru, i->second);
+        e.seen = now;
+        e.value = value;
+        if (duplicate) {
+            ++hits;
+            return true;
+        }
+        ++misses;
+        return false;
+    }
+
+    ++misses;
+    if (lru.size() >= capacity) {
+        // Reuse the least recently seen entry
+        index.erase(lru.back().key);
+        lru.splice(lru.begin(), lru, std::prev(lru.end()));
+        lru.front().key = key;
+    } else {
+        lru.push_front(Entry{key, std::string(), now});
+    }
+    lru.front().value = value;
+    lru.front().seen = now;
+    index.emplace(key, lru.begin());
+    return false;
+}
+
+}
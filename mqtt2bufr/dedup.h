@@ -0,0 +1,92 @@
+/*
+ * dedup - Duplicate messages suppression
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+#ifndef MQTT2BUFR_DEDUP_H
+#define MQTT2BUFR_DEDUP_H
+
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <dballe/msg/msg.h>
+
+namespace mqtt2bufr {
+
+/**
+ * Recognize the messages already seen, e.g. records resent by the stations
+ * after a reconnection, or QoS 1 redeliveries.
+ *
+ * A message is a duplicate of another one seen in the last `window` if it
+ * has the same station, datetime, variables, levels and time ranges, and, if
+ * values are compared, the same values. The most recently seen `capacity`
+ * messages are remembered: lookups and updates are constant time. The cache
+ * can be shared between threads.
+ */
+class Dedup {
+ protected:
+  struct Entry {
+      std::string key;
+      std::string value;
+      std::chrono::steady_clock::time_point seen;
+  };
+
+  std::mutex mutex;
+  /// Entries, the most recently seen first
+  std::list<Entry> lru;
+  std::unordered_map<std::string, std::list<Entry>::iterator> index;
+  std::size_t capacity;
+  std::chrono::steady_clock::duration window;
+  bool compare_values;
+  std::string key;
+  std::string value;
+
+  /// Set key and value of the message
+  void make_key(const dballe::Msg& msg);
+
+ public:
+  /// Duplicates found
+  unsigned long long hits = 0;
+  /// New messages
+  unsigned long long misses = 0;
+
+  /**
+   * @param capacity number of messages to remember
+   * @param window how long a message is remembered (0: no time limit)
+   * @param compare_values consider duplicates only messages with the same
+   *                       values
+   */
+  Dedup(std::size_t capacity, std::chrono::seconds window, bool compare_values=false)
+      : capacity(capacity), window(window), compare_values(compare_values) {}
+
+  /**
+   * Check if the message is a duplicate, and remember it.
+   *
+   * @return true if the message is a duplicate
+   */
+  bool seen(const dballe::Msg& msg);
+};
+
+}
+
+#endif
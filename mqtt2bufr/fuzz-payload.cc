@@ -0,0 +1,84 @@
+/*
+ * fuzz-payload - Fuzz target for the MQTT payload decoder
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+/*
+ * Build with libFuzzer:
+ *   make fuzz-payload CXX=clang++ \
+ *       CXXFLAGS="-g -fsanitize=fuzzer,address -DMQTT2BUFR_LIBFUZZER"
+ *   ./fuzz-payload fuzz/payload
+ *
+ * Without libFuzzer, the program decodes the files given on the command line
+ * (e.g. the corpus in fuzz/payload) and reports the outcome for each of them.
+ */
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+
+#include "payload.h"
+
+static bool decode(mqtt2bufr::PayloadDecoder& decoder, const char* data, std::size_t size, std::string& err) {
+    try {
+        decoder.decode(data, size);
+        if (decoder.datetime.type == mqtt2bufr::PayloadValue::STRING)
+            mqtt2bufr::parse_datetime(decoder.datetime.str.data(), decoder.datetime.str.size());
+    } catch (const std::runtime_error& e) {
+        err = e.what();
+        return false;
+    }
+    return true;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    static mqtt2bufr::PayloadDecoder decoder;
+    std::string err;
+    decode(decoder, (const char*)data, size, err);
+    return 0;
+}
+
+#ifndef MQTT2BUFR_LIBFUZZER
+int main(int argc, char** argv)
+{
+    mqtt2bufr::PayloadDecoder decoder;
+    for (int i = 1; i < argc; ++i) {
+        std::ifstream in(argv[i], std::ios::binary);
+        if (!in) {
+            std::cerr << "Cannot open file " << argv[i] << std::endl;
+            return 1;
+        }
+        std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        std::string err;
+        if (decode(decoder, data.data(), data.size(), err))
+            std::cout << argv[i] << ": ok" << std::endl;
+        else
+            std::cout << argv[i] << ": " << err << std::endl;
+    }
+    return 0;
+}
+#endif
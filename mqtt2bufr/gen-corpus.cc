@@ -0,0 +1,103 @@
+/*
+ * gen-corpus - Write a synthetic corpus of MQTT messages
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <cstdlib>
+#include <iostream>
+
+#include <getopt.h>
+
+#include "corpus.h"
+
+void print_help(std::ostream& out)
+{
+    out << "Usage: gen-corpus [OPTIONS]" << std::endl
+        << "Write a synthetic corpus of rmap MQTT messages to stdout, one message" << std::endl
+        << "per line: the topic, a space and the payload." << std::endl
+        << "Options are" << std::endl
+        << " --help             show this help and exit" << std::endl
+        << " -n,--count N       number of messages (default: 10000)" << std::endl
+        << " -f,--fixed N       number of fixed stations (default: 50)" << std::endl
+        << " -m,--mobile N      number of mobile stations (default: 10)" << std::endl
+        << " -s,--seed N        seed of the pseudo-random values (default: 1)" << std::endl
+        << " -t,--prefix PREFIX topic prefix (default: rmap)" << std::endl
+        ;
+}
+
+int main(int argc, char** argv)
+{
+    static int show_help = 0;
+    mqtt2bufr::CorpusOptions opts;
+
+    while (1) {
+        int c;
+        int opt_idx = 0;
+        static struct option long_opts[] = {
+            { "help", no_argument, &show_help, 1 },
+            { "count", required_argument, 0, 'n' },
+            { "fixed", required_argument, 0, 'f' },
+            { "mobile", required_argument, 0, 'm' },
+            { "seed", required_argument, 0, 's' },
+            { "prefix", required_argument, 0, 't' },
+            { 0, 0, 0, 0 }
+        };
+
+        c = getopt_long(argc, argv, "n:f:m:s:t:", long_opts, &opt_idx);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 0:
+                if (show_help) {
+                  print_help(std::cout);
+                  return 0;
+                }
+                break;
+            case 'n':
+                opts.count = strtoul(optarg, NULL, 10);
+                break;
+            case 'f':
+                opts.fixed_stations = strtoul(optarg, NULL, 10);
+                break;
+            case 'm':
+                opts.mobile_stations = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                opts.seed = strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                opts.prefix = optarg;
+                break;
+            default:
+                print_help(std::cerr);
+                return 1;
+        }
+    }
+
+    for (const auto& msg: mqtt2bufr::make_corpus(opts))
+        std::cout << msg.topic << ' ' << msg.payload << '\n';
+
+    return 0;
+}
@@ -0,0 +1,81 @@
+/*
+ * inflight - Set of the MQTT messages waiting for an acknowledgement
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+#ifndef MQTT2BUFR_INFLIGHT_H
+#define MQTT2BUFR_INFLIGHT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace bufr2mqtt {
+
+/**
+ * Set of in-flight message ids.
+ *
+ * MQTT message ids are 16 bit integers, so the set is a fixed bitmap: insert,
+ * erase and lookup are constant time and never allocate.
+ */
+class MidSet {
+ protected:
+  static const std::size_t MAX_MID = 65535;
+  uint64_t bits[(MAX_MID + 1) / 64];
+  std::size_t count = 0;
+
+ public:
+  MidSet() { memset(bits, 0, sizeof(bits)); }
+
+  std::size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+
+  bool contains(int mid) const {
+      if (mid < 0 || (std::size_t)mid > MAX_MID)
+          return false;
+      return bits[mid / 64] & (uint64_t(1) << (mid % 64));
+  }
+
+  void insert(int mid) {
+      if (mid < 0 || (std::size_t)mid > MAX_MID || contains(mid))
+          return;
+      bits[mid / 64] |= uint64_t(1) << (mid % 64);
+      ++count;
+  }
+
+  void erase(int mid) {
+      if (!contains(mid))
+          return;
+      bits[mid / 64] &= ~(uint64_t(1) << (mid % 64));
+      --count;
+  }
+
+  /// Call f(mid) for each mid in the set, in increasing order
+  template<typename F>
+  void foreach(F f) const {
+      for (std::size_t i = 0; i < sizeof(bits) / sizeof(bits[0]); ++i)
+          for (uint64_t w = bits[i]; w; w &= w - 1)
+              f(int(i * 64 + __builtin_ctzll(w)));
+  }
+};
+
+}
+
+#endif
@@ -25,6 +25,10 @@
 #endif
 
 #include <iostream>
+#include <chrono>
+#include <atomic>
+#include <map>
+#include <thread>
 
 #include <mosquittopp.h>
 
@@ -37,41 +41,479 @@
 #include <dballe/msg/wr_codec.h>
 
 #include "parser.h"
+#include "batch.h"
+#include "dbwriter.h"
+#include "station.h"
+#include "dedup.h"
+#include "router.h"
+#include "aggregate.h"
+#include "spool.h"
+#include "stats.h"
+#include "queue.h"
+
+// Capacity of the queues between the pipeline stages
+#define PIPELINE_QUEUE_SIZE 1024
+
+/**
+ * Output stages of the decoded messages, the same with and without worker
+ * threads: aggregation of the samples, then the database, the outputs of the
+ * routing rules or a batch of BUFR messages written to out.
+ *
+ * Only used by one thread: the network loop, or the writer of the pipeline.
+ */
+struct Output {
+    mqtt2bufr::Batch batch;
+    std::size_t batch_size;
+    std::chrono::milliseconds batch_interval;
+    /// Database output, instead of BUFR on out
+    mqtt2bufr::DBWriter* db = nullptr;
+    /// Routing of the messages to several outputs, instead of out
+    mqtt2bufr::Router* router = nullptr;
+    /// Aggregation of the samples into reports, if enabled
+    mqtt2bufr::Aggregator* aggregator = nullptr;
+    /// Output of the BUFR messages: stdout, or the spool
+    std::ostream* out = &std::cout;
+    /// Messages already encoded by the worker threads
+    std::string encoded;
+    std::size_t encoded_count = 0;
+    std::chrono::steady_clock::time_point encoded_started;
+    /// Writing to out failed: the following messages would be lost
+    bool failed = false;
+    /// Statistics, if enabled
+    mqtt2bufr::Counter* written = nullptr;
+    mqtt2bufr::Histogram* encode_time = nullptr;
+    mqtt2bufr::Histogram* write_time = nullptr;
+
+    Output(std::size_t batch_size, int batch_interval, bool group)
+        : batch(group), batch_size(batch_size), batch_interval(batch_interval) {}
+
+    /// Record the messages written and the encoding and writing times in stats
+    void set_stats(mqtt2bufr::Stats& stats) {
+        written = &stats.counter("written");
+        encode_time = &stats.histogram("encode");
+        write_time = &stats.histogram("write");
+        if (router)
+            router->set_stats(stats);
+    }
+
+    /**
+     * True if the messages can be encoded one by one by the worker threads,
+     * and given to add_encoded()
+     */
+    bool encodes_single() const {
+        return !db && !router && !aggregator && !batch.grouping() && !batch.compressing();
+    }
+
+    /// Add a message, routed to routes if there are routing rules
+    void add(dballe::Msg&& msg, mqtt2bufr::Router::Routes routes) {
+        // The samples are written later, as reports
+        if (aggregator && aggregator->add(msg, time(nullptr)))
+            return;
+        if (router) {
+            // The router flushes the batch of each output by itself
+            router->add(std::move(msg), routes, batch_size);
+            return;
+        }
+        if (db)
+            db->add(std::move(msg));
+        else
+            batch.add(std::move(msg));
+        if ((db ? db->size() : batch.size()) >= batch_size)
+            flush();
+    }
+
+    /// Add an encoded message (see encodes_single())
+    void add_encoded(const std::string& data) {
+        if (encoded_count == 0)
+            encoded_started = std::chrono::steady_clock::now();
+        encoded += data;
+        if (++encoded_count >= batch_size)
+            flush();
+    }
+
+    /// Write a block of count encoded messages to out
+    void write(const std::string& data, std::size_t count) {
+        std::chrono::steady_clock::time_point start;
+        if (write_time)
+            start = std::chrono::steady_clock::now();
+        out->write(data.data(), data.size());
+        out->flush();
+        if (write_time) {
+            write_time->add_since(start);
+            written->add(count);
+        }
+        // The stream stays bad, e.g. a spool append failed: stop rather than
+        // dropping all the next messages
+        if (!*out && !failed) {
+            std::cerr << "Error while writing the BUFR messages, stopping" << std::endl;
+            failed = true;
+        }
+    }
+
+    /// Write the pending messages
+    void flush() {
+        if (router) {
+            router->flush();
+        } else if (db) {
+            if (db->empty())
+                return;
+            // The import in the database counts as writing
+            std::size_t count = db->size();
+            std::chrono::steady_clock::time_point start;
+            if (write_time)
+                start = std::chrono::steady_clock::now();
+            db->flush();
+            if (write_time) {
+                write_time->add_since(start);
+                written->add(count);
+            }
+        } else if (!batch.empty()) {
+            std::size_t count = batch.size();
+            std::chrono::steady_clock::time_point start;
+            if (encode_time)
+                start = std::chrono::steady_clock::now();
+            const std::string& data = batch.encode();
+            if (encode_time)
+                encode_time->add_since(start);
+            write(data, count);
+        }
+        if (encoded_count > 0) {
+            write(encoded, encoded_count);
+            encoded.clear();
+            encoded_count = 0;
+        }
+    }
+
+    /// Write the reports of the closed aggregation intervals (all the open
+    /// ones, if all is true)
+    void write_reports(bool all=false) {
+        std::vector<dballe::Msg> reports;
+        if (all)
+            aggregator->close_all(reports);
+        else
+            aggregator->close(time(nullptr), reports);
+        for (auto& msg: reports) {
+            if (db)
+                db->add(std::move(msg));
+            else
+                batch.add(std::move(msg));
+            if ((db ? db->size() : batch.size()) >= batch_size)
+                flush();
+        }
+    }
+
+    /// Flush the messages older than the batch interval
+    void flush_expired() {
+        if (aggregator)
+            write_reports();
+        if (batch_interval.count() == 0)
+            return;
+        if (router) {
+            router->flush_expired(batch_interval);
+            return;
+        }
+        auto now = std::chrono::steady_clock::now();
+        if ((db ? !db->empty() && db->age() >= batch_interval
+                : !batch.empty() && batch.age() >= batch_interval) ||
+            (encoded_count > 0 && now - encoded_started >= batch_interval))
+            flush();
+    }
+
+    /// Timeout for waiting for messages, so that the batch interval is honoured
+    std::chrono::milliseconds timeout() const {
+        if (batch_interval.count() > 0 && batch_interval.count() < 1000)
+            return batch_interval;
+        return std::chrono::milliseconds(1000);
+    }
+
+    /// Write everything pending, including the partial reports
+    void close() {
+        // Partial reports rather than losing the samples
+        if (aggregator)
+            write_reports(true);
+        flush();
+    }
+};
+
+/**
+ * Parse messages on a pool of worker threads.
+ *
+ * The network thread pushes the raw messages in the job queue, each worker
+ * parses them with its own Parser, and a single writer gives them to the
+ * output, optionally restoring the arrival order. When the output writes
+ * each message as a bulletin of its own, the workers encode them too.
+ */
+struct Pipeline {
+    struct Job {
+        unsigned long seq = 0;
+        std::string topic;
+        std::string payload;
+    };
+    struct Result {
+        unsigned long seq = 0;
+        /// Decoded message, if not encoded
+        dballe::Msg msg;
+        /// Routes of the message
+        mqtt2bufr::Router::Routes routes = 0;
+        /// Encoded BUFR message, if encoded by the worker
+        std::string data;
+        bool encoded = false;
+        /// Error message, if the message could not be converted
+        std::string error;
+        /// The message is a duplicate, and must not be written
+        bool duplicate = false;
+    };
+
+    mqtt2bufr::BoundedQueue<Job> jobs;
+    mqtt2bufr::BoundedQueue<Result> results;
+    std::vector<std::thread> workers;
+    std::atomic<unsigned> running;
+    bool overwrite_date;
+    /// Encode the messages in the workers
+    bool encode;
+    /// Station information cache, shared by the workers
+    mqtt2bufr::StationCache* stations;
+    /// Duplicates suppression, shared by the workers
+    mqtt2bufr::Dedup* dedup;
+    /// Routing rules, only matched by the workers
+    const mqtt2bufr::Router* router;
+    /// Statistics, if enabled
+    mqtt2bufr::Stats* stats;
+
+    Pipeline(unsigned nthreads, bool overwrite_date, bool encode,
+             mqtt2bufr::StationCache* stations=nullptr,
+             mqtt2bufr::Dedup* dedup=nullptr,
+             const mqtt2bufr::Router* router=nullptr,
+             mqtt2bufr::Stats* stats=nullptr)
+        : jobs(PIPELINE_QUEUE_SIZE), results(PIPELINE_QUEUE_SIZE),
+          running(nthreads), overwrite_date(overwrite_date), encode(encode),
+          stations(stations), dedup(dedup), router(router), stats(stats) {
+        for (unsigned i = 0; i < nthreads; ++i)
+            workers.emplace_back(&Pipeline::work, this);
+    }
+
+    ~Pipeline() {
+        jobs.close();
+        results.close();
+        for (auto& t: workers)
+            t.join();
+    }
+
+    /// Worker thread body
+    void work() {
+        mqtt2bufr::Parser parser;
+        dballe::msg::BufrExporter exporter;
+        dballe::Messages single;
+        mqtt2bufr::Histogram* encode_time = nullptr;
+        mqtt2bufr::Counter* duplicates = nullptr;
+        if (stats) {
+            parser.set_stats(*stats);
+            encode_time = &stats->histogram("encode");
+            duplicates = &stats->counter("duplicates");
+        }
+        Job job;
+        while (jobs.pop(job)) {
+            Result result;
+            result.seq = job.seq;
+            try {
+                dballe::Msg msg = parser.parse(job.topic, job.payload);
+                if (dedup && dedup->seen(msg)) {
+                    if (duplicates)
+                        duplicates->add();
+                    result.duplicate = true;
+                    results.push(std::move(result));
+                    continue;
+                }
+                // See mosq::on_message
+                if (overwrite_date && msg.data.size() > 1)
+                    msg.set_datetime(mqtt2bufr::datetime_now());
+                if (stations)
+                    stations->enrich(msg);
+                if (router)
+                    result.routes = router->match(parser.topic());
+                if (encode) {
+                    single.clear();
+                    single.append(msg);
+                    auto start = std::chrono::steady_clock::now();
+                    result.data = exporter.to_binary(single);
+                    result.encoded = true;
+                    if (encode_time)
+                        encode_time->add_since(start);
+                } else {
+                    result.msg = std::move(msg);
+                }
+            } catch (const std::exception& e) {
+                result.error = e.what();
+            }
+            if (!results.push(std::move(result)))
+                break;
+        }
+        // The last worker tells the writer that no more results will come
+        if (--running == 0)
+            results.close();
+    }
+
+    /**
+     * Writer body: give the messages to output until the pipeline is
+     * closed, flushing it at least every batch interval.
+     *
+     * @return false if writing to the output failed
+     */
+    bool write(Output& output, bool ordered) {
+        // Results received ahead of their turn, when ordered
+        std::map<unsigned long, Result> pending;
+        unsigned long next_seq = 0;
+
+        auto emit = [&](Result& r) {
+            if (!r.error.empty()) {
+                std::cerr << r.error << std::endl;
+                return;
+            }
+            if (r.duplicate)
+                return;
+            if (r.encoded)
+                output.add_encoded(r.data);
+            else
+                output.add(std::move(r.msg), r.routes);
+        };
+
+        while (!output.failed) {
+            Result r;
+            auto status = results.pop_for(r, output.timeout());
+            if (status == mqtt2bufr::BoundedQueue<Result>::CLOSED)
+                break;
+            if (status == mqtt2bufr::BoundedQueue<Result>::OK) {
+                if (!ordered) {
+                    emit(r);
+                } else if (r.seq != next_seq) {
+                    pending.emplace(r.seq, std::move(r));
+                } else {
+                    emit(r);
+                    ++next_seq;
+                    for (auto i = pending.begin();
+                         i != pending.end() && i->first == next_seq;
+                         i = pending.erase(i), ++next_seq)
+                        emit(i->second);
+                }
+            }
+            output.flush_expired();
+        }
+        if (output.failed)
+            return false;
+        // Every job has been processed: nothing can be missing anymore
+        for (auto& i: pending)
+            emit(i.second);
+        output.close();
+        return !output.failed;
+    }
+};
 
 struct mosq : public mosqpp::mosquittopp {
     mqtt2bufr::Parser parser;
     bool debug;
     bool overwrite_date;
+    Output& output;
+    /// Station information cache, if enabled
+    mqtt2bufr::StationCache* stations = nullptr;
+    /// Duplicates suppression, if enabled
+    mqtt2bufr::Dedup* dedup = nullptr;
+    /// Worker pipeline, if the messages are not processed in the callback
+    Pipeline* pipeline = nullptr;
+    unsigned long next_seq = 0;
+    /// Statistics, if enabled
+    mqtt2bufr::Counter* received = nullptr;
+    mqtt2bufr::Counter* duplicates = nullptr;
 
-    mosq(bool debug=false, bool overwrite_date=false) : debug(debug), overwrite_date(overwrite_date) {}
+    mosq(Output& output, const char* id=NULL, bool debug=false, bool overwrite_date=false)
+        : mosqpp::mosquittopp(id), debug(debug), overwrite_date(overwrite_date),
+          output(output) {}
+
+    /// Record the statistics of the messages in stats
+    void set_stats(mqtt2bufr::Stats& stats) {
+        parser.set_stats(stats);
+        received = &stats.counter("received");
+        duplicates = &stats.counter("duplicates");
+        output.set_stats(stats);
+    }
 
     virtual void on_message(const struct mosquitto_message *message) {
-        dballe::Msg msg;
+        if (received)
+            received->add();
+        if (pipeline) {
+            Pipeline::Job job;
+            job.seq = next_seq++;
+            job.topic = message->topic;
+            job.payload.assign((const char*)message->payload,
+                               message->payloadlen);
+            pipeline->jobs.push(std::move(job));
+            return;
+        }
+        if (output.failed)
+            return;
         try {
-            msg = parser.parse(message->topic,
-                               std::string((const char*)message->payload,
-                                           message->payloadlen));
+            dballe::Msg msg = parser.parse(message->topic, strlen(message->topic),
+                                           (const char*)message->payload,
+                                           message->payloadlen);
+
+            if (dedup && dedup->seen(msg)) {
+                if (duplicates)
+                    duplicates->add();
+                return;
+            }
 
             // One context means station context only: in that case, there's no
             // need to overwrite the datetime.
             if (overwrite_date && msg.data.size() > 1)
                 msg.set_datetime(mqtt2bufr::datetime_now());
 
-            dballe::Messages msgs;
-            dballe::msg::BufrExporter exporter;
-            msgs.append(msg);
-            std::cout << exporter.to_binary(msgs) << std::flush;
+            if (stations)
+                stations->enrich(msg);
+
+            output.add(std::move(msg), output.router ? output.router->match(parser.topic()) : 0);
         } catch(const std::exception& e) {
             std::cerr << e.what() << std::endl;
         }
     }
 
+    virtual void on_disconnect(int rc) {
+        if (rc != 0)
+            std::cerr << "Unexpected disconnection: " << mosqpp::strerror(rc) << std::endl;
+        // Stop the pipeline: the writer returns once the pending messages
+        // have been written.
+        if (pipeline)
+            pipeline->jobs.close();
+    }
+
     virtual void on_log(int level, const char *str) {
       if (debug)
         std::cerr << str << std::endl;
     }
 };
 
+// Long options without a short equivalent
+enum {
+    OPT_BATCH_SIZE = 256,
+    OPT_BATCH_INTERVAL,
+    OPT_THREADS,
+    OPT_DBALLE_URL,
+    OPT_DEDUP,
+    OPT_DEDUP_WINDOW,
+    OPT_ROUTES,
+    OPT_AGGREGATE,
+    OPT_AGGREGATE_GRACE,
+    OPT_SPOOL,
+    OPT_SPOOL_OUTPUT,
+    OPT_SPOOL_SEGMENT_SIZE,
+    OPT_SPOOL_SYNC,
+    OPT_SPOOL_MAX_SIZE,
+    OPT_ID,
+    OPT_ID_SUFFIX,
+    OPT_SHARE,
+    OPT_STATS_INTERVAL,
+    OPT_STATS_SOCKET,
+    OPT_STATS_TOPIC,
+};
+
 void print_help(std::ostream& out)
 {
     out << "Usage: mqtt2bufr [OPTIONS]" << std::endl
@@ -85,8 +527,70 @@ void print_help(std::ostream& out)
         << " -t,--topic TOPIC   MQTT topic to subscribe to (may be repeated multiple times)" << std::endl
         << " -u,--username NAME username for authenticating with the broker" << std::endl
         << " -P,--pw PASSWORD   password for authenticating with the broker" << std::endl
+        << " -V,--protocol-version VERSION" << std::endl
+        << "                    MQTT protocol version: mqttv31, mqttv311 or mqttv5" << std::endl
+        << "                    (default: mqttv311)" << std::endl
+        << " --id ID            MQTT client id (default: random)" << std::endl
+        << " --id-suffix SUFFIX append SUFFIX to the client id (default id: mqtt2bufr), to" << std::endl
+        << "                    give each instance of a shared subscription its own id" << std::endl
+        << " --share GROUP      subscribe to the topics as members of the shared subscription" << std::endl
+        << "                    GROUP ($share/GROUP/TOPIC): the messages are spread among the" << std::endl
+        << "                    instances, in no particular order (not compatible with" << std::endl
+        << "                    --aggregate)" << std::endl
         << " -d,--debug         enable debug messages" << std::endl
         << " --overwrite-date   date is ignored and is overwritten with current date" << std::endl
+        << " --batch-size N     write the BUFR messages in blocks of N messages (default: 1)" << std::endl
+        << " --batch-interval MS write the pending BUFR messages at least every MS milliseconds" << std::endl
+        << "                    (default: 0, wait for the batch to be full)" << std::endl
+        << " --group            merge the messages of a batch with the same station and datetime" << std::endl
+        << " --threads N        parse and encode the messages with N worker threads" << std::endl
+        << "                    (default: 0, in the network loop)" << std::endl
+        << " --ordered          with --threads, write the messages in arrival order" << std::endl
+        << " --compress         encode the messages of a batch with the same variables, levels" << std::endl
+        << "                    and time ranges in a compressed multi-subset bulletin (not" << std::endl
+        << "                    compatible with --dballe-url)" << std::endl
+        << " --verify           with --compress, decode each bulletin and write its messages" << std::endl
+        << "                    uncompressed if they do not match" << std::endl
+        << " --station-cache    add the station information (name, height, etc.) received" << std::endl
+        << "                    in station context messages to the data messages" << std::endl
+        << " --dedup N          drop the messages equal to one of the last N messages" << std::endl
+        << "                    (same station, datetime, variable, level and time range)" << std::endl
+        << " --dedup-window SEC only drop the duplicates seen in the last SEC seconds" << std::endl
+        << "                    (default: 3600, 0 for no limit)" << std::endl
+        << " --dedup-values     only drop the duplicates with the same value" << std::endl
+        << " --routes FILE      write the messages to the outputs of the routing rules in" << std::endl
+        << "                    FILE matching their topic, instead of stdout (not" << std::endl
+        << "                    compatible with --dballe-url)" << std::endl
+        << " --aggregate SEC    write the samples (time range 254,0,0) as reports of their" << std::endl
+        << "                    mean, maximum and minimum over intervals of SEC seconds" << std::endl
+        << "                    (not compatible with --routes)" << std::endl
+        << " --aggregate-grace SEC" << std::endl
+        << "                    keep the intervals open for SEC seconds after their end," << std::endl
+        << "                    or after their first sample arrived (default: 60)" << std::endl
+        << " --spool DIR        write the BUFR messages to a spool in DIR, forwarded to the" << std::endl
+        << "                    output by a separate thread (not compatible with --routes" << std::endl
+        << "                    and --dballe-url)" << std::endl
+        << " --spool-output OUT forward the spool to OUT: - (stdout, default), tcp:HOST:PORT" << std::endl
+        << "                    or a file" << std::endl
+        << " --spool-segment-size BYTES" << std::endl
+        << "                    size of the spool segment files (default: 67108864)" << std::endl
+        << " --spool-sync MS    sync the spool to disk every MS milliseconds (default: 100," << std::endl
+        << "                    0 to sync every batch)" << std::endl
+        << " --spool-max-size BYTES" << std::endl
+        << "                    stop reading messages while more than BYTES are spooled" << std::endl
+        << "                    and not forwarded (default: 0, no limit)" << std::endl
+        << " --stats-interval SEC" << std::endl
+        << "                    print counters and latency histograms as a JSON line on" << std::endl
+        << "                    stderr every SEC seconds" << std::endl
+        << " --stats-socket PATH answer the connections to the Unix socket PATH with the" << std::endl
+        << "                    statistics as a JSON line" << std::endl
+        << " --stats-topic PREFIX" << std::endl
+        << "                    with --stats-interval, also publish the statistics under" << std::endl
+        << "                    the topic PREFIX" << std::endl
+        << " --dballe-url URL   import the messages in the DB-All.e database at URL (e.g." << std::endl
+        << "                    sqlite:file.sqlite) instead of writing BUFR to stdout; each" << std::endl
+        << "                    batch is imported in a single transaction (not compatible" << std::endl
+        << "                    with --group and --compress)" << std::endl
         << std::endl
         << "Report bugs to: " << PACKAGE_BUGREPORT << std::endl;
         ;
@@ -102,12 +606,39 @@ int main(int argc, char** argv)
     static int show_help = 0;
     static int show_version = 0;
     static int overwrite_date = 0;
+    static int group = 0;
+    static int ordered = 0;
+    static int station_cache = 0;
+    static int dedup_values = 0;
+    static int compress = 0;
+    static int verify = 0;
+    long dedup_size = 0;
+    long dedup_window = 3600;
+    long threads = 0;
+    std::string dballe_url;
+    std::string routes;
+    long aggregate = 0;
+    long aggregate_grace = 60;
+    std::string spool_dir;
+    std::string spool_output = "-";
+    long long spool_segment_size = 64 * 1024 * 1024;
+    long spool_sync = 100;
+    long long spool_max_size = 0;
+    long batch_size = 1;
+    long batch_interval = 0;
     int keepalive = 60;
     int port = 1883;
     std::string hostname = "localhost";
     std::vector<std::string> topics;
     char* username = NULL;
     char* password = NULL;
+    int protocol_version = 0;
+    std::string client_id;
+    std::string id_suffix;
+    std::string share;
+    long stats_interval = 0;
+    std::string stats_socket;
+    std::string stats_topic;
     bool debug = false;
 
     while (1) {
@@ -122,13 +653,40 @@ int main(int argc, char** argv)
             { "topic", required_argument, 0, 't' },
             { "username", required_argument, 0, 'u' },
             { "pw", required_argument, 0, 'P' },
+            { "protocol-version", required_argument, 0, 'V' },
+            { "id", required_argument, 0, OPT_ID },
+            { "id-suffix", required_argument, 0, OPT_ID_SUFFIX },
+            { "share", required_argument, 0, OPT_SHARE },
+            { "stats-interval", required_argument, 0, OPT_STATS_INTERVAL },
+            { "stats-socket", required_argument, 0, OPT_STATS_SOCKET },
+            { "stats-topic", required_argument, 0, OPT_STATS_TOPIC },
             { "debug", no_argument, 0, 'd' },
             { "overwrite-date", no_argument, &overwrite_date, 1 },
+            { "batch-size", required_argument, 0, OPT_BATCH_SIZE },
+            { "batch-interval", required_argument, 0, OPT_BATCH_INTERVAL },
+            { "group", no_argument, &group, 1 },
+            { "threads", required_argument, 0, OPT_THREADS },
+            { "dballe-url", required_argument, 0, OPT_DBALLE_URL },
+            { "station-cache", no_argument, &station_cache, 1 },
+            { "dedup", required_argument, 0, OPT_DEDUP },
+            { "dedup-window", required_argument, 0, OPT_DEDUP_WINDOW },
+            { "dedup-values", no_argument, &dedup_values, 1 },
+            { "routes", required_argument, 0, OPT_ROUTES },
+            { "aggregate", required_argument, 0, OPT_AGGREGATE },
+            { "aggregate-grace", required_argument, 0, OPT_AGGREGATE_GRACE },
+            { "spool", required_argument, 0, OPT_SPOOL },
+            { "spool-output", required_argument, 0, OPT_SPOOL_OUTPUT },
+            { "spool-segment-size", required_argument, 0, OPT_SPOOL_SEGMENT_SIZE },
+            { "spool-sync", required_argument, 0, OPT_SPOOL_SYNC },
+            { "spool-max-size", required_argument, 0, OPT_SPOOL_MAX_SIZE },
+            { "ordered", no_argument, &ordered, 1 },
+            { "compress", no_argument, &compress, 1 },
+            { "verify", no_argument, &verify, 1 },
             { 0, 0, 0, 0 }
         };
 
         c = getopt_long(argc, argv,
-                        "h:k:p:t:u:P:d",
+                        "h:k:p:t:u:P:V:d",
                         opts, &opt_idx);
         if (c == -1)
             break;
@@ -162,18 +720,245 @@ int main(int argc, char** argv)
             case 'P':
                 password = strdup(optarg);
                 break;
+            case 'V':
+                if (strcmp(optarg, "mqttv31") == 0) {
+                    protocol_version = MQTT_PROTOCOL_V31;
+                } else if (strcmp(optarg, "mqttv311") == 0) {
+                    protocol_version = MQTT_PROTOCOL_V311;
+#ifdef MQTT_PROTOCOL_V5
+                } else if (strcmp(optarg, "mqttv5") == 0) {
+                    protocol_version = MQTT_PROTOCOL_V5;
+#endif
+                } else {
+                    std::cerr << "Invalid or unsupported protocol version " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case OPT_ID:
+                client_id = optarg;
+                break;
+            case OPT_ID_SUFFIX:
+                id_suffix = optarg;
+                break;
+            case OPT_SHARE:
+                share = optarg;
+                if (share.empty() || share.find_first_of("/+#") != std::string::npos) {
+                    std::cerr << "Invalid share name " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case OPT_STATS_INTERVAL:
+                stats_interval = atol(optarg);
+                if (stats_interval < 1) {
+                    std::cerr << "Invalid stats interval " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case OPT_STATS_SOCKET:
+                stats_socket = optarg;
+                break;
+            case OPT_STATS_TOPIC:
+                stats_topic = optarg;
+                break;
             case 'd':
                 debug = true;
                 break;
+            case OPT_BATCH_SIZE:
+                batch_size = atol(optarg);
+                if (batch_size < 1) {
+                    std::cerr << "Invalid batch size " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case OPT_BATCH_INTERVAL:
+                batch_interval = atol(optarg);
+                if (batch_interval < 0) {
+                    std::cerr << "Invalid batch interval " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case OPT_THREADS:
+                threads = atol(optarg);
+                if (threads < 0) {
+                    std::cerr << "Invalid number of threads " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case OPT_DBALLE_URL:
+                dballe_url = optarg;
+                break;
+            case OPT_ROUTES:
+                routes = optarg;
+                break;
+            case OPT_AGGREGATE:
+                aggregate = atol(optarg);
+                if (aggregate < 1) {
+                    std::cerr << "Invalid aggregation interval " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case OPT_AGGREGATE_GRACE:
+                aggregate_grace = atol(optarg);
+                if (aggregate_grace < 0) {
+                    std::cerr << "Invalid aggregation grace " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case OPT_SPOOL:
+                spool_dir = optarg;
+                break;
+            case OPT_SPOOL_OUTPUT:
+                spool_output = optarg;
+                break;
+            case OPT_SPOOL_SEGMENT_SIZE:
+                spool_segment_size = atoll(optarg);
+                if (spool_segment_size < 1) {
+                    std::cerr << "Invalid spool segment size " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case OPT_SPOOL_SYNC:
+                spool_sync = atol(optarg);
+                if (spool_sync < 0) {
+                    std::cerr << "Invalid spool sync interval " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case OPT_SPOOL_MAX_SIZE:
+                spool_max_size = atoll(optarg);
+                if (spool_max_size < 0) {
+                    std::cerr << "Invalid spool size " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case OPT_DEDUP:
+                dedup_size = atol(optarg);
+                if (dedup_size < 0) {
+                    std::cerr << "Invalid dedup size " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case OPT_DEDUP_WINDOW:
+                dedup_window = atol(optarg);
+                if (dedup_window < 0) {
+                    std::cerr << "Invalid dedup window " << optarg << std::endl;
+                    return 1;
+                }
+                break;
             default:
                 print_help(std::cerr);
                 return 1;
         }
     }
 
+    // The database merges the messages by itself, and has no BUFR output
+    if (!dballe_url.empty() && (group || compress)) {
+        std::cerr << "--dballe-url cannot be used with --group or --compress" << std::endl;
+        return 1;
+    }
+    if (!routes.empty() && !dballe_url.empty()) {
+        std::cerr << "--routes cannot be used with --dballe-url" << std::endl;
+        return 1;
+    }
+    if (verify && !compress) {
+        std::cerr << "--verify requires --compress" << std::endl;
+        return 1;
+    }
+    if (!share.empty() && aggregate > 0) {
+        std::cerr << "--aggregate cannot be used with --share" << std::endl;
+        return 1;
+    }
+    if (!stats_topic.empty() && stats_interval == 0) {
+        std::cerr << "--stats-topic requires --stats-interval" << std::endl;
+        return 1;
+    }
+    if (!id_suffix.empty())
+        client_id = (client_id.empty() ? "mqtt2bufr" : client_id) + id_suffix;
+    // The reports have no topic to match the rules with
+    if (aggregate > 0 && !routes.empty()) {
+        std::cerr << "--aggregate cannot be used with --routes" << std::endl;
+        return 1;
+    }
+    if (!spool_dir.empty() && (!routes.empty() || !dballe_url.empty())) {
+        std::cerr << "--spool cannot be used with --routes or --dballe-url" << std::endl;
+        return 1;
+    }
+    std::unique_ptr<mqtt2bufr::Spool> spool;
+    std::unique_ptr<mqtt2bufr::SpoolStreambuf> spool_buf;
+    std::unique_ptr<std::ostream> spool_out;
+    if (!spool_dir.empty()) {
+        try {
+            spool.reset(new mqtt2bufr::Spool(spool_dir, spool_output, spool_segment_size,
+                                             std::chrono::milliseconds(spool_sync),
+                                             spool_max_size));
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+        spool_buf.reset(new mqtt2bufr::SpoolStreambuf(*spool));
+        spool_out.reset(new std::ostream(spool_buf.get()));
+    }
+    std::unique_ptr<mqtt2bufr::Router> router;
+    if (!routes.empty()) {
+        try {
+            router.reset(new mqtt2bufr::Router(routes, group));
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
+    std::unique_ptr<mqtt2bufr::DBWriter> db;
+    if (!dballe_url.empty()) {
+        try {
+            db.reset(new mqtt2bufr::DBWriter(dballe_url));
+        } catch (const std::exception& e) {
+            std::cerr << "Error while connecting to " << dballe_url
+                      << ": " << e.what() << std::endl;
+            return 1;
+        }
+    }
+
     mosqpp::lib_init();
-    mosq m(debug, overwrite_date);
+    Output output(batch_size, batch_interval, group);
+    output.db = db.get();
+    output.router = router.get();
+    if (compress) {
+        output.batch.set_compression(verify);
+        if (router)
+            router->set_compression(verify);
+    }
+    if (spool_out)
+        output.out = spool_out.get();
+    mqtt2bufr::Aggregator aggregator(aggregate, aggregate_grace);
+    if (aggregate > 0)
+        output.aggregator = &aggregator;
+    mosq m(output, client_id.empty() ? NULL : client_id.c_str(), debug, overwrite_date);
+    mqtt2bufr::StationCache stations;
+    if (station_cache)
+        m.stations = &stations;
+    mqtt2bufr::Dedup dedup(dedup_size, std::chrono::seconds(dedup_window), dedup_values);
+    if (dedup_size > 0)
+        m.dedup = &dedup;
+
+    mqtt2bufr::Stats stats;
+    const bool with_stats = stats_interval > 0 || !stats_socket.empty();
+    if (with_stats)
+        m.set_stats(stats);
+    std::unique_ptr<mqtt2bufr::StatsServer> stats_server;
+    if (!stats_socket.empty()) {
+        try {
+            stats_server.reset(new mqtt2bufr::StatsServer(stats, stats_socket));
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
 
+    if (protocol_version != 0 &&
+        m.opts_set(MOSQ_OPT_PROTOCOL_VERSION, &protocol_version) != 0) {
+        std::cerr << "Error while setting the protocol version" << std::endl;
+        return 1;
+    }
     if (m.username_pw_set(username, password) != 0) {
         std::cerr << "Error while setting username and password" << std::endl;
         return 1;
@@ -184,12 +969,58 @@ int main(int argc, char** argv)
     }
     for (std::vector<std::string>::const_iterator i = topics.begin();
          i != topics.end(); ++i) {
-        if (m.subscribe(NULL, i->c_str()) != 0) {
-            std::cerr << "Error while subscribing to topic " << *i << std::endl;
+        std::string topic = share.empty() ? *i : "$share/" + share + "/" + *i;
+        if (m.subscribe(NULL, topic.c_str()) != 0) {
+            std::cerr << "Error while subscribing to topic " << topic << std::endl;
             return 1;
         }
     }
-    while (m.loop() == 0) {}
+    std::unique_ptr<mqtt2bufr::StatsTicker> stats_ticker;
+    if (stats_interval > 0)
+        stats_ticker.reset(new mqtt2bufr::StatsTicker(std::chrono::seconds(stats_interval), [&]() {
+            std::cerr << stats.to_json() << std::endl;
+            if (!stats_topic.empty())
+                stats.foreach([&](const std::string& name, const std::string& value) {
+                    std::string topic = stats_topic + "/" + name;
+                    m.publish(NULL, topic.c_str(), value.size(), value.data());
+                });
+        }));
+
+    if (threads > 0) {
+        // Network loop on its own thread, the main thread is the writer
+        Pipeline pipeline(threads, overwrite_date, output.encodes_single(),
+                          m.stations, m.dedup, router.get(),
+                          with_stats ? &stats : nullptr);
+        m.pipeline = &pipeline;
+        if (m.loop_start() != 0) {
+            std::cerr << "Error while starting the network loop" << std::endl;
+            return 1;
+        }
+        if (!pipeline.write(output, ordered)) {
+            // Unblock the network thread and the workers
+            pipeline.jobs.close();
+            pipeline.results.close();
+        }
+        m.loop_stop(true);
+        m.pipeline = nullptr;
+    } else {
+        while (!output.failed && m.loop(output.timeout().count()) == 0)
+            output.flush_expired();
+        if (!output.failed)
+            output.close();
+    }
+
+    if (m.dedup)
+        std::cerr << "dedup: " << dedup.hits << " duplicates dropped, "
+                  << dedup.misses << " new messages" << std::endl;
+    if (output.aggregator)
+        std::cerr << "aggregate: " << aggregator.samples << " samples aggregated, "
+                  << aggregator.late << " late samples dropped" << std::endl;
+
+    // Wait for the spooled messages to be forwarded
+    if (spool)
+        spool->close();
+    stats_ticker.reset();
 
     if (m.disconnect() != 0) {
         std::cerr << "Error while disconnetting from " << hostname << ":" << port << std::endl;
@@ -197,5 +1028,5 @@ int main(int argc, char** argv)
     }
 
     mosqpp::lib_cleanup();
-    return 0;
+    return output.failed ? 1 : 0;
 }
@@ -23,41 +23,10 @@
 
 #include "parser.h"
 
-#include <regex.h>
-
 #include <iostream>
 #include <ctime>
 
-#include <jansson.h>
-
-#define IDENT_RE "([^/]+)"
-#define LON_RE   "([0-9]+)"
-#define LAT_RE   "([0-9]+)"
-#define REP_RE   "([^/]+)"
-#define LT1_RE   "([0-9]+|-)"
-#define L1_RE    "([0-9]+|-)"
-#define LT2_RE   "([0-9]+|-)"
-#define L2_RE    "([0-9]+|-)"
-#define PIND_RE  "([0-9]+|-)"
-#define P1_RE    "([0-9]+|-)"
-#define P2_RE    "([0-9]+|-)"
-#define VAR_RE   "(B[0-9]{5})"
-
-#define TOPIC_RE "^.*/" IDENT_RE "/" LON_RE "," LAT_RE "/" REP_RE "/" PIND_RE "," P1_RE "," P2_RE "/" LT1_RE "," L1_RE "," LT2_RE "," L2_RE "/" VAR_RE "$"
-
-#define throw_regexception(errcode, preg, errbuf, prefixmsg) do { regerror(errcode, preg, errbuf, sizeof(errbuf)); throw std::runtime_error(std::string(prefixmsg) + std::string(errbuf)); } while(0);
-
-struct RAIIRegexp {
-    regex_t* re;
-    RAIIRegexp(regex_t* re) : re(re) {}
-    ~RAIIRegexp() { regfree(re); }
-};
-
-struct RAIIJson {
-    json_t* root;
-    RAIIJson(json_t* root) : root(root) {}
-    ~RAIIJson() { json_decref(root); }
-};
+#include <dballe/core/var.h>
 
 namespace mqtt2bufr {
 
@@ -74,202 +43,278 @@ dballe::Datetime datetime_now()
                             tm->tm_sec);
 }
 
-static std::vector<std::string> split_topic(const std::string& topic) {
-    int r;
-    char errmsg[1024];
-    int nmatches = 13;
-    regmatch_t matches[nmatches];
-    regex_t re;
-    std::vector<std::string> items;
-
-    r = regcomp(&re, TOPIC_RE, REG_EXTENDED);
-    RAIIRegexp raiiregexp(&re);
-    if (r != 0) throw_regexception(r, &re, errmsg, "While compiling topic regexp: ");
-    r = regexec(&re, topic.c_str(), nmatches, matches, 0);
-    if (r != 0) throw_regexception(r, &re, errmsg, "While parsing topic: ");
-
-    for (int i = 1; i < nmatches; ++i) { 
-        items.push_back(topic.substr(matches[i].rm_so, matches[i].rm_eo - matches[i].rm_so));
-    }
-    return items;
-}
-
-void Parser::parse_topic(const std::string& topic) {
-    // split topic by "/" delimiter
-    std::vector<std::string> items = split_topic(topic);
+void Parser::parse_topic(const char* topic, std::size_t size, dballe::Msg& msg) {
+    split_topic(topic, size, decoded_topic);
+    const dballe::Level station_level;
+    const dballe::Trange station_trange;
     // set station ident
-    if (items[0] != "-")
-        station_rec.set_var(dballe::var(WR_VAR(0, 1, 11), items[0].c_str()));
+    if (decoded_topic.has_ident())
+        msg.set(dballe::newvar(WR_VAR(0, 1, 11), decoded_topic.ident.str().c_str()),
+                station_level, station_trange);
     // set station coordinates
-    station_rec.set_var(dballe::var(WR_VAR(0, 6,  1), items[1].c_str()));
-    station_rec.set_var(dballe::var(WR_VAR(0, 5,  1), items[2].c_str()));
+    msg.set(dballe::newvar(WR_VAR(0, 6,  1), decoded_topic.lon),
+            station_level, station_trange);
+    msg.set(dballe::newvar(WR_VAR(0, 5,  1), decoded_topic.lat),
+            station_level, station_trange);
     // set station rep_memo
-    station_rec.set_var(dballe::var(WR_VAR(0, 1,194), items[3].c_str()));
-    // set variable trange
-    variable_rec.setf("pindicator", items[4].c_str());
-    variable_rec.setf("p1", items[5].c_str());
-    variable_rec.setf("p2", items[6].c_str());
-    // set variable level
-    variable_rec.setf("leveltype1", items[7].c_str());
-    variable_rec.setf("l1", items[8].c_str());
-    variable_rec.setf("leveltype2", items[9].c_str());
-    variable_rec.setf("l2", items[10].c_str());
-    // set variable
-    variable_rec.setf("var", items[11].c_str());
+    msg.set(dballe::newvar(WR_VAR(0, 1,194), decoded_topic.rep_memo.str().c_str()),
+            station_level, station_trange);
 }
 
-void Parser::parse_payload(const std::string& payload) {
-    wreport::Var var(dballe::varinfo(variable_rec["var"].enqs()));
-    json_t* root = json_loads(payload.c_str(), 0, NULL);
-    RAIIJson raiijson(root);
-    if (!json_is_object(root))
-        throw std::runtime_error("Payload is not a valid JSON object (document is not a JSON object)");
+void Parser::parse_payload(const char* payload, std::size_t size, dballe::Msg& msg) {
+    step = STEP_VARIABLE;
+    std::unique_ptr<wreport::Var> var = dballe::newvar(decoded_topic.var);
+    dballe::Datetime datetime;
+    step = STEP_JSON;
+    decoder.decode(payload, size);
     // Set the value
-    json_t* v = json_object_get(root, "v");
-    if (json_is_string(v))
-        var.set(json_string_value(v));
-    else if (json_is_integer(v))
-        var.set((int)json_integer_value(v));
-    else if (json_is_real(v))
-        var.set(json_real_value(v));
+    step = STEP_VALUE;
+    const PayloadValue& v = decoder.value;
+    if (v.type == PayloadValue::STRING)
+        var->set(v.str.c_str());
+    else if (v.type == PayloadValue::INTEGER)
+        var->set(v.i);
+    else if (v.type == PayloadValue::REAL)
+        var->set(v.d);
     else
         throw std::runtime_error("Payload is not a valid JSON object (value associated to key \"v\" is not a string, integer or real)");
     // Parse datetime when data are not in station context
-    if (variable_rec.get_level() != dballe::Level() &&
-        variable_rec.get_trange() != dballe::Trange()) {
-        json_t* t = json_object_get(root, "t");
-        dballe::Datetime datetime;
+    if (decoded_topic.level != dballe::Level() &&
+        decoded_topic.trange != dballe::Trange()) {
+        step = STEP_DATETIME;
+        const PayloadValue& t = decoder.datetime;
         // A datetime missing or null means "now"
-        if (!t || json_is_null(t))
+        if (t.type == PayloadValue::ABSENT || t.type == PayloadValue::NUL)
             datetime = datetime_now();
-        else if (json_is_string(t))
-            datetime = dballe::Datetime::from_iso8601(json_string_value(t));
+        else if (t.type == PayloadValue::STRING)
+            datetime = parse_datetime(t.str.data(), t.str.size());
         else
             throw std::runtime_error("Payload is not a valid JSON object (value associated to key \"t\" is not a string)");
-
-        variable_rec.set_datetime(datetime);
     }
     // Parse attributes (if any)
-    if (json_object_iter_at(root, "a")) {
-        json_t* a = json_object_get(root, "a");
-        if (!json_is_object(a))
+    step = STEP_ATTRIBUTES;
+    if (decoder.attributes_type != PayloadValue::ABSENT) {
+        if (decoder.attributes_type != PayloadValue::OBJECT)
             throw std::runtime_error("Payload is not a valid JSON object (value associated to key \"a\" is not an object)");
-        void* i = json_object_iter(a);
-        while (i) {
-            const char* k = json_object_iter_key(i);
-            json_t* av = json_object_iter_value(i);
-            const char* s = json_string_value(av);
-            var.seta(dballe::var(k, s));
-            i = json_object_iter_next(a, i);
+        for (std::size_t i = 0; i < decoder.attributes_count; ++i) {
+            const PayloadAttribute& a = decoder.attributes[i];
+            // Only strings are valid attribute values, other values leave the
+            // attribute unset
+            if (a.value.type == PayloadValue::STRING)
+                var->seta(dballe::var(a.code.c_str(), a.value.str.c_str()));
+            else
+                var->seta(dballe::var(a.code.c_str()));
         }
     }
-    variable_rec.set(var);
+    msg.set(std::move(var), decoded_topic.level, decoded_topic.trange);
+    msg.set_datetime(datetime);
 }
 
-dballe::Msg Parser::parse(const std::string& topic, const std::string& payload) {
-    // clear records
-    station_rec.clear();
-    variable_rec.clear();
-    attributes_rec.clear();
-
-    // parse topic
-    parse_topic(topic);
-    // parse payload
-    parse_payload(payload);
-
-    // create message
+dballe::Msg Parser::parse(const char* topic, std::size_t topic_size,
+                          const char* payload, std::size_t payload_size) {
     dballe::Msg msg;
-    std::vector<wreport::Var*> vars;
-    std::vector<wreport::Var*>::const_iterator it;
+    if (!topic_time) {
+        // parse topic
+        parse_topic(topic, topic_size, msg);
+        // parse payload
+        parse_payload(payload, payload_size, msg);
+        return msg;
+    }
 
-    vars = station_rec.vars();
-    for (it = vars.begin(); it != vars.end(); ++it) {
-        msg.set(**it, (*it)->code(), station_rec.get_level(), station_rec.get_trange());
+    auto start = std::chrono::steady_clock::now();
+    try {
+        parse_topic(topic, topic_size, msg);
+    } catch (const std::range_error&) {
+        topic_errors->add();
+        topic_range_errors->add();
+        throw;
+    } catch (...) {
+        topic_errors->add();
+        topic_syntax_errors->add();
+        throw;
     }
+    auto parsed = std::chrono::steady_clock::now();
+    topic_time->add(parsed - start);
+    try {
+        parse_payload(payload, payload_size, msg);
+    } catch (...) {
+        payload_errors->add();
+        payload_step_errors[step]->add();
+        throw;
+    }
+    payload_time->add_since(parsed);
+    return msg;
+}
+
+void Parser::set_stats(Stats& stats) {
+    topic_time = &stats.histogram("topic_parse");
+    payload_time = &stats.histogram("payload_parse");
+    topic_errors = &stats.counter("errors_topic");
+    payload_errors = &stats.counter("errors_payload");
+    topic_syntax_errors = &stats.counter("errors_topic_syntax");
+    topic_range_errors = &stats.counter("errors_topic_range");
+    payload_step_errors[STEP_VARIABLE] = &stats.counter("errors_payload_variable");
+    payload_step_errors[STEP_JSON] = &stats.counter("errors_payload_json");
+    payload_step_errors[STEP_VALUE] = &stats.counter("errors_payload_value");
+    payload_step_errors[STEP_DATETIME] = &stats.counter("errors_payload_datetime");
+    payload_step_errors[STEP_ATTRIBUTES] = &stats.counter("errors_payload_attributes");
+}
 
-    vars = variable_rec.vars();
-    for (it = vars.begin(); it != vars.end(); ++it) {
-        msg.set(**it, (*it)->code(), variable_rec.get_level(), variable_rec.get_trange());
+}
+
+namespace {
+
+/// Append val, left-padded with zeros to width digits
+void append_uint(std::string& out, unsigned val, int width=1) {
+    char buf[16];
+    char* end = buf + sizeof(buf);
+    char* p = end;
+    do {
+        *--p = '0' + val % 10;
+        val /= 10;
+    } while (val || end - p < width);
+    out.append(p, end - p);
+}
+
+/// Append val, or "-" if it is missing (as Level::to_stream and
+/// Trange::to_stream do)
+void append_int(std::string& out, int val) {
+    if (val == dballe::MISSING_INT) {
+        out += '-';
+    } else if (val < 0) {
+        out += '-';
+        append_uint(out, -(unsigned)val);
+    } else {
+        append_uint(out, val);
     }
+}
 
-    // set datetime from variable_rec
-    msg.set_datetime(variable_rec.get_datetime());
+/// Append the code as formatted by wreport::varcode_format
+void append_varcode(std::string& out, wreport::Varcode code) {
+    static const char types[] = "BRCD";
+    out += types[WR_VAR_F(code)];
+    append_uint(out, WR_VAR_X(code), 2);
+    append_uint(out, WR_VAR_Y(code), 3);
+}
 
-    return msg;
+/// Append the value of a station variable, or "-" if it is missing
+void append_station_var(std::string& out, const dballe::msg::Context& ctx, wreport::Varcode code) {
+    if (const wreport::Var* v = ctx.find(code))
+        out += v->enqc();
+    else
+        out += '-';
 }
 
+/// Append s as a JSON string, escaped as jansson does
+void append_json_string(std::string& out, const char* s) {
+    static const char hex[] = "0123456789ABCDEF";
+    out += '"';
+    for (const char* p = s; *p; ++p) {
+        unsigned char c = *p;
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\b': out += "\\b"; break;
+            case '\f': out += "\\f"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (c < 0x20) {
+                    out += "\\u00";
+                    out += hex[c >> 4];
+                    out += hex[c & 0xf];
+                } else {
+                    out += (char)c;
+                }
+        }
+    }
+    out += '"';
 }
 
-#include <sstream>
+}
 
 namespace bufr2mqtt {
 
+void Parser::set_station(const dballe::msg::Context& station_context) {
+    station_prefix.clear();
+    station_prefix += '/';
+    append_station_var(station_prefix, station_context, WR_VAR(0, 1, 11));
+    station_prefix += '/';
+    append_station_var(station_prefix, station_context, WR_VAR(0, 6,  1));
+    station_prefix += ',';
+    append_station_var(station_prefix, station_context, WR_VAR(0, 5,  1));
+    station_prefix += '/';
+    append_station_var(station_prefix, station_context, WR_VAR(0, 1,194));
+    station_prefix += '/';
+}
+
 void Parser::parse(const wreport::Var& var, const dballe::Level& level, const dballe::Trange& trange,
-                   const dballe::msg::Context& station_context,
                    const dballe::Datetime& datetime,
                    std::string& topic, std::string& payload) {
-    topic.clear();
+    topic = station_prefix;
+    append_int(topic, trange.pind);
+    topic += ',';
+    append_int(topic, trange.p1);
+    topic += ',';
+    append_int(topic, trange.p2);
+    topic += '/';
+    // NOTE: at this moment, the station info level is not (-,-,-,-), so we
+    // have to translate from dballe internal representation.
+    append_int(topic, level.ltype1);
+    topic += ',';
+    append_int(topic, level.l1);
+    topic += ',';
+    append_int(topic, level.ltype2);
+    topic += ',';
+    append_int(topic, level.l2);
+    topic += '/';
+    append_varcode(topic, var.code());
+
+    // Same layout of json_dumps(root, 0)
     payload.clear();
-    topic = "/";
-    if (const wreport::Var* v = station_context.find(WR_VAR(0, 1, 11)))
-        topic += v->enqc();
-    else
-        topic += "-";
-    topic += "/";
-    if (const wreport::Var* v = station_context.find(WR_VAR(0, 6,  1)))
-        topic += v->enqc();
-    else
-        topic += "-";
-    topic +=",";
-    if (const wreport::Var* v = station_context.find(WR_VAR(0, 5,  1)))
-        topic += v->enqc();
-    else
-        topic += "-";
-    topic += "/";
-    if (const wreport::Var* v = station_context.find(WR_VAR(0, 1,194)))
-        topic += v->enqc();
-    else
-        topic += "-";
-    topic += "/";
-    {
-        std::stringstream ss;
-        trange.to_stream(ss);
-        topic += ss.str();
+    payload += '{';
+    if (const char* v = var.enqc()) {
+        payload += "\"v\": ";
+        append_json_string(payload, v);
     }
-    topic += "/";
-    {
-        std::stringstream ss;
-        // NOTE: at this moment, the station info level is not (-,-,-,-), so we
-        // have to translate from dballe internal representation.
-        level.to_stream(ss);
-        topic += ss.str();
-    }
-    topic += "/";
-    topic += wreport::varcode_format(var.code());
-
-    json_t* root = json_object();
-    json_t* v;
-    RAIIJson raiijson(root);
-    v = json_string(var.enqc());
-    json_object_set_new(root, "v", v);
     if (level != dballe::Level() && trange != dballe::Trange()) {
-        std::stringstream ss;
-        datetime.to_stream_iso8601(ss, 'T', "");
-        v = json_string(ss.str().c_str());
-        json_object_set_new(root, "t", v);
+        if (payload.size() > 1)
+            payload += ", ";
+        payload += "\"t\": \"";
+        append_uint(payload, datetime.year, 4);
+        payload += '-';
+        append_uint(payload, datetime.month, 2);
+        payload += '-';
+        append_uint(payload, datetime.day, 2);
+        payload += 'T';
+        append_uint(payload, datetime.hour, 2);
+        payload += ':';
+        append_uint(payload, datetime.minute, 2);
+        payload += ':';
+        append_uint(payload, datetime.second, 2);
+        payload += '"';
     }
-    v = NULL;
-    for (const wreport::Var* a = var.next_attr(); a != NULL; a = a->next_attr()) {
-        if (!v) {
-            v = json_object();
-            json_object_set_new(root, "a", v);
+    if (const wreport::Var* a = var.next_attr()) {
+        if (payload.size() > 1)
+            payload += ", ";
+        payload += "\"a\": {";
+        bool first = true;
+        for ( ; a != NULL; a = a->next_attr()) {
+            const char* v = a->enqc();
+            if (!v)
+                continue;
+            if (!first)
+                payload += ", ";
+            first = false;
+            payload += '"';
+            append_varcode(payload, a->code());
+            payload += "\": ";
+            append_json_string(payload, v);
         }
-        json_t* av = json_string(a->enqc());
-        json_object_set_new(v, wreport::varcode_format(a->code()).c_str(), av);
+        payload += '}';
     }
-    char* s = json_dumps(root, 0);
-    payload = s;
-    free(s);
+    payload += '}';
 }
 
 }
@@ -24,9 +24,12 @@
 #define MQTT2BUFR_PARSER_H
 
 #include <string>
-#include <dballe/core/record.h>
 #include <dballe/msg/msg.h>
 
+#include "topic.h"
+#include "payload.h"
+#include "stats.h"
+
 namespace mqtt2bufr {
 
 dballe::Datetime datetime_now();
@@ -40,25 +43,73 @@ dballe::Datetime datetime_now();
  *   - VALUE: value of the variable VAR
  *     - if string or integer: CREX format
  *     - if double (e.g. 12.3, 33.0) : CREX format / scale
- *   - DATETIME: `YYYY-mm-ddTHH:MM:SS` or `YYYY-mm-dd HH:MM:SS`
+ *   - DATETIME: `YYYY-mm-ddTHH:MM:SS` or `YYYY-mm-dd HH:MM:SS`, with an
+ *     optional trailing `Z`
  */
 class Parser {
  protected:
-  dballe::core::Record station_rec;
-  dballe::core::Record variable_rec;
-  dballe::core::Record attributes_rec;
+  Topic decoded_topic;
+  PayloadDecoder decoder;
+  /// Statistics, if enabled
+  Histogram* topic_time = nullptr;
+  Histogram* payload_time = nullptr;
+  Counter* topic_errors = nullptr;
+  Counter* payload_errors = nullptr;
+  /// Topic errors by reason
+  Counter* topic_syntax_errors = nullptr;
+  Counter* topic_range_errors = nullptr;
+
+  /// Steps of parse_payload(), to count its errors by reason
+  enum {
+      STEP_VARIABLE,
+      STEP_JSON,
+      STEP_VALUE,
+      STEP_DATETIME,
+      STEP_ATTRIBUTES,
+      STEP_COUNT,
+  };
+  int step = STEP_VARIABLE;
+  /// Payload errors by step
+  Counter* payload_step_errors[STEP_COUNT] = {};
 
   /**
-   * Parse the topic.
+   * Parse the topic, setting the station variables in the message.
    */
-  void parse_topic(const std::string& topic);
+  void parse_topic(const char* topic, std::size_t size, dballe::Msg& msg);
   /**
-   * Parse payload.
+   * Parse payload, setting the variable and the datetime in the message.
    */
-  void parse_payload(const std::string& payload);
+  void parse_payload(const char* payload, std::size_t size, dballe::Msg& msg);
 
  public:
-  dballe::Msg parse(const std::string& topic, const std::string& payload);
+  /**
+   * Parse a message.
+   *
+   * The payload is read in place and does not need to be NUL-terminated.
+   */
+  dballe::Msg parse(const char* topic, std::size_t topic_size,
+                    const char* payload, std::size_t payload_size);
+
+  dballe::Msg parse(const std::string& topic, const std::string& payload) {
+      return parse(topic.data(), topic.size(), payload.data(), payload.size());
+  }
+
+  /**
+   * Record the time spent parsing topics and payloads (`topic_parse`,
+   * `payload_parse`) and the errors of each (`errors_topic`,
+   * `errors_payload`) in stats, also by reason: `errors_topic_syntax`,
+   * `errors_topic_range` (numbers too large), `errors_payload_variable`
+   * (unknown variable), `errors_payload_json`, `errors_payload_value`,
+   * `errors_payload_datetime` and `errors_payload_attributes`.
+   */
+  void set_stats(Stats& stats);
+
+  /**
+   * Topic of the last parsed message.
+   *
+   * Its fields point into the topic given to parse().
+   */
+  const Topic& topic() const { return decoded_topic; }
 };
 
 }
@@ -70,14 +121,42 @@ namespace bufr2mqtt {
  * This class converts a (var, level, trange), station context and date to MQTT
  * topic and payload.
  *
+ * Topic and payload are formatted in buffers owned by the caller, which are
+ * overwritten reusing their storage: formatting does not allocate once the
+ * buffers are large enough.
+ *
  * @see mqtt2bufr::Parser for a description of the MQTT topic and payload.
  */
 class Parser {
+ protected:
+  /// Station part of the topic: `/IDENT/LON,LAT/REP_MEMO/`
+  std::string station_prefix;
+
  public:
+  /**
+   * Set the station of the following parse() calls.
+   *
+   * The station part of the topic is formatted here, once for all the
+   * variables of a message.
+   */
+  void set_station(const dballe::msg::Context& station_context);
+
+  /**
+   * Format topic and payload of a variable of the station given to
+   * set_station().
+   */
   void parse(const wreport::Var& var, const dballe::Level& level, const dballe::Trange& trange,
-             const dballe::msg::Context& station_context,
              const dballe::Datetime& datetime,
              std::string& topic, std::string& payload);
+
+  /// Same as set_station() followed by parse()
+  void parse(const wreport::Var& var, const dballe::Level& level, const dballe::Trange& trange,
+             const dballe::msg::Context& station_context,
+             const dballe::Datetime& datetime,
+             std::string& topic, std::string& payload) {
+      set_station(station_context);
+      parse(var, level, trange, datetime, topic, payload);
+  }
 };
 
 }
@@ -0,0 +1,431 @@
+/*
+ * payload - MQTT payload decoder
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+
+#include "payload.h"
+
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+// Maximum nesting of skipped values
+#define MAX_DEPTH 32
+
+namespace mqtt2bufr {
+
+void PayloadDecoder::error(const char* msg) const {
+    char buf[256];
+    snprintf(buf, sizeof(buf),
+             "Payload is not a valid JSON object (%s at offset %d)",
+             msg, (int)(cur - begin));
+    throw std::runtime_error(buf);
+}
+
+void PayloadDecoder::unexpected() const {
+    if (cur == end)
+        error("unexpected end of document");
+    char buf[64];
+    if ((unsigned char)*cur < 0x20 || (unsigned char)*cur >= 0x7f)
+        snprintf(buf, sizeof(buf), "unexpected character 0x%02x", (unsigned char)*cur);
+    else
+        snprintf(buf, sizeof(buf), "unexpected character '%c'", *cur);
+    error(buf);
+}
+
+void PayloadDecoder::skip_ws() {
+    while (cur != end && (*cur == ' ' || *cur == '\t' || *cur == '\n' || *cur == '\r'))
+        ++cur;
+}
+
+void PayloadDecoder::expect(char c) {
+    skip_ws();
+    if (cur == end || *cur != c)
+        unexpected();
+    ++cur;
+}
+
+static int hexval(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static void append_utf8(std::string& out, unsigned cp) {
+    if (cp < 0x80) {
+        out += (char)cp;
+    } else if (cp < 0x800) {
+        out += (char)(0xc0 | (cp >> 6));
+        out += (char)(0x80 | (cp & 0x3f));
+    } else if (cp < 0x10000) {
+        out += (char)(0xe0 | (cp >> 12));
+        out += (char)(0x80 | ((cp >> 6) & 0x3f));
+        out += (char)(0x80 | (cp & 0x3f));
+    } else {
+        out += (char)(0xf0 | (cp >> 18));
+        out += (char)(0x80 | ((cp >> 12) & 0x3f));
+        out += (char)(0x80 | ((cp >> 6) & 0x3f));
+        out += (char)(0x80 | (cp & 0x3f));
+    }
+}
+
+void PayloadDecoder::read_string(std::string& out) {
+    expect('"');
+    out.clear();
+    while (true) {
+        // Copy the unescaped run in one go
+        const char* start = cur;
+        while (cur != end && *cur != '"' && *cur != '\\' && (unsigned char)*cur >= 0x20)
+            ++cur;
+        out.append(start, cur - start);
+        if (cur == end)
+            error("unterminated string");
+        if (*cur == '"') {
+            ++cur;
+            return;
+        }
+        if (*cur != '\\')
+            error("control character in string");
+        if (++cur == end)
+            error("unterminated string");
+        switch (*cur++) {
+            case '"': out += '"'; break;
+            case '\\': out += '\\'; break;
+            case '/': out += '/'; break;
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'n': out += '\n'; break;
+            case 'r': out += '\r'; break;
+            case 't': out += '\t'; break;
+            case 'u': {
+                unsigned cp = 0;
+                for (int i = 0; i < 4; ++i, ++cur) {
+                    int h = cur == end ? -1 : hexval(*cur);
+                    if (h < 0) error("invalid \\u escape in string");
+                    cp = cp << 4 | h;
+                }
+                if (cp >= 0xd800 && cp < 0xdc00) {
+                    // Surrogate pair
+                    unsigned lo = 0;
+                    if (end - cur < 6 || cur[0] != '\\' || cur[1] != 'u')
+                        error("invalid surrogate pair in string");
+                    cur += 2;
+                    for (int i = 0; i < 4; ++i, ++cur) {
+                        int h = hexval(*cur);
+                        if (h < 0) error("invalid \\u escape in string");
+                        lo = lo << 4 | h;
+                    }
+                    if (lo < 0xdc00 || lo >= 0xe000)
+                        error("invalid surrogate pair in string");
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                } else if (cp >= 0xdc00 && cp < 0xe000) {
+                    error("invalid surrogate pair in string");
+                } else if (cp == 0) {
+                    error("\\u0000 is not allowed in string");
+                }
+                append_utf8(out, cp);
+                break;
+            }
+            default:
+                --cur;
+                error("invalid escape in string");
+        }
+    }
+}
+
+void PayloadDecoder::read_number(PayloadValue& out) {
+    const char* start = cur;
+    bool real = false;
+    if (cur != end && *cur == '-') ++cur;
+    if (cur == end) unexpected();
+    if (*cur == '0') {
+        ++cur;
+    } else if (*cur >= '1' && *cur <= '9') {
+        while (cur != end && *cur >= '0' && *cur <= '9') ++cur;
+    } else {
+        unexpected();
+    }
+    if (cur != end && *cur == '.') {
+        real = true;
+        ++cur;
+        if (cur == end || *cur < '0' || *cur > '9') unexpected();
+        while (cur != end && *cur >= '0' && *cur <= '9') ++cur;
+    }
+    if (cur != end && (*cur == 'e' || *cur == 'E')) {
+        real = true;
+        ++cur;
+        if (cur != end && (*cur == '+' || *cur == '-')) ++cur;
+        if (cur == end || *cur < '0' || *cur > '9') unexpected();
+        while (cur != end && *cur >= '0' && *cur <= '9') ++cur;
+    }
+
+    // strtol and strtod need a terminated string
+    char buf[64];
+    std::size_t len = cur - start;
+    if (len >= sizeof(buf)) {
+        cur = start;
+        error("number too long");
+    }
+    memcpy(buf, start, len);
+    buf[len] = 0;
+
+    errno = 0;
+    if (real) {
+        out.type = PayloadValue::REAL;
+        out.d = strtod(buf, NULL);
+    } else {
+        long long v = strtoll(buf, NULL, 10);
+        if (errno == ERANGE || v < INT_MIN || v > INT_MAX) {
+            cur = start;
+            error("integer out of range");
+        }
+        out.type = PayloadValue::INTEGER;
+        out.i = (int)v;
+    }
+}
+
+void PayloadDecoder::read_literal(const char* lit) {
+    for (; *lit; ++lit, ++cur)
+        if (cur == end || *cur != *lit)
+            unexpected();
+}
+
+void PayloadDecoder::read_value(PayloadValue& out) {
+    skip_ws();
+    if (cur == end)
+        unexpected();
+    switch (*cur) {
+        case '"':
+            read_string(out.str);
+            out.type = PayloadValue::STRING;
+            break;
+        case 'n':
+            read_literal("null");
+            out.type = PayloadValue::NUL;
+            break;
+        case 't':
+        case 'f':
+        case '[':
+            skip_value(0);
+            out.type = PayloadValue::OTHER;
+            break;
+        case '{':
+            skip_value(0);
+            out.type = PayloadValue::OBJECT;
+            break;
+        default:
+            read_number(out);
+            break;
+    }
+}
+
+void PayloadDecoder::skip_value(unsigned depth) {
+    if (depth > MAX_DEPTH)
+        error("too many nested values");
+    skip_ws();
+    if (cur == end)
+        unexpected();
+    switch (*cur) {
+        case '"': read_string(scratch); break;
+        case 't': read_literal("true"); break;
+        case 'f': read_literal("false"); break;
+        case 'n': read_literal("null"); break;
+        case '[':
+            ++cur;
+            skip_ws();
+            if (cur != end && *cur == ']') {
+                ++cur;
+                break;
+            }
+            while (true) {
+                skip_value(depth + 1);
+                skip_ws();
+                if (cur != end && *cur == ',') {
+                    ++cur;
+                    continue;
+                }
+                expect(']');
+                break;
+            }
+            break;
+        case '{':
+            ++cur;
+            skip_ws();
+            if (cur != end && *cur == '}') {
+                ++cur;
+                break;
+            }
+            while (true) {
+                read_string(scratch);
+                expect(':');
+                skip_value(depth + 1);
+                skip_ws();
+                if (cur != end && *cur == ',') {
+                    ++cur;
+                    continue;
+                }
+                expect('}');
+                break;
+            }
+            break;
+        default: {
+            PayloadValue tmp;
+            read_number(tmp);
+            break;
+        }
+    }
+}
+
+void PayloadDecoder::read_attributes() {
+    // cur is at '{'
+    ++cur;
+    skip_ws();
+    if (cur != end && *cur == '}') {
+        ++cur;
+        return;
+    }
+    while (true) {
+        if (attributes_count == attributes.size())
+            attributes.resize(attributes_count + 1);
+        PayloadAttribute& attr = attributes[attributes_count];
+        read_string(attr.code);
+        expect(':');
+        read_value(attr.value);
+        // Like in a JSON object, a duplicated key overrides the former one
+        std::size_t i = 0;
+        while (i < attributes_count && attributes[i].code != attr.code) ++i;
+        if (i == attributes_count)
+            ++attributes_count;
+        else
+            std::swap(attributes[i].value, attr.value);
+        skip_ws();
+        if (cur != end && *cur == ',') {
+            ++cur;
+            continue;
+        }
+        expect('}');
+        return;
+    }
+}
+
+void PayloadDecoder::decode(const char* data, std::size_t size) {
+    begin = cur = data;
+    const char* nul = size ? (const char*)memchr(data, 0, size) : NULL;
+    end = nul ? nul : data + size;
+
+    value.type = PayloadValue::ABSENT;
+    datetime.type = PayloadValue::ABSENT;
+    attributes_type = PayloadValue::ABSENT;
+    attributes_count = 0;
+
+    skip_ws();
+    if (cur == end || *cur != '{')
+        error("document is not a JSON object");
+    ++cur;
+    skip_ws();
+    if (cur != end && *cur == '}') {
+        ++cur;
+    } else {
+        while (true) {
+            read_string(scratch);
+            expect(':');
+            if (scratch == "v") {
+                read_value(value);
+            } else if (scratch == "t") {
+                read_value(datetime);
+            } else if (scratch == "a") {
+                skip_ws();
+                if (cur != end && *cur == '{') {
+                    attributes_count = 0;
+                    attributes_type = PayloadValue::OBJECT;
+                    read_attributes();
+                } else {
+                    PayloadValue tmp;
+                    read_value(tmp);
+                    attributes_type = tmp.type;
+                }
+            } else {
+                skip_value(0);
+            }
+            skip_ws();
+            if (cur != end && *cur == ',') {
+                ++cur;
+                continue;
+            }
+            expect('}');
+            break;
+        }
+    }
+    skip_ws();
+    if (cur != end)
+        error("end of document expected");
+}
+
+static bool read_digits(const char*& p, const char* end, int n, int& val) {
+    val = 0;
+    for (int i = 0; i < n; ++i, ++p) {
+        if (p == end || *p < '0' || *p > '9')
+            return false;
+        val = val * 10 + (*p - '0');
+    }
+    return true;
+}
+
+static bool read_char(const char*& p, const char* end, char c) {
+    if (p == end || *p != c)
+        return false;
+    ++p;
+    return true;
+}
+
+dballe::Datetime parse_datetime(const char* s, std::size_t size) {
+    const char* p = s;
+    const char* end = s + size;
+    int ye, mo, da, ho, mi, se;
+    bool ok = read_digits(p, end, 4, ye) && read_char(p, end, '-')
+           && read_digits(p, end, 2, mo) && read_char(p, end, '-')
+           && read_digits(p, end, 2, da)
+           && (read_char(p, end, 'T') || read_char(p, end, ' '))
+           && read_digits(p, end, 2, ho) && read_char(p, end, ':')
+           && read_digits(p, end, 2, mi) && read_char(p, end, ':')
+           && read_digits(p, end, 2, se);
+    if (ok)
+        read_char(p, end, 'Z');
+    if (!ok || p != end)
+        throw std::runtime_error("cannot parse datetime \"" + std::string(s, size)
+                                 + "\": expected YYYY-mm-ddTHH:MM:SS");
+
+    static const int mdays[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+    bool leap = (ye % 4 == 0 && ye % 100 != 0) || ye % 400 == 0;
+    if (mo < 1 || mo > 12 || da < 1
+        || da > mdays[mo - 1] + (mo == 2 && leap ? 1 : 0)
+        || ho > 23 || mi > 59 || se > 60)
+        throw std::runtime_error("cannot parse datetime \"" + std::string(s, size)
+                                 + "\": value out of range");
+
+    return dballe::Datetime(ye, mo, da, ho, mi, se);
+}
+
+}
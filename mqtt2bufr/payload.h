@@ -0,0 +1,125 @@
+/*
+ * payload - MQTT payload decoder
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+#ifndef MQTT2BUFR_PAYLOAD_H
+#define MQTT2BUFR_PAYLOAD_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include <dballe/types.h>
+
+namespace mqtt2bufr {
+
+/**
+ * JSON value read from the payload.
+ */
+struct PayloadValue {
+    enum Type {
+        /// Key not found in the document
+        ABSENT,
+        NUL,
+        STRING,
+        INTEGER,
+        REAL,
+        OBJECT,
+        /// Boolean or array
+        OTHER,
+    };
+    Type type = ABSENT;
+    /// Unescaped value, if type is STRING
+    std::string str;
+    /// Value, if type is INTEGER
+    int i = 0;
+    /// Value, if type is REAL
+    double d = 0;
+};
+
+/**
+ * Attribute read from the "a" object of the payload.
+ */
+struct PayloadAttribute {
+    std::string code;
+    PayloadValue value;
+};
+
+/**
+ * Streaming decoder for the MQTT payload.
+ *
+ * Only the documented schema is decoded:
+ * `{ "v": VALUE, "t": "DATETIME", "a": { "BXXYYY": "...", } }`
+ * Other keys are validated and skipped. The document ends at the end of the
+ * buffer or at the first NUL character.
+ *
+ * The buffers are reused between calls to decode(), so that a decoder kept
+ * alive across messages does not allocate in steady state.
+ */
+class PayloadDecoder {
+ protected:
+  const char* cur = nullptr;
+  const char* end = nullptr;
+  const char* begin = nullptr;
+  /// Buffer for keys and skipped strings
+  std::string scratch;
+
+  [[noreturn]] void error(const char* msg) const;
+  [[noreturn]] void unexpected() const;
+  void skip_ws();
+  void expect(char c);
+  void read_string(std::string& out);
+  void read_number(PayloadValue& out);
+  void read_literal(const char* lit);
+  void read_value(PayloadValue& out);
+  void read_attributes();
+  void skip_value(unsigned depth);
+
+ public:
+  /// Value of "v"
+  PayloadValue value;
+  /// Value of "t"
+  PayloadValue datetime;
+  /// Type of "a"
+  PayloadValue::Type attributes_type = PayloadValue::ABSENT;
+  /// Attributes in "a", only the first attributes_count are valid
+  std::vector<PayloadAttribute> attributes;
+  std::size_t attributes_count = 0;
+
+  /**
+   * Decode a payload.
+   *
+   * @throw std::runtime_error if the payload is not a valid JSON object.
+   */
+  void decode(const char* data, std::size_t size);
+};
+
+/**
+ * Parse a datetime in the format `YYYY-mm-ddTHH:MM:SS` or
+ * `YYYY-mm-dd HH:MM:SS`, with an optional trailing `Z`.
+ *
+ * @throw std::runtime_error if the datetime is not valid.
+ */
+dballe::Datetime parse_datetime(const char* s, std::size_t size);
+
+}
+
+#endif
@@ -0,0 +1,123 @@
+/*
+ * queue - Bounded queue between pipeline stages
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+#ifndef MQTT2BUFR_QUEUE_H
+#define MQTT2BUFR_QUEUE_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+namespace mqtt2bufr {
+
+/**
+ * Bounded multi-producer, multi-consumer queue.
+ *
+ * The slots are allocated once: pushing and popping only move the items.
+ * Producers block while the queue is full, so that a slow stage applies
+ * backpressure to the previous one.
+ */
+template<typename T>
+class BoundedQueue {
+ protected:
+  std::mutex mutex;
+  std::condition_variable not_empty;
+  std::condition_variable not_full;
+  std::vector<T> slots;
+  std::size_t head = 0;
+  std::size_t count = 0;
+  bool closed = false;
+
+  T take() {
+      T item = std::move(slots[head]);
+      head = (head + 1) % slots.size();
+      --count;
+      not_full.notify_one();
+      return item;
+  }
+
+ public:
+  enum Status { OK, TIMEOUT, CLOSED };
+
+  explicit BoundedQueue(std::size_t capacity) : slots(capacity ? capacity : 1) {}
+
+  /**
+   * Add an item, waiting for a free slot.
+   *
+   * @return false if the queue was closed (the item is discarded)
+   */
+  bool push(T&& item) {
+      std::unique_lock<std::mutex> lock(mutex);
+      not_full.wait(lock, [this] { return closed || count < slots.size(); });
+      if (closed)
+          return false;
+      slots[(head + count) % slots.size()] = std::move(item);
+      ++count;
+      not_empty.notify_one();
+      return true;
+  }
+
+  /**
+   * Remove an item, waiting for one to be available.
+   *
+   * @return false if the queue is closed and empty
+   */
+  bool pop(T& item) {
+      std::unique_lock<std::mutex> lock(mutex);
+      not_empty.wait(lock, [this] { return closed || count > 0; });
+      if (count == 0)
+          return false;
+      item = take();
+      return true;
+  }
+
+  /**
+   * Remove an item, waiting at most timeout for one to be available.
+   */
+  template<typename Rep, typename Period>
+  Status pop_for(T& item, const std::chrono::duration<Rep, Period>& timeout) {
+      std::unique_lock<std::mutex> lock(mutex);
+      if (!not_empty.wait_for(lock, timeout, [this] { return closed || count > 0; }))
+          return TIMEOUT;
+      if (count == 0)
+          return CLOSED;
+      item = take();
+      return OK;
+  }
+
+  /**
+   * Close the queue: pending items can still be popped, new items are
+   * rejected and waiting threads are woken up.
+   */
+  void close() {
+      std::lock_guard<std::mutex> lock(mutex);
+      closed = true;
+      not_empty.notify_all();
+      not_full.notify_all();
+  }
+};
+
+}
+
+#endif
@@ -0,0 +1,75 @@
+/*
+ * retained - Last retained payload of each topic
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+
+#include "retained.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include <sys/stat.h>
+
+namespace bufr2mqtt {
+
+// File format: one line per topic, "TOPIC\tPAYLOAD". Topics cannot contain
+// tabs and the JSON payloads are written on a single line.
+
+void RetainedCache::load(const std::string& pathname) {
+    struct stat st;
+    if (stat(pathname.c_str(), &st) != 0 && errno == ENOENT)
+        return;
+    std::ifstream in(pathname);
+    if (!in)
+        throw std::runtime_error("cannot open " + pathname);
+    std::string line;
+    while (std::getline(in, line)) {
+        std::size_t sep = line.find('\t');
+        if (sep == std::string::npos)
+            continue;
+        payloads[line.substr(0, sep)] = line.substr(sep + 1);
+    }
+    if (in.bad())
+        throw std::runtime_error("cannot read " + pathname);
+}
+
+void RetainedCache::save(const std::string& pathname) const {
+    std::string tmp = pathname + ".tmp";
+    {
+        std::ofstream out(tmp);
+        for (const auto& i: payloads) {
+            if (i.first.find_first_of("\t\n") != std::string::npos ||
+                i.second.find('\n') != std::string::npos)
+                continue;
+            out << i.first << '\t' << i.second << '\n';
+        }
+        out.close();
+        if (!out)
+            throw std::runtime_error("cannot write " + tmp);
+    }
+    if (rename(tmp.c_str(), pathname.c_str()) != 0)
+        throw std::runtime_error("cannot rename " + tmp + ": " + strerror(errno));
+}
+
+}
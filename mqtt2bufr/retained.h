@@ -0,0 +1,83 @@
+/*
+ * retained - Last retained payload of each topic
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+#ifndef MQTT2BUFR_RETAINED_H
+#define MQTT2BUFR_RETAINED_H
+
+#include <string>
+#include <unordered_map>
+
+namespace bufr2mqtt {
+
+/**
+ * Last payload published as retained on each topic, to skip publishing it
+ * again when it did not change (e.g. station information, republished with
+ * every message of the station).
+ *
+ * The cache can be saved to a file and loaded in the next run. It is not
+ * thread safe.
+ */
+class RetainedCache {
+ protected:
+  std::unordered_map<std::string, std::string> payloads;
+
+ public:
+  /// Publishes skipped because the payload did not change
+  unsigned long long suppressed = 0;
+
+  /**
+   * Check if payload is already retained on topic, counting it as
+   * suppressed.
+   */
+  bool unchanged(const std::string& topic, const std::string& payload) {
+      auto i = payloads.find(topic);
+      if (i == payloads.end() || i->second != payload)
+          return false;
+      ++suppressed;
+      return true;
+  }
+
+  /// Remember the payload published on topic
+  void set(const std::string& topic, const std::string& payload) {
+      payloads[topic] = payload;
+  }
+
+  std::size_t size() const { return payloads.size(); }
+
+  /**
+   * Load the cache saved by save(), if the file exists.
+   *
+   * @throw std::runtime_error if the file cannot be read
+   */
+  void load(const std::string& pathname);
+
+  /**
+   * Save the cache, replacing the file atomically.
+   *
+   * @throw std::runtime_error if the file cannot be written
+   */
+  void save(const std::string& pathname) const;
+};
+
+}
+
+#endif
@@ -0,0 +1,132 @@
+/*
+ * roundtrip-compress - Check the compressed bulletins against the uncompressed
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <dballe/msg/msg.h>
+#include <dballe/msg/wr_codec.h>
+
+#include "batch.h"
+#include "corpus.h"
+#include "parser.h"
+
+/// One line per variable, sorted: equal for messages with the same observations
+static std::string describe(const dballe::Msg& msg) {
+    std::vector<std::string> lines;
+    char buf[64];
+    dballe::Datetime dt = msg.get_datetime();
+    if (!dt.is_missing()) {
+        snprintf(buf, sizeof(buf), "%04d-%02d-%02d %02d:%02d:%02d",
+                 dt.year, dt.month, dt.day, dt.hour, dt.minute, dt.second);
+        lines.push_back(buf);
+    }
+    for (const auto& ctx: msg.data) {
+        const dballe::Level& l = ctx->level;
+        const dballe::Trange& t = ctx->trange;
+        for (const auto& var: ctx->data) {
+            snprintf(buf, sizeof(buf), "%d,%d,%d,%d %d,%d,%d ",
+                     l.ltype1, l.l1, l.ltype2, l.l2, t.pind, t.p1, t.p2);
+            std::string line = buf;
+            line += wreport::varcode_format(var->code()) + "=" + var->format("");
+            for (const wreport::Var* a = var->next_attr(); a; a = a->next_attr())
+                line += " " + wreport::varcode_format(a->code()) + "=" + a->format("");
+            lines.push_back(line);
+        }
+    }
+    std::sort(lines.begin(), lines.end());
+    std::string res;
+    for (const auto& line: lines)
+        res += line + "\n";
+    return res;
+}
+
+/// Encode the corpus in a batch, decode it and describe each message, sorted
+static std::vector<std::string> roundtrip(const std::vector<mqtt2bufr::CorpusMessage>& corpus,
+                                          bool compress) {
+    mqtt2bufr::Parser parser;
+    mqtt2bufr::Batch batch(true);
+    if (compress)
+        batch.set_compression();
+    for (const auto& m: corpus) {
+        try {
+            batch.add(parser.parse(m.topic, m.payload));
+        } catch (const std::exception& e) {
+            // Same messages skipped by both runs
+        }
+    }
+    std::string data = batch.encode();
+
+    std::vector<std::string> res;
+    FILE* in = fmemopen(&data[0], data.size(), "r");
+    if (!in) {
+        perror("fmemopen");
+        exit(2);
+    }
+    std::unique_ptr<dballe::File> input = dballe::File::create(dballe::File::BUFR, in, true, "batch");
+    dballe::msg::BufrImporter importer;
+    input->foreach([&](const dballe::BinaryMessage& bmsg) {
+        return importer.foreach_decoded(bmsg, [&](std::unique_ptr<dballe::Message>&& msg) {
+            res.push_back(describe(dballe::Msg::downcast(*msg)));
+            return true;
+        });
+    });
+    std::sort(res.begin(), res.end());
+    return res;
+}
+
+int main(int argc, char** argv)
+{
+    mqtt2bufr::CorpusOptions opts;
+    if (argc > 1)
+        opts.count = strtoul(argv[1], NULL, 10);
+    if (argc > 2)
+        opts.seed = strtoul(argv[2], NULL, 10);
+    const std::vector<mqtt2bufr::CorpusMessage> corpus = mqtt2bufr::make_corpus(opts);
+
+    std::vector<std::string> expected = roundtrip(corpus, false);
+    std::vector<std::string> compressed = roundtrip(corpus, true);
+
+    std::cout << corpus.size() << " MQTT messages, " << expected.size()
+              << " messages uncompressed, " << compressed.size()
+              << " messages compressed" << std::endl;
+    if (expected.size() != compressed.size()) {
+        std::cerr << "Different number of messages" << std::endl;
+        return 1;
+    }
+    for (std::size_t i = 0; i < expected.size(); ++i)
+        if (expected[i] != compressed[i]) {
+            std::cerr << "Messages differ:" << std::endl
+                      << "uncompressed:" << std::endl << expected[i]
+                      << "compressed:" << std::endl << compressed[i];
+            return 1;
+        }
+    return 0;
+}
@@ -0,0 +1,302 @@
+/*
+ * router - Route messages to outputs according to rules on their topic
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+
+#include "router.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+#include <fnmatch.h>
+
+namespace {
+
+/// Parse `BXXYYY`
+bool parse_varcode(const std::string& s, wreport::Varcode& code) {
+    if (s.size() != 6 || s[0] != 'B')
+        return false;
+    for (int i = 1; i < 6; ++i)
+        if (s[i] < '0' || s[i] > '9')
+            return false;
+    int x = (s[1] - '0') * 10 + (s[2] - '0');
+    int y = (s[3] - '0') * 100 + (s[4] - '0') * 10 + (s[5] - '0');
+    if (x > 63 || y > 255)
+        return false;
+    code = WR_VAR(0, x, y);
+    return true;
+}
+
+/// Add routes to the literal value, adding it if needed
+template<typename T>
+void add_literal(std::vector<T>& literals, const std::string& value, uint64_t routes) {
+    for (auto& l: literals)
+        if (l.value == value) {
+            l.routes |= routes;
+            return;
+        }
+    literals.push_back(T{value, routes});
+}
+
+std::string trim(const std::string& s) {
+    std::size_t b = s.find_first_not_of(" \t\r");
+    if (b == std::string::npos)
+        return std::string();
+    std::size_t e = s.find_last_not_of(" \t\r");
+    return s.substr(b, e - b + 1);
+}
+
+}
+
+namespace mqtt2bufr {
+
+Router::Output::Output(const std::string& target, bool pipe, bool group)
+    : target(target), pipe(pipe), batch(group) {
+    fp = pipe ? popen(target.c_str(), "w") : fopen(target.c_str(), "ab");
+    if (!fp)
+        throw std::runtime_error("Cannot open " + target + ": " + strerror(errno));
+}
+
+Router::Output::~Output() {
+    flush();
+    if (pipe)
+        pclose(fp);
+    else
+        fclose(fp);
+}
+
+void Router::Output::flush() {
+    if (batch.empty())
+        return;
+    std::size_t count = batch.size();
+    std::chrono::steady_clock::time_point start, encoded;
+    if (write_time)
+        start = std::chrono::steady_clock::now();
+    const std::string& data = batch.encode();
+    if (write_time)
+        encoded = std::chrono::steady_clock::now();
+    if (fwrite(data.data(), 1, data.size(), fp) != data.size() || fflush(fp) != 0)
+        std::cerr << "Error while writing to " << target << ": " << strerror(errno) << std::endl;
+    if (write_time) {
+        encode_time->add(encoded - start);
+        write_time->add_since(encoded);
+        written->add(count);
+    }
+}
+
+Router::Router(const std::string& pathname, bool group) {
+    std::ifstream in(pathname.c_str());
+    if (!in)
+        throw std::runtime_error("Cannot open file " + pathname);
+
+    std::vector<std::pair<std::pair<wreport::Varcode, wreport::Varcode>, Routes>> var_ranges;
+    std::string line;
+    unsigned lineno = 0;
+    while (std::getline(in, line)) {
+        ++lineno;
+        auto fail = [&](const std::string& msg) {
+            std::stringstream ss;
+            ss << pathname << ":" << lineno << ": " << msg;
+            throw std::runtime_error(ss.str());
+        };
+
+        line = trim(line);
+        if (line.empty() || line[0] == '#')
+            continue;
+        std::size_t sep = line.find_first_of(">|");
+        if (sep == std::string::npos)
+            fail("missing output (> FILE or | COMMAND)");
+        const bool pipe = line[sep] == '|';
+        const std::string target = trim(line.substr(sep + 1));
+        if (target.empty())
+            fail("missing output (> FILE or | COMMAND)");
+        if (rule_output.size() == MAX_ROUTES)
+            fail("too many rules");
+        const Routes rule = Routes(1) << rule_output.size();
+
+        bool has_rep = false, has_ident = false, has_pind = false, has_var = false;
+        std::istringstream conditions(line.substr(0, sep));
+        std::string condition;
+        while (conditions >> condition) {
+            std::size_t eq = condition.find('=');
+            if (eq == std::string::npos || eq + 1 == condition.size())
+                fail("invalid condition " + condition);
+            const std::string key = condition.substr(0, eq);
+            std::istringstream values(condition.substr(eq + 1));
+            std::string value;
+            while (std::getline(values, value, ',')) {
+                if (key == "rep") {
+                    add_literal(reps, value, rule);
+                    has_rep = true;
+                } else if (key == "ident") {
+                    if (value.find_first_of("*?[") != std::string::npos)
+                        add_literal(ident_globs, value, rule);
+                    else
+                        add_literal(idents, value, rule);
+                    has_ident = true;
+                } else if (key == "pind") {
+                    int pind = dballe::MISSING_INT;
+                    if (value != "-") {
+                        char* end;
+                        long v = strtol(value.c_str(), &end, 10);
+                        if (value.empty() || *end || v < 0 || v > 255)
+                            fail("invalid time range indicator " + value);
+                        pind = v;
+                    }
+                    pinds[pind] |= rule;
+                    has_pind = true;
+                } else if (key == "var") {
+                    std::size_t dash = value.find('-');
+                    wreport::Varcode first, last;
+                    if (!parse_varcode(value.substr(0, dash), first) ||
+                        !parse_varcode(dash == std::string::npos ? value.substr(0, dash) : value.substr(dash + 1), last) ||
+                        last < first)
+                        fail("invalid variable " + value);
+                    var_ranges.push_back(std::make_pair(std::make_pair(first, last), rule));
+                    has_var = true;
+                } else {
+                    fail("unknown condition " + key);
+                }
+            }
+        }
+        if (!has_rep) any_rep |= rule;
+        if (!has_ident) any_ident |= rule;
+        if (!has_pind) any_pind |= rule;
+        if (!has_var) any_var |= rule;
+
+        // Rules with the same output share it
+        std::size_t output = 0;
+        while (output < outputs.size() &&
+               (outputs[output]->target != target || outputs[output]->pipe != pipe))
+            ++output;
+        if (output == outputs.size())
+            outputs.emplace_back(new Output(target, pipe, group));
+        rule_output.push_back(output);
+    }
+
+    compile_vars(var_ranges);
+}
+
+void Router::compile_vars(const std::vector<std::pair<std::pair<wreport::Varcode, wreport::Varcode>, Routes>>& ranges) {
+    // Split the varcodes at every range boundary, so that all the codes of a
+    // segment match the same rules
+    std::vector<wreport::Varcode> bounds;
+    bounds.push_back(0);
+    for (const auto& r: ranges) {
+        bounds.push_back(r.first.first);
+        bounds.push_back(r.first.second + 1);
+    }
+    std::sort(bounds.begin(), bounds.end());
+    bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+
+    vars.clear();
+    for (wreport::Varcode b: bounds) {
+        Routes routes = 0;
+        for (const auto& r: ranges)
+            if (r.first.first <= b && b <= r.first.second)
+                routes |= r.second;
+        if (vars.empty() || vars.back().routes != routes)
+            vars.push_back(VarRange{b, routes});
+    }
+}
+
+Router::Routes Router::match(const Topic& topic) const {
+    Routes res = any_rep;
+    for (const auto& l: reps)
+        if (topic.rep_memo == l.value.c_str()) {
+            res |= l.routes;
+            break;
+        }
+
+    Routes ident = any_ident;
+    for (const auto& l: idents)
+        if (topic.ident == l.value.c_str()) {
+            ident |= l.routes;
+            break;
+        }
+    if (!ident_globs.empty()) {
+        const std::string s = topic.ident.str();
+        for (const auto& l: ident_globs)
+            if (fnmatch(l.value.c_str(), s.c_str(), 0) == 0)
+                ident |= l.routes;
+    }
+    res &= ident;
+
+    Routes pind = any_pind;
+    auto i = pinds.find(topic.trange.pind);
+    if (i != pinds.end())
+        pind |= i->second;
+    res &= pind;
+
+    Routes var = any_var;
+    auto v = std::upper_bound(vars.begin(), vars.end(), topic.var,
+                              [](wreport::Varcode code, const VarRange& r) { return code < r.first; });
+    if (v != vars.begin())
+        var |= std::prev(v)->routes;
+    return res & var;
+}
+
+void Router::add(dballe::Msg&& msg, Routes routes, std::size_t batch_size) {
+    // Outputs of the rules, each one once
+    uint64_t selected = 0;
+    for (unsigned i = 0; routes; ++i, routes >>= 1)
+        if (routes & 1)
+            selected |= uint64_t(1) << rule_output[i];
+    for (std::size_t i = 0; selected; ++i, selected >>= 1) {
+        if (!(selected & 1))
+            continue;
+        Output& out = *outputs[i];
+        // Copy the message for all the outputs but the last one
+        if (selected == 1)
+            out.batch.add(std::move(msg));
+        else
+            out.batch.add(dballe::Msg(msg));
+        if (out.batch.size() >= batch_size)
+            out.flush();
+    }
+}
+
+void Router::set_stats(Stats& stats) {
+    for (auto& out: outputs) {
+        out->written = &stats.counter("written");
+        out->encode_time = &stats.histogram("encode");
+        out->write_time = &stats.histogram("write");
+    }
+}
+
+void Router::flush_expired(std::chrono::milliseconds interval) {
+    for (auto& out: outputs)
+        if (!out->batch.empty() && out->batch.age() >= interval)
+            out->flush();
+}
+
+void Router::flush() {
+    for (auto& out: outputs)
+        out->flush();
+}
+
+}
@@ -0,0 +1,155 @@
+/*
+ * router - Route messages to outputs according to rules on their topic
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+#ifndef MQTT2BUFR_ROUTER_H
+#define MQTT2BUFR_ROUTER_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <dballe/msg/msg.h>
+
+#include "batch.h"
+#include "stats.h"
+#include "topic.h"
+
+namespace mqtt2bufr {
+
+/**
+ * Write each message to the outputs of the routing rules matching its topic.
+ *
+ * Rules are read from a file, one per line:
+ *
+ *     CONDITION... > FILE
+ *     CONDITION... | COMMAND
+ *
+ * The messages matching all the conditions are appended to FILE, or written
+ * to the standard input of COMMAND. A rule without conditions matches every
+ * message; a message matching no rule is dropped, a message matching several
+ * rules is written to each of their outputs (once per output). Conditions
+ * are `KEY=VALUE[,VALUE...]`, matching any of the values:
+ *
+ * - `rep=NAME`: report (rep_memo)
+ * - `ident=GLOB`: station ident, `-` for fixed stations
+ * - `pind=N`: time range indicator, `-` for station information
+ * - `var=BXXYYY` or `var=BXXYYY-BXXYYY`: variable, or range of variables
+ *
+ * Empty lines and lines starting with `#` are ignored.
+ *
+ * The rules are compiled in per-field lookup tables, each giving the set of
+ * rules matching the field as a bitmask: the rules matching a topic are the
+ * intersection of the sets of its fields.
+ */
+class Router {
+ public:
+  /// Set of rules: bit i is set for rule i
+  typedef uint64_t Routes;
+  static const unsigned MAX_ROUTES = 64;
+
+ protected:
+  struct Output {
+      std::string target;
+      FILE* fp = nullptr;
+      bool pipe = false;
+      Batch batch;
+      /// Statistics, if enabled
+      Counter* written = nullptr;
+      Histogram* encode_time = nullptr;
+      Histogram* write_time = nullptr;
+
+      Output(const std::string& target, bool pipe, bool group);
+      ~Output();
+      void flush();
+  };
+
+  struct Literal {
+      std::string value;
+      Routes routes;
+  };
+
+  struct VarRange {
+      /// First varcode of the range, up to the first of the next range
+      wreport::Varcode first;
+      Routes routes;
+  };
+
+  std::vector<std::unique_ptr<Output>> outputs;
+  /// Output of each rule
+  std::vector<std::size_t> rule_output;
+
+  /// Rules without conditions on each field
+  Routes any_rep = 0;
+  Routes any_ident = 0;
+  Routes any_pind = 0;
+  Routes any_var = 0;
+  std::vector<Literal> reps;
+  std::vector<Literal> idents;
+  std::vector<Literal> ident_globs;
+  std::unordered_map<int, Routes> pinds;
+  /// Partition of the varcodes, sorted
+  std::vector<VarRange> vars;
+
+  void compile_vars(const std::vector<std::pair<std::pair<wreport::Varcode, wreport::Varcode>, Routes>>& ranges);
+
+ public:
+  /**
+   * Read the rules and open the outputs.
+   *
+   * @throw std::runtime_error if the rules are not valid, or an output
+   *        cannot be opened
+   */
+  Router(const std::string& pathname, bool group=false);
+
+  /// Write compressed bulletins to all the outputs (see Batch::set_compression)
+  void set_compression(bool verify=false) {
+      for (auto& o: outputs)
+          o->batch.set_compression(verify);
+  }
+
+  /**
+   * Record the messages written (`written`) and the time spent encoding
+   * (`encode`) and writing (`write`) each batch in stats.
+   */
+  void set_stats(Stats& stats);
+
+  /// Rules matching the topic
+  Routes match(const Topic& topic) const;
+
+  /**
+   * Add the message to the batches of the outputs of the rules, flushing
+   * the batches that reach batch_size messages.
+   */
+  void add(dballe::Msg&& msg, Routes routes, std::size_t batch_size);
+  /// Flush the batches older than interval
+  void flush_expired(std::chrono::milliseconds interval);
+  /// Flush all the batches
+  void flush();
+};
+
+}
+
+#endif
@@ -0,0 +1,483 @@
+/*
+ * spool - Disk-backed spool between encoding and output
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+
+#include "spool.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+// Size of the record header: big endian record length
+#define RECORD_HEADER 4
+
+namespace {
+
+void throw_errno(const std::string& msg) {
+    throw std::runtime_error(msg + ": " + strerror(errno));
+}
+
+void write_all(int fd, const char* data, std::size_t size, const std::string& path) {
+    while (size > 0) {
+        ssize_t n = ::write(fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            throw_errno("cannot write to " + path);
+        }
+        data += n;
+        size -= n;
+    }
+}
+
+bool read_all(int fd, char* data, std::size_t size, off_t offset) {
+    while (size > 0) {
+        ssize_t n = pread(fd, data, size, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        size -= n;
+        offset += n;
+    }
+    return true;
+}
+
+uint32_t decode_header(const char* p) {
+    const unsigned char* h = (const unsigned char*)p;
+    return (uint32_t)h[0] << 24 | (uint32_t)h[1] << 16 | (uint32_t)h[2] << 8 | h[3];
+}
+
+}
+
+namespace mqtt2bufr {
+
+Spool::Spool(const std::string& dir, const std::string& output,
+             std::size_t segment_size, std::chrono::milliseconds sync_interval,
+             std::size_t max_size)
+    : dir(dir), segment_size(segment_size), sync_interval(sync_interval),
+      max_size(max_size), output(output) {
+    if (mkdir(dir.c_str(), 0777) != 0 && errno != EEXIST)
+        throw_errno("cannot create " + dir);
+    recover();
+    drainer = std::thread(&Spool::drain, this);
+}
+
+Spool::~Spool() {
+    close();
+}
+
+std::string Spool::segment_path(uint64_t segment) const {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "/%020llu.spool", (unsigned long long)segment);
+    return dir + buf;
+}
+
+void Spool::open_segment(uint64_t segment) {
+    std::string path = segment_path(segment);
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0666);
+    if (fd == -1)
+        throw_errno("cannot open " + path);
+    written = Position{segment, 0};
+    synced = written;
+}
+
+void Spool::recover() {
+    std::vector<uint64_t> segments;
+    DIR* d = opendir(dir.c_str());
+    if (!d)
+        throw_errno("cannot open " + dir);
+    while (struct dirent* e = readdir(d)) {
+        char* end;
+        unsigned long long n = strtoull(e->d_name, &end, 10);
+        if (end != e->d_name && strcmp(end, ".spool") == 0)
+            segments.push_back(n);
+    }
+    closedir(d);
+    std::sort(segments.begin(), segments.end());
+
+    read = Position{segments.empty() ? 1 : segments.front(), 0};
+    if (FILE* f = fopen((dir + "/offset").c_str(), "r")) {
+        unsigned long long segment, offset;
+        if (fscanf(f, "%llu %llu", &segment, &offset) == 2)
+            read = Position{segment, offset};
+        fclose(f);
+    }
+
+    // Segments already drained
+    while (!segments.empty() && segments.front() < read.segment) {
+        unlink(segment_path(segments.front()).c_str());
+        segments.erase(segments.begin());
+    }
+    if (segments.empty() || segments.front() != read.segment)
+        read = Position{segments.empty() ? read.segment : segments.front(), 0};
+
+    for (uint64_t segment: segments) {
+        std::string path = segment_path(segment);
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0)
+            throw_errno("cannot access " + path);
+        uint64_t size = st.st_size;
+        if (segment == segments.back()) {
+            // A crash while writing leaves a partial record at the end of
+            // the last segment: drop it
+            int rfd = ::open(path.c_str(), O_RDWR);
+            if (rfd == -1)
+                throw_errno("cannot open " + path);
+            uint64_t valid = 0;
+            char header[RECORD_HEADER];
+            while (valid + RECORD_HEADER <= size &&
+                   read_all(rfd, header, RECORD_HEADER, valid) &&
+                   valid + RECORD_HEADER + decode_header(header) <= size)
+                valid += RECORD_HEADER + decode_header(header);
+            if (valid != size) {
+                std::cerr << path << ": dropping " << (size - valid)
+                          << " bytes of incomplete record" << std::endl;
+                if (ftruncate(rfd, valid) != 0)
+                    throw_errno("cannot truncate " + path);
+                size = valid;
+            }
+            ::close(rfd);
+        }
+        if (segment == read.segment) {
+            if (read.offset > size)
+                read.offset = size;
+            size -= read.offset;
+        }
+        pending += size;
+    }
+
+    open_segment(segments.empty() ? std::max<uint64_t>(read.segment, 1) : segments.back() + 1);
+    if (segments.empty())
+        read = written;
+}
+
+void Spool::save_offset() {
+    std::string path = dir + "/offset";
+    std::string tmp = path + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "w");
+    if (!f) {
+        std::cerr << "cannot write " << tmp << ": " << strerror(errno) << std::endl;
+        return;
+    }
+    fprintf(f, "%llu %llu\n", (unsigned long long)read.segment,
+            (unsigned long long)read.offset);
+    // The new offset must be on disk before it replaces the old one, and the
+    // rename before the drained segments are deleted
+    bool ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+    if (fclose(f) != 0 || !ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        std::cerr << "cannot write " << path << ": " << strerror(errno) << std::endl;
+        return;
+    }
+    int dir_fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dir_fd == -1 || fsync(dir_fd) != 0)
+        std::cerr << "cannot sync " << dir << ": " << strerror(errno) << std::endl;
+    if (dir_fd != -1)
+        ::close(dir_fd);
+}
+
+void Spool::sync_locked(std::unique_lock<std::mutex>& lock) {
+    synced_cond.wait(lock, [&] { return !syncing; });
+    if (!dirty)
+        return;
+    // Sync without the mutex: append() keeps writing meanwhile, and does not
+    // close the segment while syncing is set
+    int sync_fd = fd;
+    Position end = written;
+    syncing = true;
+    dirty = false;
+    lock.unlock();
+    if (fdatasync(sync_fd) != 0)
+        std::cerr << "cannot sync " << segment_path(end.segment) << ": "
+                  << strerror(errno) << std::endl;
+    lock.lock();
+    synced = end;
+    syncing = false;
+    synced_cond.notify_all();
+}
+
+void Spool::wait_syncing(std::unique_lock<std::mutex>& lock,
+                         std::chrono::steady_clock::time_point deadline) {
+    auto now = std::chrono::steady_clock::now();
+    while (!closing && now < deadline) {
+        auto until = deadline;
+        if (dirty && sync_interval.count() > 0) {
+            auto due = dirty_since + sync_interval;
+            if (due <= now) {
+                sync_locked(lock);
+                now = std::chrono::steady_clock::now();
+                continue;
+            }
+            until = std::min(until, due);
+        }
+        synced_cond.wait_until(lock, until);
+        now = std::chrono::steady_clock::now();
+    }
+}
+
+void Spool::append(const char* data, std::size_t size) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (max_size > 0)
+        drained_cond.wait(lock, [&] { return pending <= max_size || closing; });
+
+    while (written.offset > 0 && written.offset + RECORD_HEADER + size > segment_size) {
+        // Sync the whole segment before closing it
+        if (dirty || syncing) {
+            sync_locked(lock);
+            continue;
+        }
+        ::close(fd);
+        open_segment(written.segment + 1);
+    }
+
+    char header[RECORD_HEADER] = {
+        (char)(size >> 24), (char)(size >> 16), (char)(size >> 8), (char)size,
+    };
+    std::string path = segment_path(written.segment);
+    try {
+        write_all(fd, header, RECORD_HEADER, path);
+        write_all(fd, data, size, path);
+    } catch (...) {
+        // Do not leave a torn record in front of the next ones
+        if (ftruncate(fd, written.offset) != 0)
+            std::cerr << "cannot truncate " << path << ": " << strerror(errno) << std::endl;
+        throw;
+    }
+    written.offset += RECORD_HEADER + size;
+    pending += RECORD_HEADER + size;
+
+    if (!dirty) {
+        dirty = true;
+        dirty_since = std::chrono::steady_clock::now();
+        // Wake up the drain, which syncs after the sync interval
+        synced_cond.notify_all();
+    }
+    if (sync_interval.count() == 0)
+        sync_locked(lock);
+}
+
+void Spool::open_output() {
+    if (output == "-") {
+        out_fd = STDOUT_FILENO;
+        out_socket = false;
+    } else if (output.compare(0, 4, "tcp:") == 0) {
+        std::size_t sep = output.rfind(':');
+        std::string host = output.substr(4, sep - 4);
+        std::string port = output.substr(sep + 1);
+        struct addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        struct addrinfo* res;
+        int rc = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+        if (rc != 0) {
+            std::cerr << "cannot resolve " << host << ": " << gai_strerror(rc) << std::endl;
+            return;
+        }
+        for (struct addrinfo* ai = res; ai; ai = ai->ai_next) {
+            out_fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (out_fd == -1)
+                continue;
+            if (connect(out_fd, ai->ai_addr, ai->ai_addrlen) == 0)
+                break;
+            ::close(out_fd);
+            out_fd = -1;
+        }
+        freeaddrinfo(res);
+        if (out_fd == -1)
+            std::cerr << "cannot connect to " << output.substr(4) << std::endl;
+        out_socket = true;
+    } else {
+        out_fd = ::open(output.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0666);
+        if (out_fd == -1)
+            std::cerr << "cannot open " << output << ": " << strerror(errno) << std::endl;
+        out_socket = false;
+    }
+}
+
+void Spool::close_output() {
+    if (out_fd != -1 && out_fd != STDOUT_FILENO)
+        ::close(out_fd);
+    out_fd = -1;
+}
+
+bool Spool::write_output(const char* data, std::size_t size) {
+    if (out_fd == -1)
+        open_output();
+    if (out_fd == -1)
+        return false;
+    while (size > 0) {
+        ssize_t n = out_socket ? send(out_fd, data, size, MSG_NOSIGNAL)
+                               : ::write(out_fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            std::cerr << "cannot write to " << output << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+int Spool::forward(int segment_fd, std::string& buf) {
+    char header[RECORD_HEADER];
+    if (!read_all(segment_fd, header, RECORD_HEADER, read.offset))
+        return FORWARD_BAD_RECORD;
+    // Check a corrupted length against the segment size before allocating
+    struct stat st;
+    uint32_t size = decode_header(header);
+    if (fstat(segment_fd, &st) != 0 ||
+        read.offset + RECORD_HEADER + size > (uint64_t)st.st_size)
+        return FORWARD_BAD_RECORD;
+    buf.resize(size);
+    if (!read_all(segment_fd, &buf[0], buf.size(), read.offset + RECORD_HEADER))
+        return FORWARD_BAD_RECORD;
+    if (!write_output(buf.data(), buf.size())) {
+        close_output();
+        return FORWARD_OUTPUT_ERROR;
+    }
+    read.offset += RECORD_HEADER + buf.size();
+    return FORWARD_OK;
+}
+
+void Spool::drain() {
+    std::string buf;
+    int segment_fd = -1;
+    uint64_t segment_open = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        if (!(read < synced)) {
+            if (dirty) {
+                // Group the records of the sync interval in a single sync
+                if (!closing && sync_interval.count() > 0)
+                    synced_cond.wait_until(lock, dirty_since + sync_interval);
+                sync_locked(lock);
+            } else if (closing) {
+                break;
+            } else {
+                synced_cond.wait(lock);
+            }
+            continue;
+        }
+
+        const Position end = synced;
+        lock.unlock();
+        std::size_t drained = 0;
+        bool stop = false;
+        while (read < end && !stop) {
+            if (segment_fd == -1 || segment_open != read.segment) {
+                if (segment_fd != -1)
+                    ::close(segment_fd);
+                segment_open = read.segment;
+                segment_fd = ::open(segment_path(read.segment).c_str(), O_RDONLY);
+            }
+            struct stat st;
+            if (read.segment < end.segment &&
+                (segment_fd == -1 || (fstat(segment_fd, &st) == 0 &&
+                                      read.offset >= (uint64_t)st.st_size))) {
+                // End of a segment: move to the next one
+                uint64_t done = read.segment;
+                read = Position{done + 1, 0};
+                save_offset();
+                unlink(segment_path(done).c_str());
+                continue;
+            }
+            uint64_t offset = read.offset;
+            switch (segment_fd == -1 ? FORWARD_BAD_RECORD : forward(segment_fd, buf)) {
+                case FORWARD_OK:
+                    drained += read.offset - offset;
+                    break;
+                case FORWARD_BAD_RECORD:
+                    if (read.segment == end.segment) {
+                        // The segment may still be written: skip to the end
+                        // of the synced records, which starts a record
+                        std::cerr << "cannot read " << segment_path(read.segment)
+                                  << " at " << read.offset << ", skipping to "
+                                  << end.offset << std::endl;
+                        drained += end.offset - read.offset;
+                        read = end;
+                    } else {
+                        std::cerr << "cannot read " << segment_path(read.segment)
+                                  << " at " << read.offset << ", skipping the segment" << std::endl;
+                        if (segment_fd != -1 && fstat(segment_fd, &st) == 0 &&
+                            (uint64_t)st.st_size > read.offset)
+                            drained += st.st_size - read.offset;
+                        read = Position{read.segment + 1, 0};
+                    }
+                    break;
+                case FORWARD_OUTPUT_ERROR:
+                    // Retry after a second, unless closing: the records are
+                    // forwarded on the next start. Keep syncing meanwhile, as
+                    // the records are still spooled
+                    lock.lock();
+                    wait_syncing(lock, std::chrono::steady_clock::now() + std::chrono::seconds(1));
+                    stop = closing;
+                    lock.unlock();
+                    break;
+            }
+        }
+        save_offset();
+        lock.lock();
+        pending -= std::min(pending, drained);
+        drained_cond.notify_all();
+        if (stop) {
+            // The records left are forwarded on the next start
+            sync_locked(lock);
+            break;
+        }
+    }
+    if (segment_fd != -1)
+        ::close(segment_fd);
+}
+
+void Spool::close() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closing = true;
+        synced_cond.notify_all();
+        drained_cond.notify_all();
+    }
+    if (drainer.joinable())
+        drainer.join();
+    if (fd != -1) {
+        ::close(fd);
+        fd = -1;
+    }
+    close_output();
+}
+
+}
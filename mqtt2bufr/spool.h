@@ -0,0 +1,190 @@
+/*
+ * spool - Disk-backed spool between encoding and output
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+#ifndef MQTT2BUFR_SPOOL_H
+#define MQTT2BUFR_SPOOL_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <thread>
+
+namespace mqtt2bufr {
+
+/**
+ * Append-only spool of the encoded data, in a directory of segment files
+ * forwarded to the output by a drain thread, at its own pace: a stalled
+ * consumer does not block the network loop.
+ *
+ * Each append() is a record, written to the current segment and rotated to a
+ * new segment when it exceeds the segment size. The segments are synced to
+ * disk in groups, every sync interval, and only the synced records are
+ * forwarded. The position of the drain is saved in the `offset` file of the
+ * directory, and the drained segments are deleted: after a restart, the
+ * drain resumes from the saved position. The records forwarded after the
+ * last saved position are forwarded again (at-least-once delivery).
+ *
+ * Outputs are `-` (stdout), `tcp:HOST:PORT` or a file, appended to. On
+ * errors, the drain reopens the output and retries every second.
+ */
+class Spool {
+ protected:
+  /// Position in the spool: segment number and offset
+  struct Position {
+      uint64_t segment;
+      uint64_t offset;
+
+      bool operator<(const Position& o) const {
+          return segment < o.segment || (segment == o.segment && offset < o.offset);
+      }
+  };
+
+  std::string dir;
+  std::size_t segment_size;
+  std::chrono::milliseconds sync_interval;
+  std::size_t max_size;
+
+  std::mutex mutex;
+  /// Signalled when records are synced, or the spool is closed
+  std::condition_variable synced_cond;
+  /// Signalled when records are drained
+  std::condition_variable drained_cond;
+  /// Current segment
+  int fd = -1;
+  Position written;
+  /// Everything before this position is on disk
+  Position synced;
+  bool dirty = false;
+  /// When the first record not synced was written
+  std::chrono::steady_clock::time_point dirty_since;
+  /// A sync is running, with the mutex released
+  bool syncing = false;
+  bool closing = false;
+  /// Bytes spooled and not drained yet
+  std::size_t pending = 0;
+
+  std::string output;
+  int out_fd = -1;
+  bool out_socket = false;
+  std::thread drainer;
+  /// Drain position
+  Position read;
+
+  std::string segment_path(uint64_t segment) const;
+  void open_segment(uint64_t segment);
+  /**
+   * Sync the current segment: called with the mutex held, released during
+   * the sync. Waits for a sync already running.
+   */
+  void sync_locked(std::unique_lock<std::mutex>& lock);
+  /**
+   * Wait until deadline or closing, syncing meanwhile when the sync interval
+   * expires (mutex held)
+   */
+  void wait_syncing(std::unique_lock<std::mutex>& lock,
+                    std::chrono::steady_clock::time_point deadline);
+  /// Load the drain position and truncate the torn record of a crash
+  void recover();
+  void save_offset();
+  void open_output();
+  void close_output();
+  /// Write to the output, false on errors
+  bool write_output(const char* data, std::size_t size);
+  enum {
+      FORWARD_OK,
+      FORWARD_BAD_RECORD,
+      FORWARD_OUTPUT_ERROR,
+  };
+  /// Forward the record at the drain position
+  int forward(int segment_fd, std::string& buf);
+  void drain();
+
+ public:
+  /**
+   * Open the spool in dir, creating it if needed, and start forwarding to
+   * output.
+   *
+   * @param segment_size rotate the segments larger than this
+   * @param sync_interval sync the segments at most every sync_interval (0:
+   *                      sync every record)
+   * @param max_size if not 0, block append() while more than max_size bytes
+   *                 are spooled and not drained
+   */
+  Spool(const std::string& dir, const std::string& output,
+        std::size_t segment_size, std::chrono::milliseconds sync_interval,
+        std::size_t max_size=0);
+  ~Spool();
+
+  /// Spool a record
+  void append(const char* data, std::size_t size);
+
+  /**
+   * Sync, wait for the drain to forward all the records and stop it.
+   */
+  void close();
+};
+
+/**
+ * Stream buffer spooling each flushed block as a record.
+ *
+ * If the record cannot be spooled, the flush fails and the stream is left
+ * bad: the writer has to stop, since the next records would be lost too.
+ */
+class SpoolStreambuf : public std::streambuf {
+ protected:
+  Spool& spool;
+  std::string buffer;
+
+  int_type overflow(int_type c) override {
+      if (c != traits_type::eof())
+          buffer += traits_type::to_char_type(c);
+      return traits_type::not_eof(c);
+  }
+  std::streamsize xsputn(const char* s, std::streamsize n) override {
+      buffer.append(s, n);
+      return n;
+  }
+  int sync() override {
+      if (buffer.empty())
+          return 0;
+      int res = 0;
+      try {
+          spool.append(buffer.data(), buffer.size());
+      } catch (const std::exception& e) {
+          std::cerr << e.what() << std::endl;
+          res = -1;
+      }
+      buffer.clear();
+      return res;
+  }
+
+ public:
+  SpoolStreambuf(Spool& spool) : spool(spool) {}
+};
+
+}
+
+#endif
@@ -0,0 +1,89 @@
+/*
+ * station - Station information cache
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+
+#include "station.h"
+
+namespace mqtt2bufr {
+
+bool is_station_key(wreport::Varcode code) {
+    return code == WR_VAR(0, 1, 11) || code == WR_VAR(0, 6, 1) ||
+           code == WR_VAR(0, 5, 1) || code == WR_VAR(0, 1, 194) ||
+           WR_VAR_X(code) == 4;
+}
+
+void make_station_key(const dballe::Msg& msg, std::string& key) {
+    static const wreport::Varcode codes[] = {
+        WR_VAR(0, 1, 11), WR_VAR(0, 6, 1), WR_VAR(0, 5, 1), WR_VAR(0, 1, 194),
+    };
+    key.clear();
+    const dballe::msg::Context* station = msg.find_station_context();
+    for (wreport::Varcode code: codes) {
+        const wreport::Var* var = station ? station->find(code) : nullptr;
+        if (var && var->isset())
+            key += var->enqc();
+        key += '/';
+    }
+}
+
+void StationCache::enrich(dballe::Msg& msg) {
+    const dballe::msg::Context* station = msg.find_station_context();
+    if (!station)
+        return;
+    std::lock_guard<std::mutex> lock(mutex);
+    make_station_key(msg, key);
+
+    // Station information: one context only
+    if (msg.data.size() == 1) {
+        std::vector<wreport::Var>& vars = stations[key];
+        for (const auto& var: station->data) {
+            if (is_station_key(var->code()))
+                continue;
+            bool found = false;
+            for (auto& v: vars)
+                if (v.code() == var->code()) {
+                    v = *var;
+                    found = true;
+                    break;
+                }
+            if (!found)
+                vars.push_back(*var);
+        }
+        return;
+    }
+
+    auto i = stations.find(key);
+    if (i == stations.end())
+        return;
+    const dballe::Level level;
+    const dballe::Trange trange;
+    for (const auto& var: i->second)
+        if (!station->find(var.code()))
+            msg.set(var, var.code(), level, trange);
+}
+
+std::size_t StationCache::size() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stations.size();
+}
+
+}
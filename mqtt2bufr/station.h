@@ -0,0 +1,72 @@
+/*
+ * station - Station information cache
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+#ifndef MQTT2BUFR_STATION_H
+#define MQTT2BUFR_STATION_H
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <dballe/msg/msg.h>
+
+namespace mqtt2bufr {
+
+/**
+ * True if the variable is part of the station key (see make_station_key), or
+ * is the datetime, stored in the station context.
+ */
+bool is_station_key(wreport::Varcode code);
+
+/**
+ * Set key to the identity of the station of the message: ident, coordinates
+ * and report.
+ */
+void make_station_key(const dballe::Msg& msg, std::string& key);
+
+/**
+ * Station information (name, height, etc.) received in station context
+ * messages, added to the data messages of the same station.
+ *
+ * Stations are identified by ident, coordinates and report. The cache can be
+ * shared between threads.
+ */
+class StationCache {
+ protected:
+  std::mutex mutex;
+  std::unordered_map<std::string, std::vector<wreport::Var>> stations;
+  std::string key;
+
+ public:
+  /**
+   * If msg only contains station information, store it; otherwise, add the
+   * stored information of its station to its station context.
+   */
+  void enrich(dballe::Msg& msg);
+  /// Number of stations in the cache
+  std::size_t size();
+};
+
+}
+
+#endif
@@ -0,0 +1,208 @@
+/*
+ * stats - Counters and latency histograms
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+
+#include "stats.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace mqtt2bufr {
+
+Histogram::Histogram() : total_us(0) {
+    for (auto& b: buckets)
+        b.store(0, std::memory_order_relaxed);
+}
+
+void Histogram::to_json(std::string& out) const {
+    uint64_t counts[BUCKETS];
+    uint64_t count = 0;
+    for (unsigned i = 0; i < BUCKETS; ++i)
+        count += counts[i] = buckets[i].load(std::memory_order_relaxed);
+    char buf[64];
+    snprintf(buf, sizeof(buf), "{\"count\": %llu, \"mean\": %llu",
+             (unsigned long long)count,
+             (unsigned long long)(count ? total_us.load(std::memory_order_relaxed) / count : 0));
+    out += buf;
+    static const struct { const char* name; double q; } quantiles[] = {
+        { "p50", 0.5 }, { "p90", 0.9 }, { "p99", 0.99 },
+    };
+    for (const auto& q: quantiles) {
+        // Upper bound of the bucket of the quantile
+        uint64_t rank = count * q.q, seen = 0, bound = 0;
+        for (unsigned i = 0; i < BUCKETS && count; ++i) {
+            seen += counts[i];
+            if (seen > rank) {
+                bound = i == 0 ? 1 : uint64_t(1) << i;
+                break;
+            }
+        }
+        snprintf(buf, sizeof(buf), ", \"%s\": %llu", q.name, (unsigned long long)bound);
+        out += buf;
+    }
+    out += '}';
+}
+
+Counter& Stats::counter(const std::string& name) {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::unique_ptr<Counter>& c = counters[name];
+    if (!c)
+        c.reset(new Counter);
+    return *c;
+}
+
+Histogram& Stats::histogram(const std::string& name) {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::unique_ptr<Histogram>& h = histograms[name];
+    if (!h)
+        h.reset(new Histogram);
+    return *h;
+}
+
+std::string Stats::to_json() {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::string out = "{\"time\": ";
+    out += std::to_string((long long)time(nullptr));
+    out += ", \"counters\": {";
+    bool first = true;
+    for (const auto& c: counters) {
+        if (!first)
+            out += ", ";
+        first = false;
+        out += '"' + c.first + "\": " + std::to_string((unsigned long long)c.second->get());
+    }
+    out += "}, \"latency_us\": {";
+    first = true;
+    for (const auto& h: histograms) {
+        if (!first)
+            out += ", ";
+        first = false;
+        out += '"' + h.first + "\": ";
+        h.second->to_json(out);
+    }
+    out += "}}";
+    return out;
+}
+
+void Stats::foreach(std::function<void(const std::string&, const std::string&)> fn) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto& c: counters)
+        fn("counters/" + c.first, std::to_string((unsigned long long)c.second->get()));
+    std::string value;
+    for (const auto& h: histograms) {
+        value.clear();
+        h.second->to_json(value);
+        fn("latency_us/" + h.first, value);
+    }
+}
+
+StatsTicker::StatsTicker(std::chrono::seconds interval, std::function<void()> fn) {
+    thread = std::thread([this, interval, fn]() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stop_cond.wait_for(lock, interval, [this] { return stopping; })) {
+            lock.unlock();
+            fn();
+            lock.lock();
+        }
+    });
+}
+
+StatsTicker::~StatsTicker() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    stop_cond.notify_all();
+    thread.join();
+}
+
+StatsServer::StatsServer(Stats& stats, const std::string& path)
+    : stats(stats), path(path) {
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+        throw std::runtime_error("socket path too long: " + path);
+    strcpy(addr.sun_path, path.c_str());
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+        throw std::runtime_error(std::string("cannot create socket: ") + strerror(errno));
+    // Left behind by a previous run
+    unlink(path.c_str());
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 8) != 0 ||
+        pipe(stop_pipe) != 0) {
+        std::string msg = std::string("cannot listen on ") + path + ": " + strerror(errno);
+        ::close(fd);
+        throw std::runtime_error(msg);
+    }
+    thread = std::thread(&StatsServer::serve, this);
+}
+
+StatsServer::~StatsServer() {
+    if (write(stop_pipe[1], "", 1) < 0)
+        perror("cannot stop the stats server");
+    thread.join();
+    ::close(stop_pipe[0]);
+    ::close(stop_pipe[1]);
+    ::close(fd);
+    unlink(path.c_str());
+}
+
+void StatsServer::serve() {
+    struct pollfd fds[2] = {
+        { fd, POLLIN, 0 },
+        { stop_pipe[0], POLLIN, 0 },
+    };
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (fds[1].revents)
+            break;
+        int client = accept(fd, NULL, NULL);
+        if (client == -1)
+            continue;
+        std::string line = stats.to_json() + "\n";
+        const char* p = line.data();
+        std::size_t size = line.size();
+        while (size > 0) {
+            ssize_t n = send(client, p, size, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            p += n;
+            size -= n;
+        }
+        ::close(client);
+    }
+}
+
+}
@@ -0,0 +1,155 @@
+/*
+ * stats - Counters and latency histograms
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+#ifndef MQTT2BUFR_STATS_H
+#define MQTT2BUFR_STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace mqtt2bufr {
+
+/// Event counter, updated without locks
+class Counter {
+ protected:
+  std::atomic<uint64_t> value;
+
+ public:
+  Counter() : value(0) {}
+  void add(uint64_t n=1) { value.fetch_add(n, std::memory_order_relaxed); }
+  uint64_t get() const { return value.load(std::memory_order_relaxed); }
+};
+
+/**
+ * Latency histogram, updated without locks.
+ *
+ * Bucket i counts the latencies from 2^(i-1) (included) to 2^i (excluded)
+ * microseconds: quantiles are approximated by the upper bound of their
+ * bucket, i.e. within a factor of 2.
+ */
+class Histogram {
+ public:
+  static const unsigned BUCKETS = 40;
+
+ protected:
+  std::atomic<uint64_t> buckets[BUCKETS];
+  std::atomic<uint64_t> total_us;
+
+ public:
+  Histogram();
+
+  void add(std::chrono::steady_clock::duration d) {
+      uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+      unsigned bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+      if (bucket >= BUCKETS)
+          bucket = BUCKETS - 1;
+      buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+      total_us.fetch_add(us, std::memory_order_relaxed);
+  }
+
+  /// Add the time elapsed since start
+  void add_since(std::chrono::steady_clock::time_point start) {
+      add(std::chrono::steady_clock::now() - start);
+  }
+
+  /// Format count, mean and quantiles (in microseconds) as a JSON object
+  void to_json(std::string& out) const;
+};
+
+/**
+ * Named counters and latency histograms of a program.
+ *
+ * Counters and histograms are created once, before use: updating them does
+ * not take locks nor allocate.
+ */
+class Stats {
+ protected:
+  std::mutex mutex;
+  std::map<std::string, std::unique_ptr<Counter>> counters;
+  std::map<std::string, std::unique_ptr<Histogram>> histograms;
+
+ public:
+  /// Counter called name, created if needed
+  Counter& counter(const std::string& name);
+  /// Histogram called name, created if needed
+  Histogram& histogram(const std::string& name);
+
+  /**
+   * Format the statistics as a JSON object on a single line:
+   * `{"counters": {NAME: N...}, "latency_us": {NAME: {...}...}}`
+   */
+  std::string to_json();
+
+  /**
+   * Call fn with the relative topic (`counters/NAME` or `latency_us/NAME`)
+   * and the value of each statistic, to publish them as MQTT messages.
+   */
+  void foreach(std::function<void(const std::string&, const std::string&)> fn);
+};
+
+/**
+ * Call a function every interval from a separate thread, until destroyed.
+ */
+class StatsTicker {
+ protected:
+  std::mutex mutex;
+  std::condition_variable stop_cond;
+  bool stopping = false;
+  std::thread thread;
+
+ public:
+  StatsTicker(std::chrono::seconds interval, std::function<void()> fn);
+  ~StatsTicker();
+};
+
+/**
+ * Answer each connection to a Unix socket with the statistics as a JSON
+ * line, from a separate thread, until destroyed.
+ */
+class StatsServer {
+ protected:
+  Stats& stats;
+  std::string path;
+  int fd = -1;
+  /// Written to stop the thread
+  int stop_pipe[2] = { -1, -1 };
+  std::thread thread;
+
+  void serve();
+
+ public:
+  /// @throw std::runtime_error if the socket cannot be created
+  StatsServer(Stats& stats, const std::string& path);
+  ~StatsServer();
+};
+
+}
+
+#endif
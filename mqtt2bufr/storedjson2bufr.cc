@@ -27,35 +27,198 @@
 #include <iostream>
 #include <stdexcept>
 #include <vector>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 #include <getopt.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <dballe/msg/msg.h>
 #include <dballe/msg/wr_codec.h>
-#include <dballe/core/record.h>
 
 #include "parser.h"
+#include "batch.h"
 
+// Size of the records written by the station firmware: done flag, topic,
+// ';', payload
+#define RECORD_SIZE 128
+// Number of consecutive records converted by a worker in one go
+#define CHUNK_RECORDS 1024
 
-struct FpRAII {
-    FILE* fp = nullptr;
-    bool close_on_exit = false;
+// Long options without a short equivalent
+enum {
+    OPT_THREADS = 256,
+};
+
+/**
+ * Read-only view of a whole file: regular files are mapped in memory, other
+ * files (e.g. standard input) are read in a buffer.
+ */
+struct MappedFile {
+    const char* data = nullptr;
+    std::size_t size = 0;
+    void* map = MAP_FAILED;
+    std::vector<char> buffer;
 
-    FpRAII(const std::string& name) {
-        if (name == "-") {
-            fp = stdin;
-            close_on_exit = false;
-        } else {
-            fp = fopen(name.c_str(), "r");
-            close_on_exit = true;
-            if (fp == nullptr)
-                throw std::runtime_error("Cannot open file " + name);
+    MappedFile(const std::string& name) {
+        int fd = name == "-" ? 0 : open(name.c_str(), O_RDONLY);
+        if (fd == -1)
+            throw std::runtime_error("Cannot open file " + name);
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                madvise(map, st.st_size, MADV_SEQUENTIAL);
+                data = (const char*)map;
+                size = st.st_size;
+            }
+        }
+        if (map == MAP_FAILED) {
+            char buf[65536];
+            ssize_t n;
+            while ((n = read(fd, buf, sizeof(buf))) > 0)
+                buffer.insert(buffer.end(), buf, buf + n);
+            data = buffer.data();
+            size = buffer.size();
         }
+        if (fd != 0)
+            close(fd);
     }
-    ~FpRAII() {
-        if (close_on_exit)
-            fclose(fp);
+    ~MappedFile() {
+        if (map != MAP_FAILED)
+            munmap(map, size);
+    }
+};
+
+struct Stats {
+    unsigned long read = 0;
+    unsigned long sent = 0;
+    unsigned long failed = 0;
+
+    Stats& operator+=(const Stats& o) {
+        read += o.read;
+        sent += o.sent;
+        failed += o.failed;
+        return *this;
+    }
+};
+
+/**
+ * Convert the records of a file on a pool of threads.
+ *
+ * The records are split in chunks of consecutive records, taken in turn by
+ * the workers; the output of each chunk is written in record order. When
+ * compressing, the records of a chunk with the same data template share a
+ * bulletin.
+ */
+struct Converter {
+    struct Chunk {
+        /// Encoded BUFR messages
+        std::string data;
+        /// Error messages
+        std::string errors;
+        Stats stats;
+        bool done = false;
+    };
+
+    const std::string& name;
+    const char* records;
+    std::size_t count;
+    bool exclude_sent;
+    /// Encode the messages of a chunk in compressed bulletins
+    bool compress = false;
+    bool verify = false;
+    std::vector<Chunk> chunks;
+    std::atomic<std::size_t> next_chunk;
+    std::mutex mutex;
+    std::condition_variable chunk_done;
+
+    Converter(const std::string& name, const MappedFile& file, bool exclude_sent)
+        : name(name), records(file.data), count(file.size / RECORD_SIZE),
+          exclude_sent(exclude_sent),
+          chunks((count + CHUNK_RECORDS - 1) / CHUNK_RECORDS), next_chunk(0) {}
+
+    /// Worker thread body
+    void work() {
+        mqtt2bufr::Parser parser;
+        dballe::msg::BufrExporter exporter;
+        dballe::Messages msgs;
+        mqtt2bufr::Batch batch;
+        if (compress)
+            batch.set_compression(verify);
+        Chunk chunk;
+        std::size_t i;
+        while ((i = next_chunk++) < chunks.size()) {
+            const char* begin = records + i * CHUNK_RECORDS * RECORD_SIZE;
+            const char* end = records + std::min(count, (i + 1) * CHUNK_RECORDS) * RECORD_SIZE;
+            for (const char* buf = begin; buf != end; buf += RECORD_SIZE) {
+                ++chunk.stats.read;
+                bool already_sent = buf[0];
+                if (exclude_sent and already_sent) {
+                    ++chunk.stats.sent;
+                    continue;
+                }
+                const char *sep = (const char*)memchr(buf + 1, ';', RECORD_SIZE - 1);
+                try {
+                    if (!sep)
+                        throw std::runtime_error("topic and payload separator not found");
+                    // The topic ends one character before the separator
+                    dballe::Msg msg = parser.parse(buf + 1, std::max(sep - 1 - (buf + 1), (std::ptrdiff_t)0),
+                                                   sep + 1, buf + RECORD_SIZE - (sep + 1));
+                    if (compress) {
+                        batch.add(std::move(msg));
+                    } else {
+                        msgs.clear();
+                        msgs.append(msg);
+                        chunk.data += exporter.to_binary(msgs);
+                    }
+                } catch (const std::exception& e) {
+                    ++chunk.stats.failed;
+                    std::string topic(buf + 1, sep ? std::max(sep - 1, buf + 1) : buf + RECORD_SIZE);
+                    std::string payload(sep ? sep + 1 : buf + RECORD_SIZE, buf + RECORD_SIZE);
+                    chunk.errors += "Error while parsing " + name +
+                        "[" + topic + " " + payload + "]" +
+                        ": " + e.what() + "\n";
+                }
+            }
+            if (compress)
+                chunk.data += batch.encode();
+            std::lock_guard<std::mutex> lock(mutex);
+            chunk.done = true;
+            chunks[i] = std::move(chunk);
+            chunk = Chunk();
+            chunk_done.notify_all();
+        }
+    }
+
+    /**
+     * Convert the records with nthreads workers, writing the output in
+     * record order.
+     */
+    void run(unsigned nthreads, std::ostream& out, std::ostream& err, Stats& stats) {
+        std::vector<std::thread> workers;
+        for (unsigned i = 0; i < nthreads; ++i)
+            workers.emplace_back(&Converter::work, this);
+        for (auto& chunk: chunks) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                chunk_done.wait(lock, [&chunk] { return chunk.done; });
+            }
+            out.write(chunk.data.data(), chunk.data.size());
+            err << chunk.errors;
+            stats += chunk.stats;
+            // Release the memory of the chunk as soon as it is written
+            chunk = Chunk();
+        }
+        for (auto& t: workers)
+            t.join();
+        out.flush();
     }
 };
 
@@ -68,6 +231,12 @@ void print_help(std::ostream& out)
         << " --help             show this help and exit" << std::endl
         << " --version          show version and exit" << std::endl
         << " --exclude-sent     exclude records already sent" << std::endl
+        << " --threads N        convert the records with N threads (default: number of CPUs)" << std::endl
+        << " --compress         encode the records with the same variables, levels and time" << std::endl
+        << "                    ranges in compressed multi-subset bulletins" << std::endl
+        << " --verify           with --compress, decode each bulletin and write its records" << std::endl
+        << "                    uncompressed if they do not match" << std::endl
+        << " --stats            print the number of records read, skipped and failed on stderr" << std::endl
         << std::endl
         << "Report bugs to: " << PACKAGE_BUGREPORT << std::endl;
         ;
@@ -83,6 +252,10 @@ int main(int argc, char** argv)
     static int show_help = 0;
     static int show_version = 0;
     static int exclude_sent = 0;
+    static int show_stats = 0;
+    static int compress = 0;
+    static int verify = 0;
+    long threads = std::thread::hardware_concurrency();
     std::vector<std::string> files;
 
     while (1) {
@@ -92,6 +265,10 @@ int main(int argc, char** argv)
             { "help", no_argument, &show_help, 1 },
             { "version", no_argument, &show_version, 1 },
             { "exclude-sent", no_argument, &exclude_sent, 1},
+            { "threads", required_argument, 0, OPT_THREADS },
+            { "stats", no_argument, &show_stats, 1 },
+            { "compress", no_argument, &compress, 1 },
+            { "verify", no_argument, &verify, 1 },
             { 0, 0, 0, 0 }
         };
 
@@ -110,6 +287,13 @@ int main(int argc, char** argv)
                   return 0;
                 }
                 break;
+            case OPT_THREADS:
+                threads = atol(optarg);
+                if (threads < 1) {
+                    std::cerr << "Invalid number of threads " << optarg << std::endl;
+                    return 1;
+                }
+                break;
             default:
                 print_help(std::cerr);
                 return 1;
@@ -122,36 +306,27 @@ int main(int argc, char** argv)
     if (files.empty())
         files.push_back("-");
 
-    int return_value = 0;
+    if (threads < 1)
+        threads = 1;
+
+    if (verify && !compress) {
+        std::cerr << "--verify requires --compress" << std::endl;
+        return 1;
+    }
+
+    Stats stats;
     for (auto file: files) {
-        FpRAII f(file);
-        char buf[128];
-        while (fread(buf, sizeof(buf), 1, f.fp)) {
-            bool already_sent = buf[0];
-            if (exclude_sent and already_sent)
-                continue;
-            dballe::Messages msgs;
-            dballe::msg::BufrExporter exporter;
-            mqtt2bufr::Parser parser;
-
-	    char *sep = (char*)memchr( buf+1, ';', 127);
-	    
-	    std::string topic(buf + 1, sep - 1);
-            std::string payload(sep + 1, buf + 128);
-
-
-	    try {
-                dballe::Msg msg = parser.parse(topic, payload);
-                msgs.append(msg);
-                std::cout << exporter.to_binary(msgs);
-            } catch (const std::exception& e) {
-                return_value = 1;
-                std::cerr << "Error while parsing "
-                    << file << "[" << topic << " " << payload << "]"
-                    << ": " << e.what() << std::endl;
-            }
-        }
+        MappedFile f(file);
+        Converter converter(file, f, exclude_sent);
+        converter.compress = compress;
+        converter.verify = verify;
+        converter.run(threads, std::cout, std::cerr, stats);
     }
 
-    return return_value;
+    if (show_stats)
+        std::cerr << "records: " << stats.read << " read, "
+                  << stats.sent << " skipped as sent, "
+                  << stats.failed << " failed" << std::endl;
+
+    return stats.failed ? 1 : 0;
 }
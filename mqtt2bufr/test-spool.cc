@@ -0,0 +1,144 @@
+/*
+ * test-spool - Check the spool forwarding and its write errors
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <csignal>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include "spool.h"
+
+static int failures = 0;
+
+static void check(bool ok, const char* what) {
+    if (!ok) {
+        std::cerr << "FAIL: " << what << std::endl;
+        ++failures;
+    }
+}
+
+static std::string slurp(const std::string& pathname) {
+    std::ifstream in(pathname.c_str());
+    std::stringstream res;
+    res << in.rdbuf();
+    return res.str();
+}
+
+static void set_file_size_limit(rlim_t size) {
+    struct rlimit rl;
+    getrlimit(RLIMIT_FSIZE, &rl);
+    rl.rlim_cur = size;
+    setrlimit(RLIMIT_FSIZE, &rl);
+}
+
+/// Every flushed block is forwarded, in order
+static void test_forward(const std::string& dir) {
+    std::string output = dir + ".out";
+    std::string expected;
+    {
+        mqtt2bufr::Spool spool(dir, output, 1024, std::chrono::milliseconds(5));
+        mqtt2bufr::SpoolStreambuf buf(spool);
+        std::ostream out(&buf);
+        for (int i = 0; i < 1000; ++i) {
+            std::string record = "record " + std::to_string(i) + "\n";
+            expected += record;
+            out << record;
+            out.flush();
+        }
+        check(out.good(), "forward: stream good");
+        spool.close();
+    }
+    check(slurp(output) == expected, "forward: all the records forwarded in order");
+}
+
+/// A failed append leaves the stream bad, and no torn record in the spool
+static void test_append_error(const std::string& dir) {
+    std::string output = dir + ".out";
+    std::string first(100, 'a');
+    {
+        mqtt2bufr::Spool spool(dir, output, 1 << 20, std::chrono::milliseconds(0));
+        mqtt2bufr::SpoolStreambuf buf(spool);
+        std::ostream out(&buf);
+        out << first;
+        out.flush();
+        check(out.good(), "append error: first record spooled");
+
+        // Writes past the limit fail with EFBIG: room for the first record
+        // and part of the second one
+        signal(SIGXFSZ, SIG_IGN);
+        set_file_size_limit(4 + first.size() + 4 + 50);
+        out << std::string(1000, 'b');
+        out.flush();
+        set_file_size_limit(RLIM_INFINITY);
+        check(out.bad(), "append error: stream bad after the failure");
+        struct stat st;
+        check(stat((dir + "/00000000000000000001.spool").c_str(), &st) == 0 &&
+              st.st_size == (off_t)(4 + first.size()),
+              "append error: partial record truncated");
+        out << "c";
+        out.flush();
+        check(out.bad(), "append error: stream still bad");
+        spool.close();
+    }
+    check(slurp(output) == first, "append error: only the first record forwarded");
+
+    // Recovering the spool finds nothing else to forward
+    {
+        mqtt2bufr::Spool spool(dir, output, 1 << 20, std::chrono::milliseconds(0));
+        spool.append("d", 1);
+        spool.close();
+    }
+    check(slurp(output) == first + "d", "append error: no torn record after a restart");
+}
+
+int main(int argc, char** argv)
+{
+    char tmpl[] = "/tmp/test-spool.XXXXXX";
+    if (!mkdtemp(tmpl)) {
+        perror("mkdtemp");
+        return 2;
+    }
+    std::string base = tmpl;
+
+    test_forward(base + "/forward");
+    test_append_error(base + "/error");
+
+    std::string cmd = "rm -rf " + base;
+    if (system(cmd.c_str()) != 0)
+        std::cerr << "cannot remove " << base << std::endl;
+
+    if (failures) {
+        std::cerr << failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "spool: all checks passed" << std::endl;
+    return 0;
+}
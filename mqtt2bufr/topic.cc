@@ -0,0 +1,147 @@
+/*
+ * topic - MQTT topic tokenizer
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+
+#include "topic.h"
+
+#include <climits>
+#include <stdexcept>
+
+// Number of "/"-separated fields after the prefix:
+// IDENT, LON,LAT, REP_MEMO, PIND,P1,P2, LT1,L1,LT2,L2, VAR
+#define TOPIC_FIELDS 6
+
+namespace {
+
+/// Same messages reported by the former regexp-based parser.
+void throw_nomatch() {
+    throw std::runtime_error("While parsing topic: No match");
+}
+
+void throw_range() {
+    throw std::range_error("While parsing topic: Numerical result out of range");
+}
+
+/**
+ * Parse `[0-9]+` at `p`, moving `p` after the last digit.
+ */
+bool parse_uint(const char*& p, const char* end, int& val) {
+    const char* start = p;
+    long long v = 0;
+    for (; p != end && *p >= '0' && *p <= '9'; ++p) {
+        v = v * 10 + (*p - '0');
+        if (v > INT_MAX) throw_range();
+    }
+    val = (int)v;
+    return p != start;
+}
+
+/**
+ * Parse `[0-9]+|-` at `p`: "-" is a missing value.
+ */
+bool parse_uint_or_missing(const char*& p, const char* end, int& val) {
+    if (p != end && *p == '-') {
+        ++p;
+        val = dballe::MISSING_INT;
+        return true;
+    }
+    return parse_uint(p, end, val);
+}
+
+bool expect(const char*& p, const char* end, char c) {
+    if (p == end || *p != c)
+        return false;
+    ++p;
+    return true;
+}
+
+}
+
+namespace mqtt2bufr {
+
+void split_topic(const char* topic, std::size_t size, Topic& out) {
+    const char* begin = topic;
+    const char* end = topic + size;
+    // Bounds of each field, scanning backward for the "/" delimiters: the
+    // prefix is free and must end with "/" (i.e. "^.*/").
+    const char* fields[TOPIC_FIELDS];
+    const char* ends[TOPIC_FIELDS];
+    int n = TOPIC_FIELDS;
+    ends[TOPIC_FIELDS - 1] = end;
+    for (const char* p = end; p != begin && n > 0; ) {
+        --p;
+        if (*p == '/') {
+            fields[--n] = p + 1;
+            if (n > 0)
+                ends[n - 1] = p;
+        }
+    }
+    if (n > 0)
+        throw_nomatch();
+
+    const char* p;
+    const char* e;
+
+    // IDENT: [^/]+
+    if (fields[0] == ends[0]) throw_nomatch();
+    out.ident = TopicField(fields[0], ends[0] - fields[0]);
+
+    // LON,LAT: [0-9]+,[0-9]+
+    p = fields[1];
+    e = ends[1];
+    if (!parse_uint(p, e, out.lon) || !expect(p, e, ',') ||
+        !parse_uint(p, e, out.lat) || p != e)
+        throw_nomatch();
+
+    // REP_MEMO: [^/]+
+    if (fields[2] == ends[2]) throw_nomatch();
+    out.rep_memo = TopicField(fields[2], ends[2] - fields[2]);
+
+    // PIND,P1,P2: ([0-9]+|-)
+    p = fields[3];
+    e = ends[3];
+    if (!parse_uint_or_missing(p, e, out.trange.pind) || !expect(p, e, ',') ||
+        !parse_uint_or_missing(p, e, out.trange.p1) || !expect(p, e, ',') ||
+        !parse_uint_or_missing(p, e, out.trange.p2) || p != e)
+        throw_nomatch();
+
+    // LT1,L1,LT2,L2: ([0-9]+|-)
+    p = fields[4];
+    e = ends[4];
+    if (!parse_uint_or_missing(p, e, out.level.ltype1) || !expect(p, e, ',') ||
+        !parse_uint_or_missing(p, e, out.level.l1) || !expect(p, e, ',') ||
+        !parse_uint_or_missing(p, e, out.level.ltype2) || !expect(p, e, ',') ||
+        !parse_uint_or_missing(p, e, out.level.l2) || p != e)
+        throw_nomatch();
+
+    // VAR: B[0-9]{5}
+    p = fields[5];
+    if (ends[5] - p != 6 || *p != 'B') throw_nomatch();
+    for (int i = 1; i < 6; ++i)
+        if (p[i] < '0' || p[i] > '9') throw_nomatch();
+    int x = (p[1] - '0') * 10 + (p[2] - '0');
+    int y = (p[3] - '0') * 100 + (p[4] - '0') * 10 + (p[5] - '0');
+    if (x > 63 || y > 255) throw_range();
+    out.var = WR_VAR(0, x, y);
+}
+
+}
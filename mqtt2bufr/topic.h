@@ -0,0 +1,96 @@
+/*
+ * topic - MQTT topic tokenizer
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+#ifndef MQTT2BUFR_TOPIC_H
+#define MQTT2BUFR_TOPIC_H
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+
+#include <wreport/var.h>
+#include <dballe/types.h>
+
+namespace mqtt2bufr {
+
+/**
+ * Non-owning view on a portion of a topic.
+ *
+ * The referenced buffer must outlive the view.
+ */
+struct TopicField {
+    const char* data = nullptr;
+    std::size_t size = 0;
+
+    TopicField() {}
+    TopicField(const char* data, std::size_t size) : data(data), size(size) {}
+
+    bool empty() const { return size == 0; }
+    std::string str() const { return std::string(data, size); }
+
+    bool operator==(const char* s) const {
+        return strlen(s) == size && memcmp(data, s, size) == 0;
+    }
+    bool operator!=(const char* s) const { return !(*this == s); }
+};
+
+/**
+ * Decoded MQTT topic.
+ *
+ * Format: `.../IDENT/LON,LAT/REP_MEMO/PIND,P1,P2/LT1,L1,LT2,L2/VAR`
+ *
+ * Missing fields ("-") in level and time range are set to
+ * dballe::MISSING_INT.
+ */
+struct Topic {
+    TopicField ident;
+    int lon = 0;
+    int lat = 0;
+    TopicField rep_memo;
+    dballe::Trange trange;
+    dballe::Level level;
+    wreport::Varcode var = 0;
+
+    /// True if the station has an ident (i.e. is a mobile station)
+    bool has_ident() const { return ident != "-"; }
+    /// True if the topic refers to station information
+    bool is_station() const {
+        return level == dballe::Level() && trange == dballe::Trange();
+    }
+};
+
+/**
+ * Validate and split a topic in a single pass, without allocations.
+ *
+ * The fields of `out` point into `topic`.
+ *
+ * @throw std::runtime_error if the topic is not valid.
+ */
+void split_topic(const char* topic, std::size_t size, Topic& out);
+
+inline void split_topic(const std::string& topic, Topic& out) {
+    split_topic(topic.data(), topic.size(), out);
+}
+
+}
+
+#endif
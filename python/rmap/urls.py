@@ -42,6 +42,7 @@ urlpatterns = [
     url(r'^auth/auth',     rmap.views.auth),
     url(r'^auth/superuser',rmap.views.superuser),
     url(r'^auth/acl',      rmap.views.acl),
+    url(r'^auth/superacl', rmap.views.superacl),
 
 
     url(r'^accounts/profile/$',      rmap.views.profile),
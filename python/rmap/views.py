@@ -186,27 +186,46 @@ def auth(request):
     response.status_code=403
     return response
 
+def is_superuser(username):
+
+    #        user = authenticate(username=username, password=password)
+    #        if user:
+    #            if user.is_superuser:
+    #                response=HttpResponse("allow administrator")
+    #                response.status_code=200
+    #                return response
+    #            else:
+    #                response=HttpResponse("allow management")
+    #                response.status_code=403
+    #                return response
+
+    # rmap as superuser
+    return username == "rmap"
+
+def acl_allowed(username,topic,acc):
+
+    #read to all
+    if acc == "1":
+        return True
+
+    #write to all in test/#
+    if topic.startswith(("test/")) and acc == "2":
+        return True
+
+    #write to all in rmap/username/# report/username/# mobile/username/# plus new sample/username/# fixed/username/# and rpc/username/#
+    if topic.startswith(("sample/"+username+"/","rmap/"+username+"/","report/"+username+"/","maint/"+username+"/","rpc/"+username+"/")) and acc == "2":
+        return True
+
+    return False
+
 @csrf_exempt  
 def superuser(request):
 
     if 'username' in request.POST and 'password' in request.POST:
         username = request.POST['username']
-        password = request.POST['password']
-        #print username,password
+        #print username
 
-        #        user = authenticate(username=username, password=password)
-        #        if user:
-        #            if user.is_superuser:
-        #                response=HttpResponse("allow administrator")
-        #                response.status_code=200
-        #                return response
-        #            else:
-        #                response=HttpResponse("allow management")
-        #                response.status_code=403
-        #                return response
-        
-        # rmap as superuser
-        if username == "rmap":
+        if is_superuser(username):
             response=HttpResponse("allow")
             response.status_code=200
             return response
@@ -224,20 +243,25 @@ def acl(request):
         acc = request.POST['acc']
         #print username,topic,acc
 
-        #read to all
-        if acc == "1":
+        if acl_allowed(username,topic,acc):
             response=HttpResponse("allow")
             response.status_code=200
             return response
 
-        #write to all in test/#
-        if topic.startswith(("test/")) and acc == "2":
-            response=HttpResponse("allow")
-            response.status_code=200
-            return response
+    response=HttpResponse("deny")
+    response.status_code=403
+    return response
+
+@csrf_exempt  
+def superacl(request):
+    # superuser and acl check in one request (auth_opt_http_superacl_uri)
+
+    if 'username' in request.POST and 'topic' in request.POST and 'acc' in request.POST :
+        username = request.POST['username']
+        topic = request.POST['topic']
+        acc = request.POST['acc']
 
-        #write to all in rmap/username/# report/username/# mobile/username/# plus new sample/username/# fixed/username/# and rpc/username/#
-        if topic.startswith(("sample/"+username+"/","rmap/"+username+"/","report/"+username+"/","maint/"+username+"/","rpc/"+username+"/")) and acc == "2":
+        if is_superuser(username) or acl_allowed(username,topic,acc):
             response=HttpResponse("allow")
             response.status_code=200
             return response